@@ -0,0 +1,64 @@
+#pragma once
+#include <wut.h>
+
+/**
+ * \defgroup coreinit_interrupts Interrupts
+ * \ingroup coreinit
+ *
+ * Enable and disable external interrupts, such as alarms, on the current core.
+ *
+ * Disabling interrupts also prevents the current thread from being pre-empted
+ * or moved to another core until they are restored. A thread which goes to
+ * sleep with interrupts disabled will have them disabled again when it wakes.
+ * @{
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/**
+ * Enable interrupts on the current core.
+ *
+ * \returns
+ * \c TRUE if interrupts were previously enabled.
+ */
+BOOL
+OSEnableInterrupts();
+
+
+/**
+ * Disable interrupts on the current core.
+ *
+ * \returns
+ * \c TRUE if interrupts were previously enabled, to be passed to
+ * OSRestoreInterrupts.
+ */
+BOOL
+OSDisableInterrupts();
+
+
+/**
+ * Restore the interrupt state returned by OSDisableInterrupts or
+ * OSEnableInterrupts.
+ *
+ * \returns
+ * \c TRUE if interrupts were enabled before this call.
+ */
+BOOL
+OSRestoreInterrupts(BOOL enable);
+
+
+/**
+ * Determines whether interrupts are enabled on the current core.
+ */
+BOOL
+OSIsInterruptEnabled();
+
+
+#ifdef __cplusplus
+}
+#endif
+
+/** @} */
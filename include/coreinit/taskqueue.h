@@ -1,5 +1,6 @@
 #pragma once
 #include <wut.h>
+#include "spinlock.h"
 #include "time.h"
 
 /**
@@ -22,6 +22,7 @@ extern "C" {
 #define GX2_SHADER_PROGRAM_ALIGNMENT        (0x100)
 #define GX2_VERTEX_BUFFER_ALIGNMENT         (0x40)
 #define GX2_INDEX_BUFFER_ALIGNMENT          (0x20)
+#define GX2_DISPLAY_LIST_ALIGNMENT          (0x20)
 
 #define GX2_COMMAND_BUFFER_SIZE             (0x400000)
 
@@ -72,6 +72,25 @@ GX2GetSwapStatus(uint32_t *swapCount,
 BOOL
 GX2WaitTimeStamp(OSTime time);
 
+/**
+ * Write the GPU clock to result when the command reaches the top of the
+ * pipeline, i.e. when the GPU starts processing it.
+ */
+void
+GX2SampleTopGPUCycle(uint64_t *result);
+
+/**
+ * Write the GPU clock to result once all previous commands have completed.
+ */
+void
+GX2SampleBottomGPUCycle(uint64_t *result);
+
+OSTime
+GX2GPUTimeToCPUTime(uint64_t time);
+
+uint64_t
+GX2CPUTimeToGPUTime(OSTime time);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,130 @@
+#pragma once
+#include <wut.h>
+#include <coreinit/thread.h>
+
+/**
+ * \defgroup wut_thread Thread Attributes
+ *
+ * Control the OSThread created for each std::thread.
+ *
+ * By default every std::thread is created with a 4 MiB stack, priority 16 and
+ * may run on any core. The process-wide default can be replaced with
+ * WUTSetDefaultThreadAttributes, and a single thread can be given its own
+ * attributes by calling WUTSetNextThreadAttributes just before it is created:
+ *
+ * \code
+ * WUTThreadAttributes attribs;
+ * WUTGetDefaultThreadAttributes(&attribs);
+ * attribs.stackSize = 64 * 1024;
+ * attribs.attributes = OS_THREAD_ATTRIB_AFFINITY_CPU2;
+ * attribs.name = "AudioMixer";
+ *
+ * WUTSetNextThreadAttributes(&attribs);
+ * std::thread mixer(mixerMain);
+ * \endcode
+ *
+ * The OSThread and stack of an exited std::thread are kept in a small pool and
+ * reused by the next thread created with the same stack size, so short-lived
+ * threads do not churn the default heap. The pool size can be changed with
+ * WUTSetThreadPoolLimit.
+ *
+ * std::mutex and std::condition_variable are backed by OSMutex and
+ * OSCondition by default. Applications which mostly lock uncontended mutexes
+ * can instead select the lighter OSFastMutex and OSFastCondition at link
+ * time by defining __wut_thread_use_fast_mutex:
+ *
+ * \code
+ * extern "C" BOOL __wut_thread_use_fast_mutex = TRUE;
+ * \endcode
+ *
+ * @{
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct WUTThreadAttributes WUTThreadAttributes;
+
+//! Stack size used for std::thread unless overridden.
+#define WUT_THREAD_DEFAULT_STACK_SIZE (4096 * 1024)
+
+//! Priority used for std::thread unless overridden.
+#define WUT_THREAD_DEFAULT_PRIORITY (16)
+
+//! Smallest stack size accepted for a std::thread.
+#define WUT_THREAD_MIN_STACK_SIZE (4096)
+
+//! Largest stack size accepted for a std::thread.
+#define WUT_THREAD_MAX_STACK_SIZE (256 * 1024 * 1024)
+
+struct WUTThreadAttributes
+{
+   //! Size of the stack to allocate for the thread, in bytes.
+   uint32_t stackSize;
+
+   //! Thread priority, 0 is highest priority, 31 is lowest.
+   int32_t priority;
+
+   //! Affinity mask and flags, see OS_THREAD_ATTRIB.
+   OSThreadAttributes attributes;
+
+   //! Thread name, must remain valid for the lifetime of the thread. May be NULL.
+   const char *name;
+};
+
+/**
+ * Fill attribs with the current process-wide default thread attributes.
+ */
+void
+WUTGetDefaultThreadAttributes(WUTThreadAttributes *attribs);
+
+/**
+ * Set the process-wide default attributes used for new threads.
+ *
+ * This does not affect threads which have already been created, and should
+ * be called before any other thread may be creating a std::thread.
+ *
+ * \returns FALSE if the attributes are invalid, in which case the defaults
+ * are left unchanged.
+ */
+BOOL
+WUTSetDefaultThreadAttributes(const WUTThreadAttributes *attribs);
+
+/**
+ * Set the attributes used for the next thread created by the calling thread.
+ *
+ * The attributes are consumed by the next std::thread constructed on the
+ * calling thread, after which the process-wide defaults apply again. The
+ * structure is copied. Passing NULL clears any pending attributes.
+ *
+ * \returns FALSE if the attributes are invalid or could not be stored.
+ */
+BOOL
+WUTSetNextThreadAttributes(const WUTThreadAttributes *attribs);
+
+/**
+ * Set how many exited threads may be kept for reuse.
+ *
+ * Threads beyond either limit are freed lazily, the next time a thread is
+ * created or when WUTTrimThreadPool is called. Defaults to 4 threads and
+ * 16 MiB of stack.
+ *
+ * \param maxThreads Maximum number of pooled threads, 0 disables pooling.
+ * \param maxBytes Maximum total size of pooled stacks, in bytes.
+ */
+void
+WUTSetThreadPoolLimit(uint32_t maxThreads,
+                      uint32_t maxBytes);
+
+/**
+ * Immediately free every thread held in the pool.
+ */
+void
+WUTTrimThreadPool();
+
+#ifdef __cplusplus
+}
+#endif
+
+/** @} */
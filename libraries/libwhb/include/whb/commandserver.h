@@ -4,6 +4,17 @@
 /**
  * \defgroup whb_commandserver Network Command Server
  * \ingroup whb
+ *
+ * TCP server which runs on its own thread and serves several clients at once
+ * using non-blocking sockets and select, so it never stalls the game loop.
+ *
+ * Every message in either direction is a frame of a big endian uint32_t size
+ * of the rest of the frame, a big endian uint32_t command id and then size - 4
+ * bytes of payload. Frames are dispatched to the handler registered for their
+ * command on the server thread. Frames with no handler are kept for
+ * WHBCommandServerListen, or dropped if it already has one waiting.
+ *
+ * share/whb_command_client.py is an example client.
  * @{
  */
 
@@ -11,14 +22,60 @@
 extern "C" {
 #endif
 
-#define WHB_SERVER_BUFFER_SIZE 1024
+#define WHB_SERVER_PORT             4406
+#define WHB_SERVER_MAX_CLIENTS      8
+#define WHB_SERVER_MAX_COMMANDS     32
+//! Largest frame payload which can be received.
+#define WHB_SERVER_BUFFER_SIZE      1024
+#define WHB_SERVER_THREAD_PRIORITY  20
+
+/**
+ * Called on the server thread for each received frame, client identifies the
+ * connection for WHBCommandServerSend.
+ */
+typedef void (*WHBCommandHandlerFn)(int32_t client,
+                                    uint32_t command,
+                                    const void *data,
+                                    uint32_t size,
+                                    void *userData);
 
 BOOL
 WHBCommandServerInit();
 
+BOOL
+WHBCommandServerInitEx(uint16_t port,
+                       int32_t priority);
+
 void
 WHBCommandServerStop();
 
+BOOL
+WHBCommandServerRegister(uint32_t command,
+                         WHBCommandHandlerFn fn,
+                         void *userData);
+
+BOOL
+WHBCommandServerUnregister(uint32_t command);
+
+/**
+ * Send a frame to client, may be called from any thread.
+ *
+ * Frames to the same client are sent one at a time. If the client is not
+ * reading, this waits up to about 100ms for room in its socket buffer before
+ * failing, and other senders to that client wait with it.
+ */
+BOOL
+WHBCommandServerSend(int32_t client,
+                     uint32_t command,
+                     const void *data,
+                     uint32_t size);
+
+/**
+ * Wait for a frame with no registered handler and copy its payload, null
+ * terminated, to stringLocation which must hold WHB_SERVER_BUFFER_SIZE bytes.
+ *
+ * Returns FALSE once the server is stopped.
+ */
 BOOL
 WHBCommandServerListen(char * stringLocation);
 
@@ -0,0 +1,624 @@
+#pragma once
+#include <wut.h>
+#include <coreinit/alarm.h>
+#include <coreinit/event.h>
+#include <coreinit/filesystem.h>
+#include <coreinit/memdefaultheap.h>
+#include <coreinit/messagequeue.h>
+#include <coreinit/spinlock.h>
+#include <coreinit/thread.h>
+#include <coreinit/time.h>
+#include <gx2/event.h>
+
+/**
+ * \defgroup whb_coro C++20 Coroutines
+ * \ingroup whb
+ *
+ * Header-only C++20 coroutine executor and awaitables for asynchronous Cafe
+ * operations. Requires the application to be compiled with -std=c++20.
+ *
+ * The executor runs one thread pinned to each core. A coroutine awaiting an
+ * operation is resumed on the core it suspended on, from the completion
+ * callback (FS, OSAlarm) or by the executor polling the operation while idle
+ * (GPU timestamps, OSMessageQueue), so no thread is blocked per operation.
+ *
+ * \code
+ * whb::coro::task<void> loadLevel(FSClient *client, FSCmdBlock *block)
+ * {
+ *    FSFileHandle handle;
+ *    FSStatus status = co_await whb::coro::fs_async([&](FSAsyncData *async) {
+ *       return FSOpenFileAsync(client, block, "/vol/content/level.bin", "r",
+ *                              &handle, FS_ERROR_FLAG_ALL, async);
+ *    });
+ *    co_await whb::coro::sleep_for(OSMillisecondsToTicks(16));
+ *    ...
+ * }
+ *
+ * whb::coro::start(16, 64 * 1024);
+ * whb::coro::spawn(loadLevel(client, block));
+ * \endcode
+ * @{
+ */
+
+#if defined(__cplusplus) && defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+namespace whb::coro
+{
+
+static constexpr int NumWorkers = 3;
+
+//! Intrusive queue entry for a coroutine waiting to be resumed.
+struct work_item
+{
+   work_item *next = nullptr;
+   std::coroutine_handle<> handle;
+};
+
+//! An operation the executor polls for completion while it is idle.
+struct poll_item : work_item
+{
+   poll_item *nextPoll = nullptr;
+   virtual bool poll() = 0;
+};
+
+namespace detail
+{
+
+struct worker
+{
+   OSThread thread;
+   OSEvent event;
+   OSSpinLock lock;
+   work_item *head;
+   work_item *tail;
+   poll_item *pollers;
+   void *stack;
+   int core;
+};
+
+inline worker *sWorkers[NumWorkers] = { };
+inline volatile bool sRunning = false;
+inline uint32_t sNextCore = 0;
+
+//! How often idle workers check polled operations.
+inline OSTime sPollInterval = 0;
+
+inline worker *
+current_worker()
+{
+   OSThread *thread = OSGetCurrentThread();
+
+   for (int i = 0; i < NumWorkers; ++i) {
+      if (sWorkers[i] && &sWorkers[i]->thread == thread) {
+         return sWorkers[i];
+      }
+   }
+
+   return nullptr;
+}
+
+//! Returns nullptr when the executor is not running.
+inline worker *
+pick_worker(int core)
+{
+   if (core >= 0 && core < NumWorkers) {
+      return sWorkers[core];
+   }
+
+   if (worker *self = current_worker()) {
+      return self;
+   }
+
+   return sWorkers[sNextCore++ % NumWorkers];
+}
+
+inline void
+push(worker *w, work_item *item)
+{
+   item->next = nullptr;
+
+   // May be called from interrupt context, such as an alarm callback.
+   OSUninterruptibleSpinLock_Acquire(&w->lock);
+   if (w->tail) {
+      w->tail->next = item;
+   } else {
+      w->head = item;
+   }
+   w->tail = item;
+   OSUninterruptibleSpinLock_Release(&w->lock);
+
+   OSSignalEvent(&w->event);
+}
+
+inline work_item *
+pop(worker *w)
+{
+   OSUninterruptibleSpinLock_Acquire(&w->lock);
+   work_item *item = w->head;
+   if (item) {
+      w->head = item->next;
+      if (!w->head) {
+         w->tail = nullptr;
+      }
+   }
+   OSUninterruptibleSpinLock_Release(&w->lock);
+   return item;
+}
+
+inline void
+run_pollers(worker *w)
+{
+   poll_item **link = &w->pollers;
+
+   while (poll_item *item = *link) {
+      if (item->poll()) {
+         *link = item->nextPoll;
+         item->handle.resume();
+      } else {
+         link = &item->nextPoll;
+      }
+   }
+}
+
+inline int
+worker_main(int argc, const char **argv)
+{
+   worker *w = reinterpret_cast<worker *>(argv);
+
+   while (sRunning) {
+      if (work_item *item = pop(w)) {
+         item->handle.resume();
+      }
+
+      if (w->pollers) {
+         run_pollers(w);
+      }
+
+      if (!w->head) {
+         if (w->pollers) {
+            OSWaitEventWithTimeout(&w->event, sPollInterval);
+         } else {
+            OSWaitEvent(&w->event);
+         }
+      }
+   }
+
+   return 0;
+}
+
+struct promise_base
+{
+   std::coroutine_handle<> continuation = std::noop_coroutine();
+
+   struct final_awaiter
+   {
+      bool await_ready() noexcept { return false; }
+
+      template<typename Promise>
+      std::coroutine_handle<>
+      await_suspend(std::coroutine_handle<Promise> h) noexcept
+      {
+         return h.promise().continuation;
+      }
+
+      void await_resume() noexcept { }
+   };
+
+   std::suspend_always initial_suspend() noexcept { return { }; }
+   final_awaiter final_suspend() noexcept { return { }; }
+   void unhandled_exception() noexcept { std::terminate(); }
+};
+
+} // namespace detail
+
+inline void
+stop();
+
+/**
+ * Start the executor threads, one per core.
+ */
+inline bool
+start(int32_t priority, uint32_t stackSize,
+      OSTime pollInterval = OSMicrosecondsToTicks(500))
+{
+   if (detail::sRunning) {
+      return true;
+   }
+
+   detail::sRunning = true;
+   detail::sPollInterval = pollInterval;
+
+   for (int i = 0; i < NumWorkers; ++i) {
+      auto w = static_cast<detail::worker *>(MEMAllocFromDefaultHeapEx(sizeof(detail::worker), 16));
+      void *stack = MEMAllocFromDefaultHeapEx(stackSize, 16);
+      if (!w || !stack) {
+         if (w) {
+            MEMFreeToDefaultHeap(w);
+         }
+         if (stack) {
+            MEMFreeToDefaultHeap(stack);
+         }
+         stop();
+         return false;
+      }
+
+      *w = { };
+      w->stack = stack;
+      w->core = i;
+      OSInitEvent(&w->event, FALSE, OS_EVENT_MODE_AUTO);
+      OSInitSpinLock(&w->lock);
+
+      if (!OSCreateThread(&w->thread, &detail::worker_main, 0,
+                          reinterpret_cast<char *>(w),
+                          static_cast<uint8_t *>(stack) + stackSize, stackSize,
+                          priority,
+                          static_cast<OSThreadAttributes>(OS_THREAD_ATTRIB_AFFINITY_CPU0 << i))) {
+         MEMFreeToDefaultHeap(w);
+         MEMFreeToDefaultHeap(stack);
+         stop();
+         return false;
+      }
+
+      OSSetThreadName(&w->thread, "WHBCoroExecutor");
+      detail::sWorkers[i] = w;
+      OSResumeThread(&w->thread);
+   }
+
+   return true;
+}
+
+/**
+ * Stop the executor threads, suspended coroutines are not resumed.
+ */
+inline void
+stop()
+{
+   detail::sRunning = false;
+
+   for (int i = 0; i < NumWorkers; ++i) {
+      if (detail::worker *w = detail::sWorkers[i]) {
+         OSSignalEvent(&w->event);
+         OSJoinThread(&w->thread, nullptr);
+         MEMFreeToDefaultHeap(w->stack);
+         MEMFreeToDefaultHeap(w);
+         detail::sWorkers[i] = nullptr;
+      }
+   }
+}
+
+/**
+ * Queue item to be resumed on an executor thread, core -1 means the current
+ * core if called from the executor, otherwise any. Returns false, without
+ * queueing, when the executor is not running.
+ */
+inline bool
+post(work_item *item, int core = -1)
+{
+   detail::worker *w = detail::pick_worker(core);
+   if (!w) {
+      return false;
+   }
+
+   detail::push(w, item);
+   return true;
+}
+
+//! Current executor core, or -1 when not on an executor thread.
+inline int
+current_core()
+{
+   detail::worker *w = detail::current_worker();
+   return w ? w->core : -1;
+}
+
+/**
+ * A lazily started coroutine which produces a T when awaited.
+ */
+template<typename T = void>
+class task
+{
+public:
+   struct promise_type : detail::promise_base
+   {
+      std::optional<T> value;
+
+      task get_return_object()
+      {
+         return task { std::coroutine_handle<promise_type>::from_promise(*this) };
+      }
+
+      template<typename U>
+      void return_value(U &&v)
+      {
+         value.emplace(std::forward<U>(v));
+      }
+   };
+
+   task(task &&other) noexcept : mHandle(std::exchange(other.mHandle, nullptr)) { }
+   task(const task &) = delete;
+   ~task() { if (mHandle) { mHandle.destroy(); } }
+
+   bool await_ready() const noexcept { return false; }
+
+   std::coroutine_handle<>
+   await_suspend(std::coroutine_handle<> awaiting) noexcept
+   {
+      mHandle.promise().continuation = awaiting;
+      return mHandle;
+   }
+
+   T await_resume() { return std::move(*mHandle.promise().value); }
+
+private:
+   explicit task(std::coroutine_handle<promise_type> h) : mHandle(h) { }
+   std::coroutine_handle<promise_type> mHandle;
+};
+
+template<>
+class task<void>
+{
+public:
+   struct promise_type : detail::promise_base
+   {
+      task get_return_object()
+      {
+         return task { std::coroutine_handle<promise_type>::from_promise(*this) };
+      }
+
+      void return_void() { }
+   };
+
+   task(task &&other) noexcept : mHandle(std::exchange(other.mHandle, nullptr)) { }
+   task(const task &) = delete;
+   ~task() { if (mHandle) { mHandle.destroy(); } }
+
+   bool await_ready() const noexcept { return false; }
+
+   std::coroutine_handle<>
+   await_suspend(std::coroutine_handle<> awaiting) noexcept
+   {
+      mHandle.promise().continuation = awaiting;
+      return mHandle;
+   }
+
+   void await_resume() { }
+
+private:
+   explicit task(std::coroutine_handle<promise_type> h) : mHandle(h) { }
+   std::coroutine_handle<promise_type> mHandle;
+};
+
+/**
+ * Awaitable which moves the coroutine onto an executor thread. When the
+ * executor is not running the coroutine carries on where it is.
+ */
+class schedule
+{
+public:
+   explicit schedule(int core = -1) : mCore(core) { }
+
+   bool await_ready() const noexcept
+   {
+      return mCore < 0 ? current_core() >= 0 : current_core() == mCore;
+   }
+
+   bool
+   await_suspend(std::coroutine_handle<> h)
+   {
+      mItem.handle = h;
+      return post(&mItem, mCore);
+   }
+
+   void await_resume() noexcept { }
+
+private:
+   int mCore;
+   work_item mItem;
+};
+
+namespace detail
+{
+
+struct detached
+{
+   struct promise_type
+   {
+      detached get_return_object() noexcept { return { }; }
+      std::suspend_never initial_suspend() noexcept { return { }; }
+      std::suspend_never final_suspend() noexcept { return { }; }
+      void return_void() noexcept { }
+      void unhandled_exception() noexcept { std::terminate(); }
+   };
+};
+
+inline detached
+run_detached(task<void> t, int core)
+{
+   co_await schedule(core);
+   co_await t;
+}
+
+} // namespace detail
+
+/**
+ * Run a task to completion on the executor without waiting for it.
+ */
+inline void
+spawn(task<void> t, int core = -1)
+{
+   detail::run_detached(std::move(t), core);
+}
+
+/**
+ * Awaitable which resumes after ticks have elapsed, using an OSAlarm.
+ */
+class sleep_for
+{
+public:
+   explicit sleep_for(OSTime ticks) : mTicks(ticks) { }
+
+   bool await_ready() const noexcept { return mTicks <= 0; }
+
+   void
+   await_suspend(std::coroutine_handle<> h)
+   {
+      mItem.handle = h;
+      mCore = current_core();
+      OSCreateAlarm(&mAlarm);
+      OSSetAlarmUserData(&mAlarm, this);
+      OSSetAlarm(&mAlarm, mTicks, &callback);
+   }
+
+   void await_resume() noexcept { }
+
+private:
+   static void
+   callback(OSAlarm *alarm, OSContext *context)
+   {
+      auto self = static_cast<sleep_for *>(OSGetAlarmUserData(alarm));
+      post(&self->mItem, self->mCore);
+   }
+
+   OSTime mTicks;
+   OSAlarm mAlarm;
+   work_item mItem;
+   int mCore = -1;
+};
+
+/**
+ * Awaitable for an FS*Async call, start is called with the FSAsyncData to
+ * pass to the call and must return its FSStatus. Resumes with the status of
+ * the completed operation.
+ */
+template<typename Start>
+class fs_operation
+{
+public:
+   explicit fs_operation(Start start) : mStart(std::move(start)) { }
+
+   bool await_ready() const noexcept { return false; }
+
+   bool
+   await_suspend(std::coroutine_handle<> h)
+   {
+      mItem.handle = h;
+      mCore = current_core();
+      mAsync.callback = &callback;
+      mAsync.param = reinterpret_cast<uint32_t>(this);
+      mAsync.ioMsgQueue = nullptr;
+
+      // Once queued the callback may resume us on another thread at any
+      // time, so do not touch any members after a successful start.
+      FSStatus status = mStart(&mAsync);
+      if (status < 0) {
+         mStatus = status;
+         return false;
+      }
+
+      return true;
+   }
+
+   FSStatus await_resume() const noexcept { return mStatus; }
+
+private:
+   static void
+   callback(FSClient *client, FSCmdBlock *block, FSStatus status, uint32_t param)
+   {
+      auto self = reinterpret_cast<fs_operation *>(param);
+      self->mStatus = status;
+      post(&self->mItem, self->mCore);
+   }
+
+   Start mStart;
+   FSAsyncData mAsync;
+   FSStatus mStatus = FS_STATUS_OK;
+   work_item mItem;
+   int mCore = -1;
+};
+
+template<typename Start>
+inline fs_operation<Start>
+fs_async(Start start)
+{
+   return fs_operation<Start>(std::move(start));
+}
+
+/**
+ * Base for awaitables polled by the executor. On a thread which is not an
+ * executor thread there is no one to poll, so the calling thread polls
+ * until the operation completes.
+ */
+template<typename Derived>
+class polled_operation : public poll_item
+{
+public:
+   bool await_ready() { return static_cast<Derived *>(this)->poll(); }
+
+   bool
+   await_suspend(std::coroutine_handle<> h)
+   {
+      detail::worker *w = detail::current_worker();
+      if (!w) {
+         OSTime interval = detail::sPollInterval ? detail::sPollInterval :
+                                                   OSMicrosecondsToTicks(500);
+         while (!static_cast<Derived *>(this)->poll()) {
+            OSSleepTicks(interval);
+         }
+
+         return false;
+      }
+
+      handle = h;
+      nextPoll = w->pollers;
+      w->pollers = this;
+      return true;
+   }
+};
+
+/**
+ * Awaitable which resumes once the GPU has retired the given timestamp, as
+ * returned by GX2GetLastSubmittedTimeStamp.
+ */
+class gpu_timestamp : public polled_operation<gpu_timestamp>
+{
+public:
+   explicit gpu_timestamp(OSTime timestamp) : mTimestamp(timestamp) { }
+
+   bool poll() override { return GX2GetRetiredTimeStamp() >= mTimestamp; }
+   void await_resume() noexcept { }
+
+private:
+   OSTime mTimestamp;
+};
+
+/**
+ * Awaitable which resumes with the next message received on queue.
+ */
+class receive_message : public polled_operation<receive_message>
+{
+public:
+   explicit receive_message(OSMessageQueue *queue) : mQueue(queue) { }
+
+   bool
+   poll() override
+   {
+      return OSReceiveMessage(mQueue, &mMessage, OS_MESSAGE_FLAGS_NONE);
+   }
+
+   OSMessage await_resume() noexcept { return mMessage; }
+
+private:
+   OSMessageQueue *mQueue;
+   OSMessage mMessage;
+};
+
+} // namespace whb::coro
+
+#endif // if defined(__cplusplus) && defined(__cpp_impl_coroutine)
+
+/** @} */
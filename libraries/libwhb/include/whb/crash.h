@@ -1,9 +1,27 @@
 #pragma once
 #include <wut.h>
+#include <coreinit/time.h>
 
 /**
  * \defgroup whb_crash Crash Handler
  * \ingroup whb
+ *
+ * When a minidump is enabled the crash handler also captures a compact binary
+ * dump, written to the SD card and/or sent over UDP. Use share/whb_minidump.py
+ * to receive dumps and symbolize them against the application's .elf.
+ *
+ * A dump is a WHBMinidumpHeader followed by numSections sections, each a
+ * WHBMinidumpSection followed by size bytes padded to a multiple of 4, all big
+ * endian:
+ * - WHB_MINIDUMP_SECTION_CONTEXT: WHBMinidumpContext of the crashing thread.
+ * - WHB_MINIDUMP_SECTION_THREAD: WHBMinidumpThread for every active thread,
+ *   followed by stackSize bytes of its stack starting at the stack pointer.
+ * - WHB_MINIDUMP_SECTION_MEMORY: uint32_t address followed by the contents of
+ *   a range added with WHBCrashMinidumpAddRange.
+ * - WHB_MINIDUMP_SECTION_LOG: the most recent log output, oldest first.
+ *
+ * Over UDP the dump is split into datagrams each starting with a
+ * WHBMinidumpChunk.
  * @{
  */
 
@@ -11,9 +29,141 @@
 extern "C" {
 #endif
 
+#define WHB_MINIDUMP_MAGIC          0x57444D50
+#define WHB_MINIDUMP_CHUNK_MAGIC    0x57444D43
+#define WHB_MINIDUMP_VERSION        1
+#define WHB_MINIDUMP_PORT           4408
+#define WHB_MINIDUMP_CHUNK_SIZE     1024
+#define WHB_MINIDUMP_MAX_RANGES     8
+#define WHB_MINIDUMP_MAX_STACK      0x2000
+#define WHB_MINIDUMP_LOG_SIZE       0x1000
+
+typedef struct WHBMinidumpHeader WHBMinidumpHeader;
+typedef struct WHBMinidumpSection WHBMinidumpSection;
+typedef struct WHBMinidumpContext WHBMinidumpContext;
+typedef struct WHBMinidumpThread WHBMinidumpThread;
+typedef struct WHBMinidumpChunk WHBMinidumpChunk;
+
+typedef enum WHBMinidumpOutput
+{
+   WHB_MINIDUMP_OUTPUT_SDCARD       = 1 << 0,
+   WHB_MINIDUMP_OUTPUT_UDP          = 1 << 1,
+} WHBMinidumpOutput;
+
+typedef enum WHBMinidumpSectionType
+{
+   WHB_MINIDUMP_SECTION_CONTEXT     = 1,
+   WHB_MINIDUMP_SECTION_THREAD      = 2,
+   WHB_MINIDUMP_SECTION_MEMORY      = 3,
+   WHB_MINIDUMP_SECTION_LOG         = 4,
+} WHBMinidumpSectionType;
+
+struct WHBMinidumpHeader
+{
+   uint32_t magic;
+   uint32_t version;
+   //! Total size of the dump including this header.
+   uint32_t size;
+   //! OSExceptionType of the crash.
+   uint32_t exceptionType;
+   OSTime time;
+   uint32_t core;
+   uint32_t upid;
+   //! Run time address of WHBInitCrashHandler, used to relocate symbols.
+   uint32_t textAnchor;
+   uint32_t numSections;
+};
+WUT_CHECK_OFFSET(WHBMinidumpHeader, 0x10, time);
+WUT_CHECK_OFFSET(WHBMinidumpHeader, 0x20, textAnchor);
+WUT_CHECK_SIZE(WHBMinidumpHeader, 0x28);
+
+struct WHBMinidumpSection
+{
+   uint16_t type;
+   uint16_t flags;
+   uint32_t size;
+};
+WUT_CHECK_SIZE(WHBMinidumpSection, 0x08);
+
+struct WHBMinidumpContext
+{
+   uint32_t gpr[32];
+   uint32_t cr;
+   uint32_t lr;
+   uint32_t ctr;
+   uint32_t xer;
+   uint32_t srr0;
+   uint32_t srr1;
+   uint32_t dsisr;
+   uint32_t dar;
+   uint32_t fpscr;
+   uint32_t gqr[8];
+   //! The crashing OSThread.
+   uint32_t thread;
+   uint64_t fpr[32];
+   uint64_t psf[32];
+};
+WUT_CHECK_OFFSET(WHBMinidumpContext, 0x80, cr);
+WUT_CHECK_OFFSET(WHBMinidumpContext, 0xC4, thread);
+WUT_CHECK_OFFSET(WHBMinidumpContext, 0xC8, fpr);
+WUT_CHECK_SIZE(WHBMinidumpContext, 0x2C8);
+
+struct WHBMinidumpThread
+{
+   uint32_t thread;
+   uint32_t stackStart;
+   uint32_t stackEnd;
+   uint32_t sp;
+   uint32_t lr;
+   uint32_t pc;
+   int32_t priority;
+   uint8_t state;
+   uint8_t attr;
+   uint16_t id;
+   //! Number of stack bytes which follow, starting at sp.
+   uint32_t stackSize;
+   char name[32];
+};
+WUT_CHECK_OFFSET(WHBMinidumpThread, 0x18, priority);
+WUT_CHECK_OFFSET(WHBMinidumpThread, 0x20, stackSize);
+WUT_CHECK_SIZE(WHBMinidumpThread, 0x44);
+
+struct WHBMinidumpChunk
+{
+   uint32_t magic;
+   //! Identifies the dump, the low 32 bits of its WHBMinidumpHeader time.
+   uint32_t id;
+   uint32_t offset;
+   uint32_t totalSize;
+};
+WUT_CHECK_SIZE(WHBMinidumpChunk, 0x10);
+
 BOOL
 WHBInitCrashHandler();
 
+/**
+ * Capture a minidump of up to bufferSize bytes on crash and write it to the
+ * outputs given as a mask of WHBMinidumpOutput. The buffer is allocated up
+ * front, UDP dumps are broadcast to WHB_MINIDUMP_PORT by default.
+ */
+BOOL
+WHBCrashEnableMinidump(uint32_t bufferSize,
+                       uint32_t outputs);
+
+void
+WHBCrashDisableMinidump();
+
+BOOL
+WHBCrashMinidumpSetUdpTarget(uint32_t address,
+                             uint16_t port);
+
+/**
+ * Include the contents of a memory range in the minidump.
+ */
+BOOL
+WHBCrashMinidumpAddRange(const void *address,
+                         uint32_t size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,104 @@
+#pragma once
+#include <wut.h>
+
+/**
+ * \defgroup whb_fiber Fiber Job System
+ * \ingroup whb
+ *
+ * Cooperative job system which runs jobs on a pool of fibers, built on
+ * OSSwitchCoroutine, with one scheduler thread pinned to each core.
+ *
+ * A job may wait for a WHBFiberCounter to drop to a target value with
+ * WHBFiberWaitForCounter. This suspends only the fiber, the scheduler thread
+ * goes on to run other jobs and the fiber is resumed, possibly on another
+ * core, once the counter reaches the target. Counters are decremented as jobs
+ * finish, or manually with WHBFiberCounterDecrement, for example from an
+ * asynchronous I/O callback.
+ *
+ * As a fiber may resume on a different thread, jobs must not hold an OSMutex
+ * or use OS thread specific data across a wait.
+ * @{
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WHB_FIBER_NUM_SCHEDULERS 3
+#define WHB_FIBER_JOB_QUEUE_SIZE 1024
+
+typedef struct WHBFiber WHBFiber;
+typedef struct WHBFiberCounter WHBFiberCounter;
+typedef struct WHBFiberJob WHBFiberJob;
+typedef struct WHBFiberThreadWaiter WHBFiberThreadWaiter;
+
+typedef void (*WHBFiberJobFn)(void *arg);
+
+struct WHBFiberCounter
+{
+   volatile int32_t value;
+   WHBFiber *waiters;
+   WHBFiberThreadWaiter *threadWaiters;
+};
+
+struct WHBFiberJob
+{
+   WHBFiberJobFn fn;
+   void *arg;
+   WHBFiberCounter *counter;
+};
+
+BOOL
+WHBFiberSystemInit(uint32_t numFibers,
+                   uint32_t fiberStackSize,
+                   int32_t priority);
+
+void
+WHBFiberSystemShutdown();
+
+void
+WHBFiberCounterInit(WHBFiberCounter *counter);
+
+void
+WHBFiberCounterAdd(WHBFiberCounter *counter,
+                   int32_t value);
+
+void
+WHBFiberCounterDecrement(WHBFiberCounter *counter);
+
+int32_t
+WHBFiberCounterGet(WHBFiberCounter *counter);
+
+/**
+ * Queue jobs to run, counter (which may be NULL) is incremented by count and
+ * decremented as each job finishes.
+ */
+void
+WHBFiberRunJobs(WHBFiberJob *jobs,
+                uint32_t count,
+                WHBFiberCounter *counter);
+
+/**
+ * Wait until counter is less than or equal to target.
+ *
+ * From a job this suspends the fiber, from any other thread it blocks on an
+ * OSEvent which is signalled once the counter reaches the target.
+ */
+void
+WHBFiberWaitForCounter(WHBFiberCounter *counter,
+                       int32_t target);
+
+/**
+ * Move the current fiber to the back of the ready queue.
+ */
+void
+WHBFiberYield();
+
+BOOL
+WHBFiberIsInJob();
+
+#ifdef __cplusplus
+}
+#endif
+
+/** @} */
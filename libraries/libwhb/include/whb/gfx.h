@@ -1,5 +1,7 @@
 #pragma once
 #include <wut.h>
+#include <coreinit/time.h>
+#include <gx2/enum.h>
 #include <gx2/shaders.h>
 #include <gx2/texture.h>
 
@@ -14,6 +16,114 @@ extern "C" {
 #endif
 
 typedef struct WHBGfxShaderGroup WHBGfxShaderGroup;
+typedef struct WHBGfxConfig WHBGfxConfig;
+typedef struct WHBGfxFrameStats WHBGfxFrameStats;
+typedef struct WHBGfxCommandBufferStats WHBGfxCommandBufferStats;
+typedef struct WHBGfxProfilerPass WHBGfxProfilerPass;
+typedef struct WHBGfxDisplayList WHBGfxDisplayList;
+
+#define WHB_GFX_MAX_FRAMES_IN_FLIGHT 3
+#define WHB_GFX_DEFAULT_COMMAND_BUFFER_POOL_SIZE 0x400000
+
+typedef enum WHBGfxMode
+{
+   //! Separate TV and DRC render targets, the scene is drawn for each.
+   WHB_GFX_MODE_SEPARATE            = 0,
+   //! Only the TV target exists, it is scaled onto the DRC scan buffer by
+   //! WHBGfxFinishRenderTV and the DRC render pass can be skipped.
+   WHB_GFX_MODE_MIRROR_TV_TO_DRC    = 1,
+} WHBGfxMode;
+
+struct WHBGfxConfig
+{
+   WHBGfxMode mode;
+   //! GX2_BUFFERING_MODE_DOUBLE or GX2_BUFFERING_MODE_TRIPLE.
+   GX2BufferingMode bufferingMode;
+   //! Number of vsyncs per frame, 1 for 60fps. 0 means the default of 1.
+   uint32_t swapInterval;
+   //! How many frames the CPU may submit before the GPU retires them, up to
+   //! WHB_GFX_MAX_FRAMES_IN_FLIGHT. 0 waits for the GPU at the end of every
+   //! frame. Above 0 the app must not modify resources the GPU may still be
+   //! reading from a previous frame.
+   uint32_t maxFramesInFlight;
+   //! Size of the MEM2 pool GX2 allocates command buffers from.
+   uint32_t commandBufferPoolSize;
+};
+
+struct WHBGfxFrameStats
+{
+   //! Frames finished since WHBGfxInit.
+   uint32_t frameCount;
+   //! Swaps submitted but not yet flipped.
+   uint32_t pendingSwaps;
+   OSTime lastFlip;
+   OSTime lastVsync;
+   //! Time the last WHBGfxBeginRender spent waiting on the GPU and display.
+   OSTime waitTime;
+};
+
+/**
+ * Command buffer pool usage, measured from where GX2 starts the command
+ * buffer after each frame's flush, so granularity is one command buffer.
+ */
+struct WHBGfxCommandBufferStats
+{
+   uint32_t poolSize;
+   //! Pool bytes used by the last frame.
+   uint32_t frameBytes;
+   uint32_t maxFrameBytes;
+   //! Pool bytes used by frames the GPU had not retired at the last frame.
+   uint32_t inFlightBytes;
+   uint32_t maxInFlightBytes;
+};
+
+#define WHB_GFX_PROFILER_MAX_PASSES    32
+#define WHB_GFX_PROFILER_MAX_DEPTH     8
+
+typedef enum WHBGfxProfilerOutput
+{
+   WHB_GFX_PROFILER_OUTPUT_NONE        = 0,
+   //! WHBLogPrintf a line per pass every logInterval frames.
+   WHB_GFX_PROFILER_OUTPUT_LOG         = 1 << 0,
+   //! Microsecond gauges named "gpu.frame" and "gpu.<pass>".
+   WHB_GFX_PROFILER_OUTPUT_TELEMETRY   = 1 << 1,
+} WHBGfxProfilerOutput;
+
+struct WHBGfxProfilerPass
+{
+   const char *name;
+   //! Number of passes this one is nested inside.
+   uint32_t depth;
+   float milliseconds;
+};
+
+#define WHB_GFX_DISPLAY_LIST_DEFAULT_MAX_SIZE   0x100000
+
+typedef void (*WHBGfxDisplayListRecordFn)(void *userData);
+
+/**
+ * A static draw sequence which is recorded once and replayed with
+ * GX2CallDisplayList. The record callback issues the GX2 state, shader,
+ * attribute buffer and draw calls, and runs again only after the list is
+ * invalidated.
+ */
+struct WHBGfxDisplayList
+{
+   WHBGfxDisplayListRecordFn record;
+   void *userData;
+   //! Size of the buffer the commands are measured in.
+   uint32_t maxSize;
+   void *buffer;
+   uint32_t size;
+   uint32_t capacity;
+   BOOL valid;
+   BOOL called;
+   //! GX2GetLastSubmittedTimeStamp at the last call.
+   OSTime callTimeStamp;
+   //! Buffer replaced while the GPU may still read it.
+   void *retiredBuffer;
+   OSTime retiredTimeStamp;
+};
 
 struct WHBGfxShaderGroup
 {
@@ -28,15 +138,151 @@ struct WHBGfxShaderGroup
 BOOL
 WHBGfxInit();
 
+/**
+ * Fill config with the defaults used by WHBGfxInit: separate TV and DRC
+ * targets, double buffering, 60fps, no CPU run-ahead and a 4 MiB command
+ * buffer pool.
+ */
+void
+WHBGfxGetDefaultConfig(WHBGfxConfig *config);
+
+/**
+ * Initialise with the given config, or the defaults when config is NULL.
+ */
+BOOL
+WHBGfxInitEx(const WHBGfxConfig *config);
+
+/**
+ * TRUE when the DRC shows the TV image, in which case there is nothing to
+ * draw between WHBGfxBeginRenderDRC and WHBGfxFinishRenderDRC.
+ */
+BOOL
+WHBGfxIsDRCMirrored();
+
 void
 WHBGfxShutdown();
 
+/**
+ * Waits until a scan buffer is free and no more than maxFramesInFlight
+ * frames are still queued on the GPU.
+ */
 void
 WHBGfxBeginRender();
 
 void
 WHBGfxFinishRender();
 
+/**
+ * Number of vsyncs per frame, 0 means the default of 1 as in WHBGfxConfig.
+ */
+void
+WHBGfxSetSwapInterval(uint32_t interval);
+
+/**
+ * Set the swap interval closest to the given frame rate.
+ */
+void
+WHBGfxSetTargetFrameRate(uint32_t framesPerSecond);
+
+void
+WHBGfxSetMaxFramesInFlight(uint32_t frames);
+
+void
+WHBGfxGetFrameStats(WHBGfxFrameStats *stats);
+
+void
+WHBGfxGetCommandBufferStats(WHBGfxCommandBufferStats *stats);
+
+/**
+ * Reset the command buffer high-water marks.
+ */
+void
+WHBGfxResetCommandBufferStats();
+
+/**
+ * Start timing GPU passes. Timestamps are written by the GPU into a ring of
+ * WHB_GFX_MAX_FRAMES_IN_FLIGHT + 1 sets of query memory, and each frame's
+ * results are read at the WHBGfxBeginRender which reuses its set, that many
+ * frames later. They are discarded if the GPU has not finished that frame
+ * by then, so the CPU never waits on them.
+ */
+BOOL
+WHBGfxProfilerInit(uint32_t outputs,
+                   uint32_t logInterval);
+
+void
+WHBGfxProfilerShutdown();
+
+/**
+ * Time the commands until the matching WHBGfxProfilerEndPass, passes may
+ * be nested. The name must outlive the profiler, e.g. a string literal.
+ */
+void
+WHBGfxProfilerBeginPass(const char *name);
+
+void
+WHBGfxProfilerEndPass();
+
+/**
+ * GPU milliseconds from WHBGfxBeginRender to WHBGfxFinishRender of the
+ * latest frame with results.
+ */
+float
+WHBGfxProfilerGetFrameTime();
+
+/**
+ * Copy up to maxPasses passes of the latest frame with results, in the
+ * order they began, and return how many were copied.
+ */
+uint32_t
+WHBGfxProfilerGetPasses(WHBGfxProfilerPass *passes,
+                        uint32_t maxPasses);
+
+/**
+ * Number of frames whose results were discarded.
+ */
+uint32_t
+WHBGfxProfilerGetDroppedFrames();
+
+/**
+ * Buffers, textures and shaders the record callback uses are referenced by
+ * address, so they must outlive the list. Their contents may change, but
+ * anything which moves or changes state requires an invalidate. A maxSize
+ * of 0 uses WHB_GFX_DISPLAY_LIST_DEFAULT_MAX_SIZE.
+ */
+void
+WHBGfxInitDisplayList(WHBGfxDisplayList *list,
+                      WHBGfxDisplayListRecordFn record,
+                      void *userData,
+                      uint32_t maxSize);
+
+/**
+ * Record the commands into a maxSize buffer, then copy them into a MEM2
+ * buffer of the measured size. The previous buffer is reused when it is
+ * large enough and the GPU has finished with it, otherwise it is freed once
+ * the GPU has.
+ */
+BOOL
+WHBGfxRecordDisplayList(WHBGfxDisplayList *list);
+
+/**
+ * Record the list again at its next call.
+ */
+void
+WHBGfxInvalidateDisplayList(WHBGfxDisplayList *list);
+
+/**
+ * Record the list if it is invalid, then call it.
+ */
+BOOL
+WHBGfxCallDisplayList(WHBGfxDisplayList *list);
+
+/**
+ * Waits for the GPU if it may still be reading the list.
+ */
+void
+WHBGfxFreeDisplayList(WHBGfxDisplayList *list);
+
 void
 WHBGfxClearColor(float r, float g, float b, float a);
 
@@ -0,0 +1,109 @@
+#pragma once
+#include <wut.h>
+
+/**
+ * \defgroup whb_job Job System
+ * \ingroup whb
+ *
+ * Work-stealing job scheduler with one worker thread pinned to each core.
+ *
+ * Jobs are pushed to the deque of the worker which submits them and may be
+ * stolen by the other workers. Jobs submitted from other threads go through a
+ * shared queue. Completion is tracked with WHBJobCounter, which can be waited
+ * on (the waiting thread runs jobs while it waits) or given a continuation job
+ * to submit once it reaches zero.
+ *
+ * Job and counter storage is owned by the caller and must remain valid until
+ * the job has finished running.
+ * @{
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WHB_JOB_NUM_WORKERS 3
+#define WHB_JOB_DEQUE_SIZE 1024
+#define WHB_JOB_MAX_PARALLEL_FOR_CHUNKS 64
+
+typedef struct WHBJob WHBJob;
+typedef struct WHBJobCounter WHBJobCounter;
+
+typedef void (*WHBJobFn)(void *arg);
+typedef void (*WHBJobRangeFn)(uint32_t begin, uint32_t end, void *arg);
+
+struct WHBJob
+{
+   WHBJobFn fn;
+   void *arg;
+   WHBJobCounter *counter;
+};
+
+struct WHBJobCounter
+{
+   volatile int32_t value;
+   //! Releases still touching the counter after it may have reached zero.
+   volatile int32_t busy;
+   WHBJob *continuation;
+};
+
+BOOL
+WHBJobSystemInit(int32_t priority,
+                 uint32_t stackSize);
+
+void
+WHBJobSystemShutdown();
+
+void
+WHBJobInit(WHBJob *job,
+           WHBJobFn fn,
+           void *arg);
+
+void
+WHBJobCounterInit(WHBJobCounter *counter);
+
+/**
+ * Submit continuation once counter reaches zero, or now if it already has.
+ * The continuation is counted against continuationCounter from now until
+ * it has finished running.
+ */
+void
+WHBJobCounterSetContinuation(WHBJobCounter *counter,
+                             WHBJob *continuation,
+                             WHBJobCounter *continuationCounter);
+
+void
+WHBJobRun(WHBJob *job,
+          WHBJobCounter *counter);
+
+void
+WHBJobRunBatch(WHBJob *jobs,
+               uint32_t count,
+               WHBJobCounter *counter);
+
+BOOL
+WHBJobCounterIsDone(WHBJobCounter *counter);
+
+/**
+ * Wait for counter to reach zero, running jobs meanwhile. A thread which is
+ * not a worker blocks once there is nothing it can run.
+ */
+void
+WHBJobWait(WHBJobCounter *counter);
+
+/**
+ * Call fn over [begin, end) split into chunks of at least grainSize, and wait
+ * for all of them to finish.
+ */
+void
+WHBJobParallelFor(uint32_t begin,
+                  uint32_t end,
+                  uint32_t grainSize,
+                  WHBJobRangeFn fn,
+                  void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+/** @} */
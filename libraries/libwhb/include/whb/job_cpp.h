@@ -0,0 +1,127 @@
+#pragma once
+#include <whb/job.h>
+
+#ifdef __cplusplus
+
+#include <type_traits>
+#include <utility>
+
+/**
+ * \ingroup whb_job
+ * @{
+ */
+
+namespace whb
+{
+
+/**
+ * A job which calls a callable, storage is owned by the caller like WHBJob.
+ */
+template<typename Fn>
+class job : public WHBJob
+{
+public:
+   explicit job(Fn fn) :
+      mFn(std::move(fn))
+   {
+      WHBJobInit(this, &job::trampoline, this);
+   }
+
+   job(const job &) = delete;
+   job &operator=(const job &) = delete;
+
+private:
+   static void
+   trampoline(void *arg)
+   {
+      static_cast<job *>(arg)->mFn();
+   }
+
+   Fn mFn;
+};
+
+template<typename Fn>
+inline job<Fn>
+make_job(Fn fn)
+{
+   return job<Fn>(std::move(fn));
+}
+
+/**
+ * A set of jobs which can be waited on together, waits on destruction.
+ */
+class job_group
+{
+public:
+   job_group()
+   {
+      WHBJobCounterInit(&mCounter);
+   }
+
+   ~job_group()
+   {
+      wait();
+   }
+
+   job_group(const job_group &) = delete;
+   job_group &operator=(const job_group &) = delete;
+
+   void
+   run(WHBJob &j)
+   {
+      WHBJobRun(&j, &mCounter);
+   }
+
+   void
+   run(WHBJob *jobs, uint32_t count)
+   {
+      WHBJobRunBatch(jobs, count, &mCounter);
+   }
+
+   //! Run continuation once every job in this group has finished.
+   void
+   then(WHBJob &continuation, job_group &continuationGroup)
+   {
+      WHBJobCounterSetContinuation(&mCounter, &continuation,
+                                   &continuationGroup.mCounter);
+   }
+
+   bool
+   done()
+   {
+      return WHBJobCounterIsDone(&mCounter);
+   }
+
+   void
+   wait()
+   {
+      WHBJobWait(&mCounter);
+   }
+
+private:
+   WHBJobCounter mCounter;
+};
+
+/**
+ * Call fn(i) for every i in [begin, end), split into chunks of at least
+ * grainSize, and wait for them all to finish.
+ */
+template<typename Fn>
+inline void
+parallel_for(uint32_t begin, uint32_t end, uint32_t grainSize, Fn &&fn)
+{
+   WHBJobParallelFor(begin, end, grainSize,
+      [](uint32_t first, uint32_t last, void *arg) {
+         auto &f = *static_cast<typename std::remove_reference<Fn>::type *>(arg);
+         for (uint32_t i = first; i < last; ++i) {
+            f(i);
+         }
+      },
+      const_cast<void *>(static_cast<const void *>(&fn)));
+}
+
+} // namespace whb
+
+/** @} */
+
+#endif // ifdef __cplusplus
@@ -11,11 +11,96 @@
 extern "C" {
 #endif
 
+/*
+ * Log levels, messages logged without a level are WHB_LOG_LEVEL_INFO.
+ */
+#define WHB_LOG_LEVEL_ERROR      0
+#define WHB_LOG_LEVEL_WARN       1
+#define WHB_LOG_LEVEL_INFO       2
+#define WHB_LOG_LEVEL_DEBUG      3
+#define WHB_LOG_LEVEL_VERBOSE    4
+#define WHB_LOG_NUM_LEVELS       5
+
+#define WHB_LOG_LEVEL_MASK(level)   (1u << (level))
+#define WHB_LOG_LEVEL_MASK_ALL      ((1u << WHB_LOG_NUM_LEVELS) - 1)
+
+/*
+ * Categories are application defined, from 0 to 31.
+ */
+#define WHB_LOG_CATEGORY_DEFAULT 0
+#define WHB_LOG_NUM_CATEGORIES   32
+
+/*
+ * Levels above WHB_LOG_COMPILE_LEVEL are removed at compile time.
+ */
+#ifndef WHB_LOG_COMPILE_LEVEL
+#define WHB_LOG_COMPILE_LEVEL    WHB_LOG_LEVEL_VERBOSE
+#endif
+
+//! Per level bitmask of enabled categories, use WHBLogSetCategoryLevel.
+extern volatile uint32_t __whb_log_filter[WHB_LOG_NUM_LEVELS];
+
+#define WHBLogIsEnabled(level, category) \
+   (((level) <= WHB_LOG_COMPILE_LEVEL) && \
+    (__whb_log_filter[(level)] & (1u << (category))))
+
+#define WHBLogLevelf(level, category, ...) \
+   do { \
+      if (WHBLogIsEnabled(level, category)) { \
+         WHBLogLevelPrintf(level, __VA_ARGS__); \
+      } \
+   } while (0)
+
+#if WHB_LOG_COMPILE_LEVEL >= WHB_LOG_LEVEL_ERROR
+#define WHBLogError(category, ...) WHBLogLevelf(WHB_LOG_LEVEL_ERROR, category, __VA_ARGS__)
+#else
+#define WHBLogError(category, ...) do { } while (0)
+#endif
+
+#if WHB_LOG_COMPILE_LEVEL >= WHB_LOG_LEVEL_WARN
+#define WHBLogWarn(category, ...) WHBLogLevelf(WHB_LOG_LEVEL_WARN, category, __VA_ARGS__)
+#else
+#define WHBLogWarn(category, ...) do { } while (0)
+#endif
+
+#if WHB_LOG_COMPILE_LEVEL >= WHB_LOG_LEVEL_INFO
+#define WHBLogInfo(category, ...) WHBLogLevelf(WHB_LOG_LEVEL_INFO, category, __VA_ARGS__)
+#else
+#define WHBLogInfo(category, ...) do { } while (0)
+#endif
+
+#if WHB_LOG_COMPILE_LEVEL >= WHB_LOG_LEVEL_DEBUG
+#define WHBLogDebug(category, ...) WHBLogLevelf(WHB_LOG_LEVEL_DEBUG, category, __VA_ARGS__)
+#else
+#define WHBLogDebug(category, ...) do { } while (0)
+#endif
+
+#if WHB_LOG_COMPILE_LEVEL >= WHB_LOG_LEVEL_VERBOSE
+#define WHBLogVerbose(category, ...) WHBLogLevelf(WHB_LOG_LEVEL_VERBOSE, category, __VA_ARGS__)
+#else
+#define WHBLogVerbose(category, ...) do { } while (0)
+#endif
+
 typedef void (*LogHandlerFn)(const char *msg);
 
+typedef enum WHBLogAsyncPolicy
+{
+   //! Discard the message if the ring is full, see WHBLogAsyncGetDroppedCount.
+   WHB_LOG_ASYNC_DROP      = 0,
+   //! Wait for the drain thread to make room if the ring is full.
+   WHB_LOG_ASYNC_BLOCK     = 1,
+} WHBLogAsyncPolicy;
+
 BOOL
 WHBAddLogHandler(LogHandlerFn fn);
 
+/**
+ * Add a handler which only receives messages whose level is in levelMask.
+ */
+BOOL
+WHBAddLogHandlerEx(LogHandlerFn fn,
+                   uint32_t levelMask);
+
 BOOL
 WHBRemoveLogHandler(LogHandlerFn fn);
 
@@ -31,6 +116,67 @@ WHBLogWritef(const char *fmt, ...);
 BOOL
 WHBLogPrintf(const char *fmt, ...);
 
+/**
+ * Like WHBLogPrintf with a level, prefer the WHBLogError etc. macros which
+ * check the category filter before any arguments are evaluated.
+ */
+BOOL
+WHBLogLevelPrintf(uint32_t level,
+                  const char *fmt, ...);
+
+/**
+ * Enable levels up to and including maxLevel for category, or for every
+ * category if category is -1. By default levels up to WHB_LOG_LEVEL_INFO
+ * are enabled.
+ */
+void
+WHBLogSetCategoryLevel(int32_t category,
+                       uint32_t maxLevel);
+
+/**
+ * Disable every level for category.
+ */
+void
+WHBLogDisableCategory(int32_t category);
+
+/**
+ * Switch logging to asynchronous mode.
+ *
+ * Messages are formatted straight into a slot of a lock-free ring of
+ * numMessages (a power of two) slots of messageSize bytes, and handlers are
+ * called from a drain thread running at priority. Logging never allocates.
+ *
+ * With WHB_LOG_ASYNC_DROP logging never waits for a handler, so it is safe
+ * from time critical threads. With WHB_LOG_ASYNC_BLOCK a full ring makes the
+ * logging thread sleep until the drain thread frees a slot.
+ */
+BOOL
+WHBLogAsyncInit(uint32_t numMessages,
+                uint32_t messageSize,
+                int32_t priority,
+                WHBLogAsyncPolicy policy);
+
+/**
+ * Dispatch any queued messages and return to synchronous logging.
+ *
+ * Waits for threads part way through logging a message to finish it, so it
+ * must not be called from a log handler.
+ */
+void
+WHBLogAsyncDeinit();
+
+/**
+ * Wait until every message queued so far has been dispatched.
+ */
+void
+WHBLogAsyncFlush();
+
+/**
+ * Number of messages discarded because the ring was full.
+ */
+uint32_t
+WHBLogAsyncGetDroppedCount();
+
 #ifdef __cplusplus
 }
 #endif
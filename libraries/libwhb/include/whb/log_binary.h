@@ -0,0 +1,96 @@
+#pragma once
+#include <wut.h>
+
+/**
+ * \defgroup whb_log_binary Binary Log
+ * \ingroup whb
+ *
+ * Deferred formatting logger. Each call records the offset of its format
+ * string in .rodata, the OSGetSystemTick, the core and the raw argument words
+ * into a per-core ring buffer, no formatting is done on the console.
+ *
+ * The application reads the stream with WHBBinLogRead and writes it wherever
+ * it likes, prefixed by a WHBBinLogStreamHeader. share/whb_binlog_decode.py
+ * rebuilds the text on the host using the format strings from the .elf.
+ *
+ * Format strings must be string literals. Strings passed for %s are copied,
+ * truncated to WHB_BINLOG_MAX_STRING bytes.
+ * @{
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WHB_BINLOG_MAGIC         0x57424C47u // 'WBLG'
+#define WHB_BINLOG_VERSION       1
+#define WHB_BINLOG_MAX_WORDS     64
+#define WHB_BINLOG_MAX_STRING    64
+
+typedef struct WHBBinLogStreamHeader WHBBinLogStreamHeader;
+typedef struct WHBBinLogRecord WHBBinLogRecord;
+
+struct WHBBinLogStreamHeader
+{
+   uint32_t magic;
+   uint32_t version;
+   //! OSGetSystemTick ticks per second.
+   uint32_t tickRate;
+   //! Runtime address of the format base, for sanity checking.
+   uint32_t formatBase;
+};
+WUT_CHECK_SIZE(WHBBinLogStreamHeader, 0x10);
+
+/**
+ * Every record is followed by numWords argument words. 64 bit integers and
+ * doubles take two words, strings take a length word followed by the
+ * characters padded to a whole word.
+ */
+struct WHBBinLogRecord
+{
+   //! Offset of the format string from the format base.
+   uint32_t formatId;
+   uint32_t tick;
+   uint8_t core;
+   uint8_t flags;
+   uint16_t numWords;
+};
+WUT_CHECK_SIZE(WHBBinLogRecord, 0x0C);
+
+/**
+ * Allocate a ring of bufferSize (a power of two) bytes for each core.
+ */
+BOOL
+WHBBinLogInit(uint32_t bufferSize);
+
+void
+WHBBinLogDeinit();
+
+BOOL
+WHBBinLogPrintf(const char *fmt, ...);
+
+//! Only accepts a string literal format.
+#define WHBBinLog(fmt, ...) WHBBinLogPrintf("" fmt, ##__VA_ARGS__)
+
+void
+WHBBinLogGetStreamHeader(WHBBinLogStreamHeader *header);
+
+/**
+ * Move whole records from the per-core rings into buffer, returns the number
+ * of bytes written. Must only be called from one thread at a time.
+ */
+uint32_t
+WHBBinLogRead(void *buffer,
+              uint32_t size);
+
+/**
+ * Number of records discarded because a ring was full.
+ */
+uint32_t
+WHBBinLogGetDroppedCount();
+
+#ifdef __cplusplus
+}
+#endif
+
+/** @} */
@@ -16,9 +16,21 @@ extern "C" {
 BOOL
 WHBLogConsoleInit();
 
+/**
+ * Initialise the console with numLines lines of up to lineLength - 1
+ * characters, WHBLogConsoleInit uses 16 lines of 128.
+ */
+BOOL
+WHBLogConsoleInitEx(uint32_t numLines,
+                    uint32_t lineLength);
+
 void
 WHBLogConsoleFree();
 
+/**
+ * Draw the console to the TV and DRC, does nothing when no lines were added
+ * since the last draw.
+ */
 void
 WHBLogConsoleDraw();
 
@@ -4,6 +4,19 @@
 /**
  * \defgroup whb_log_udp UDP Log Output
  * \ingroup whb
+ *
+ * Messages are batched into datagrams of at most WHB_LOG_UDP_MAX_PAYLOAD
+ * bytes, sent when full or once the oldest message is flushInterval old.
+ *
+ * Each datagram starts with a WHBLogUdpPacketHeader, followed by count
+ * messages each with a WHBLogUdpMessageHeader, all big endian. The sequence
+ * number increments by one per datagram so a receiver can detect loss and
+ * reordering, share/whb_udplog_receive.py is an example receiver.
+ *
+ * This framing replaces the plain text datagrams previously sent to the same
+ * WHB_LOG_UDP_PORT. Plain text receivers such as udplogserver or nc -ul will
+ * print the binary headers along with the text and must be replaced with a
+ * receiver which understands the framing.
  * @{
  */
 
@@ -11,9 +24,55 @@
 extern "C" {
 #endif
 
+#define WHB_LOG_UDP_PORT               4405
+#define WHB_LOG_UDP_MAGIC              0x574C4F47u // 'WLOG'
+#define WHB_LOG_UDP_MAX_PAYLOAD        1400
+#define WHB_LOG_UDP_DEFAULT_INTERVAL   20
+
+typedef struct WHBLogUdpPacketHeader WHBLogUdpPacketHeader;
+typedef struct WHBLogUdpMessageHeader WHBLogUdpMessageHeader;
+
+struct WHBLogUdpPacketHeader
+{
+   uint32_t magic;
+   uint32_t sequence;
+   uint16_t count;
+   uint16_t size;
+};
+WUT_CHECK_SIZE(WHBLogUdpPacketHeader, 0x0C);
+
+struct WHBLogUdpMessageHeader
+{
+   //! OSGetSystemTick when the message was logged.
+   uint32_t tick;
+   uint8_t core;
+   uint8_t flags;
+   //! Length of the text which follows, not null terminated.
+   uint16_t length;
+};
+WUT_CHECK_SIZE(WHBLogUdpMessageHeader, 0x08);
+
+/**
+ * Broadcast to WHB_LOG_UDP_PORT, using the framed format described above.
+ */
 BOOL
 WHBLogUdpInit();
 
+/**
+ * Send to address:port (host byte order, INADDR_BROADCAST to broadcast),
+ * flushing partially filled datagrams after flushInterval milliseconds.
+ */
+BOOL
+WHBLogUdpInitEx(uint32_t address,
+                uint16_t port,
+                uint32_t flushInterval);
+
+/**
+ * Send any partially filled datagram now.
+ */
+void
+WHBLogUdpFlush();
+
 BOOL
 WHBLogUdpDeinit();
 
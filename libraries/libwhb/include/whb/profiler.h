@@ -0,0 +1,78 @@
+#pragma once
+#include <wut.h>
+
+/**
+ * \defgroup whb_profiler Sampling Profiler
+ * \ingroup whb
+ *
+ * Samples the interrupted program counter and a shallow back chain on each
+ * selected core from a periodic OSAlarm. Samples go into a per-core buffer
+ * written only by that core's alarm, and are symbolized with
+ * OSGetSymbolName when exported.
+ *
+ * Output is either a flat histogram of the functions samples landed in, or
+ * collapsed stacks ("core0;outer;inner count" per line) for flamegraph.pl.
+ * @{
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WHB_PROFILER_MAX_DEPTH         8
+#define WHB_PROFILER_DEFAULT_RATE      1000
+
+typedef void (*WHBProfilerOutputFn)(const char *line,
+                                    void *userData);
+
+/**
+ * Start sampling the cores in coreMask (bit 0 for core 0) rateHz times a
+ * second, keeping up to samplesPerCore samples for each. Samples from a
+ * previous run are discarded.
+ */
+BOOL
+WHBProfilerStart(uint32_t rateHz,
+                 uint32_t samplesPerCore,
+                 uint32_t coreMask);
+
+void
+WHBProfilerStop();
+
+/**
+ * Stop sampling and free the sample buffers.
+ */
+void
+WHBProfilerShutdown();
+
+uint32_t
+WHBProfilerGetSampleCount(uint32_t core);
+
+/**
+ * Number of samples discarded because a core's buffer was full.
+ */
+uint32_t
+WHBProfilerGetDroppedCount();
+
+/**
+ * Write up to maxEntries lines of "samples percent symbol", most sampled
+ * first. Output goes to WHBLogPrint when fn is NULL. Call after
+ * WHBProfilerStop.
+ */
+BOOL
+WHBProfilerWriteHistogram(WHBProfilerOutputFn fn,
+                          void *userData,
+                          uint32_t maxEntries);
+
+/**
+ * Write every distinct stack in collapsed format, outermost frame first.
+ * Output goes to WHBLogPrint when fn is NULL. Call after WHBProfilerStop.
+ */
+BOOL
+WHBProfilerWriteCollapsed(WHBProfilerOutputFn fn,
+                          void *userData);
+
+#ifdef __cplusplus
+}
+#endif
+
+/** @} */
@@ -0,0 +1,367 @@
+#pragma once
+#include <wut.h>
+#include <coreinit/atomic.h>
+#include <coreinit/fastcondition.h>
+#include <coreinit/fastmutex.h>
+#include <coreinit/messagequeue.h>
+
+#ifdef __cplusplus
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+/**
+ * \defgroup whb_ringbuffer C++ Lock-free Ring Buffers
+ * \ingroup whb
+ *
+ * Header-only bounded lock-free queues for handing work between cores.
+ *
+ * spsc_queue has a single producer and a single consumer and needs no atomic
+ * read-modify-write at all. mpmc_queue is Dmitry Vyukov's bounded queue, any
+ * number of threads may push and pop using one OSCompareAndSwapAtomic each.
+ * Both default to carrying an OSMessage, and blocking_queue adds
+ * OSSendMessage / OSReceiveMessage style calls which only sleep when the
+ * queue is full or empty.
+ * @{
+ */
+
+namespace whb
+{
+
+//! Size of an Espresso cache line.
+static constexpr std::size_t CacheLineSize = 32;
+
+namespace detail
+{
+
+static inline void
+ring_barrier()
+{
+   __asm__ __volatile__ ("sync" : : : "memory");
+}
+
+} // namespace detail
+
+/**
+ * Bounded single producer, single consumer queue.
+ */
+template<typename T = OSMessage, std::size_t Capacity = 256>
+class spsc_queue
+{
+   static_assert(Capacity && (Capacity & (Capacity - 1)) == 0,
+                 "spsc_queue capacity must be a power of two");
+   static_assert(std::is_trivially_copyable<T>::value,
+                 "spsc_queue requires a trivially copyable type");
+
+public:
+   typedef T value_type;
+
+   spsc_queue() = default;
+   spsc_queue(const spsc_queue &) = delete;
+   spsc_queue &operator=(const spsc_queue &) = delete;
+
+   //! Push value, returns false if the queue is full. Producer only.
+   bool
+   try_push(const T &value)
+   {
+      uint32_t tail = mTail;
+
+      if (tail - mCachedHead == Capacity) {
+         mCachedHead = mHead;
+         if (tail - mCachedHead == Capacity) {
+            return false;
+         }
+      }
+
+      mItems[tail & (Capacity - 1)] = value;
+      detail::ring_barrier();
+      mTail = tail + 1;
+      return true;
+   }
+
+   //! Pop into value, returns false if the queue is empty. Consumer only.
+   bool
+   try_pop(T *value)
+   {
+      uint32_t head = mHead;
+
+      if (head == mCachedTail) {
+         mCachedTail = mTail;
+         if (head == mCachedTail) {
+            return false;
+         }
+
+         detail::ring_barrier();
+      }
+
+      *value = mItems[head & (Capacity - 1)];
+      detail::ring_barrier();
+      mHead = head + 1;
+      return true;
+   }
+
+   bool
+   empty() const
+   {
+      return mHead == mTail;
+   }
+
+   std::size_t
+   size() const
+   {
+      return mTail - mHead;
+   }
+
+private:
+   // Producer's cache line.
+   alignas(CacheLineSize) volatile uint32_t mTail = 0;
+   uint32_t mCachedHead = 0;
+
+   // Consumer's cache line.
+   alignas(CacheLineSize) volatile uint32_t mHead = 0;
+   uint32_t mCachedTail = 0;
+
+   alignas(CacheLineSize) T mItems[Capacity];
+};
+
+/**
+ * Bounded multiple producer, multiple consumer queue.
+ */
+template<typename T = OSMessage, std::size_t Capacity = 256>
+class mpmc_queue
+{
+   static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+                 "mpmc_queue capacity must be a power of two");
+   static_assert(std::is_trivially_copyable<T>::value,
+                 "mpmc_queue requires a trivially copyable type");
+
+   struct cell
+   {
+      volatile uint32_t sequence;
+      T value;
+   };
+
+public:
+   typedef T value_type;
+
+   mpmc_queue()
+   {
+      for (uint32_t i = 0; i < Capacity; ++i) {
+         mCells[i].sequence = i;
+      }
+   }
+
+   mpmc_queue(const mpmc_queue &) = delete;
+   mpmc_queue &operator=(const mpmc_queue &) = delete;
+
+   //! Push value, returns false if the queue is full.
+   bool
+   try_push(const T &value)
+   {
+      uint32_t pos = mEnqueuePos;
+      cell *c;
+
+      while (true) {
+         c = &mCells[pos & (Capacity - 1)];
+         int32_t diff = static_cast<int32_t>(c->sequence - pos);
+
+         if (diff == 0) {
+            if (OSCompareAndSwapAtomic(&mEnqueuePos, pos, pos + 1)) {
+               break;
+            }
+            pos = mEnqueuePos;
+         } else if (diff < 0) {
+            return false;
+         } else {
+            pos = mEnqueuePos;
+         }
+      }
+
+      detail::ring_barrier();
+      c->value = value;
+      detail::ring_barrier();
+      c->sequence = pos + 1;
+      return true;
+   }
+
+   //! Pop into value, returns false if the queue is empty.
+   bool
+   try_pop(T *value)
+   {
+      uint32_t pos = mDequeuePos;
+      cell *c;
+
+      while (true) {
+         c = &mCells[pos & (Capacity - 1)];
+         int32_t diff = static_cast<int32_t>(c->sequence - (pos + 1));
+
+         if (diff == 0) {
+            if (OSCompareAndSwapAtomic(&mDequeuePos, pos, pos + 1)) {
+               break;
+            }
+            pos = mDequeuePos;
+         } else if (diff < 0) {
+            return false;
+         } else {
+            pos = mDequeuePos;
+         }
+      }
+
+      detail::ring_barrier();
+      *value = c->value;
+      detail::ring_barrier();
+      c->sequence = pos + Capacity;
+      return true;
+   }
+
+   //! Approximate, other threads may be pushing or popping.
+   bool
+   empty() const
+   {
+      return mEnqueuePos == mDequeuePos;
+   }
+
+private:
+   alignas(CacheLineSize) volatile uint32_t mEnqueuePos = 0;
+   alignas(CacheLineSize) volatile uint32_t mDequeuePos = 0;
+   alignas(CacheLineSize) cell mCells[Capacity];
+};
+
+/**
+ * Adds OSMessageQueue style blocking to a lock-free queue.
+ *
+ * The lock-free path is taken whenever the queue is neither full nor empty,
+ * the fast mutex and condition (whose waiters sit on an OSThreadQueue) are
+ * only touched when a thread has to sleep or another thread is sleeping.
+ */
+template<typename Queue>
+class blocking_queue
+{
+public:
+   typedef typename Queue::value_type T;
+
+   blocking_queue()
+   {
+      OSFastMutex_Init(&mMutex, "WHBBlockingQueue");
+      OSFastCond_Init(&mNotEmpty, "WHBBlockingQueueNotEmpty");
+      OSFastCond_Init(&mNotFull, "WHBBlockingQueueNotFull");
+   }
+
+   blocking_queue(const blocking_queue &) = delete;
+   blocking_queue &operator=(const blocking_queue &) = delete;
+
+   /**
+    * Like OSSendMessage, with OS_MESSAGE_FLAGS_BLOCKING waits for space
+    * instead of returning false when full.
+    */
+   bool
+   send(const T &value, OSMessageFlags flags)
+   {
+      if (!push(value, flags)) {
+         return false;
+      }
+
+      wake(&mReceiveWaiters, &mNotEmpty);
+      return true;
+   }
+
+   /**
+    * Like OSReceiveMessage, with OS_MESSAGE_FLAGS_BLOCKING waits for a value
+    * instead of returning false when empty.
+    */
+   bool
+   receive(T *value, OSMessageFlags flags)
+   {
+      if (!pop(value, flags)) {
+         return false;
+      }
+
+      wake(&mSendWaiters, &mNotFull);
+      return true;
+   }
+
+   Queue &
+   queue()
+   {
+      return mQueue;
+   }
+
+private:
+   bool
+   push(const T &value, OSMessageFlags flags)
+   {
+      if (mQueue.try_push(value)) {
+         return true;
+      }
+
+      if (!(flags & OS_MESSAGE_FLAGS_BLOCKING)) {
+         return false;
+      }
+
+      OSFastMutex_Lock(&mMutex);
+      mSendWaiters = mSendWaiters + 1;
+      detail::ring_barrier();
+
+      while (!mQueue.try_push(value)) {
+         OSFastCond_Wait(&mNotFull, &mMutex);
+      }
+
+      mSendWaiters = mSendWaiters - 1;
+      OSFastMutex_Unlock(&mMutex);
+      return true;
+   }
+
+   bool
+   pop(T *value, OSMessageFlags flags)
+   {
+      if (mQueue.try_pop(value)) {
+         return true;
+      }
+
+      if (!(flags & OS_MESSAGE_FLAGS_BLOCKING)) {
+         return false;
+      }
+
+      OSFastMutex_Lock(&mMutex);
+      mReceiveWaiters = mReceiveWaiters + 1;
+      detail::ring_barrier();
+
+      while (!mQueue.try_pop(value)) {
+         OSFastCond_Wait(&mNotEmpty, &mMutex);
+      }
+
+      mReceiveWaiters = mReceiveWaiters - 1;
+      OSFastMutex_Unlock(&mMutex);
+      return true;
+   }
+
+   void
+   wake(volatile uint32_t *waiters, OSFastCondition *condition)
+   {
+      // Pairs with the barrier after a sleeper registers itself, either it
+      // sees our value when it rechecks the queue or we see it waiting.
+      detail::ring_barrier();
+
+      if (*waiters) {
+         OSFastMutex_Lock(&mMutex);
+         OSFastCond_Signal(condition);
+         OSFastMutex_Unlock(&mMutex);
+      }
+   }
+
+private:
+   Queue mQueue;
+   OSFastMutex mMutex;
+   OSFastCondition mNotEmpty;
+   OSFastCondition mNotFull;
+   volatile uint32_t mSendWaiters = 0;
+   volatile uint32_t mReceiveWaiters = 0;
+};
+
+} // namespace whb
+
+/** @} */
+
+#endif // ifdef __cplusplus
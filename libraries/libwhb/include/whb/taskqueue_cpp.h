@@ -0,0 +1,275 @@
+#pragma once
+#include <wut.h>
+#include <coreinit/taskqueue.h>
+
+#ifdef __cplusplus
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/**
+ * \defgroup whb_taskqueue C++ Task Queue
+ * \ingroup whb
+ *
+ * Header-only wrapper around coreinit's MPTaskQueue which runs callables.
+ *
+ * MPTask objects are taken from a fixed pool owned by the queue and callables
+ * are stored inline in the task, so enqueueing never allocates. The pool is
+ * recycled with reset() once every task has finished, which suits queues that
+ * are filled, drained and reset once per frame.
+ *
+ * The pool is not thread safe: enqueue, enqueue_range, reset and the task
+ * accessors must all be called from one thread. Any thread may run tasks.
+ * @{
+ */
+
+namespace whb
+{
+
+template<std::size_t MaxTasks, std::size_t InlineSize = 32>
+class task_queue
+{
+   struct task
+   {
+      MPTask mpTask;
+      void (*invoke)(task *);
+      void (*destroy)(task *);
+      typename std::aligned_storage<InlineSize, 8>::type storage;
+   };
+
+   template<typename Fn>
+   struct range_fn
+   {
+      Fn *fn;
+      uint32_t index;
+
+      void operator()() { (*fn)(index); }
+   };
+
+public:
+   task_queue()
+   {
+      MPInitTaskQ(&mQueue, mQueueBuffer, MaxTasks);
+   }
+
+   ~task_queue()
+   {
+      stop();
+      release();
+      MPTermTaskQ(&mQueue);
+   }
+
+   task_queue(const task_queue &) = delete;
+   task_queue &operator=(const task_queue &) = delete;
+
+   bool
+   start()
+   {
+      return MPStartTaskQ(&mQueue);
+   }
+
+   bool
+   stop()
+   {
+      return MPStopTaskQ(&mQueue);
+   }
+
+   //! Number of pooled tasks still available until the next reset().
+   std::size_t
+   available() const
+   {
+      return MaxTasks - mUsed;
+   }
+
+   /**
+    * Enqueue a callable, returns false if the pool is exhausted.
+    */
+   template<typename Fn>
+   bool
+   enqueue(Fn &&fn)
+   {
+      task *t = acquire(std::forward<Fn>(fn));
+      if (!t) {
+         return false;
+      }
+
+      if (!MPEnqueTask(&mQueue, &t->mpTask)) {
+         unacquire(t);
+         return false;
+      }
+
+      return true;
+   }
+
+   /**
+    * Enqueue count tasks which call fn(i) for i in [0, count), one
+    * MPEnqueTask each as coreinit has no call to enqueue several. fn must
+    * remain valid until the tasks have finished. Returns the number
+    * enqueued.
+    */
+   template<typename Fn>
+   uint32_t
+   enqueue_range(uint32_t count, Fn &fn)
+   {
+      uint32_t i;
+
+      for (i = 0; i < count; ++i) {
+         if (!enqueue(range_fn<Fn> { &fn, i })) {
+            break;
+         }
+      }
+
+      return i;
+   }
+
+   /**
+    * Run up to count tasks on the calling thread, may be called from threads
+    * on every core to share the work.
+    */
+   bool
+   run(uint32_t count)
+   {
+      return MPRunTasksFromTaskQ(&mQueue, count);
+   }
+
+   /**
+    * Run tasks on the calling thread until the queue has none left ready,
+    * then wait for tasks running on other threads to finish.
+    */
+   bool
+   drain(uint32_t batchSize = 16)
+   {
+      MPTaskQueueInfo info;
+
+      while (MPGetTaskQInfo(&mQueue, &info) && info.tasksReady) {
+         MPRunTasksFromTaskQ(&mQueue, batchSize);
+      }
+
+      return MPWaitTaskQ(&mQueue, MP_TASK_QUEUE_STATE_FINISHED);
+   }
+
+   /**
+    * Recycle every pooled task, must only be called once all have finished.
+    * A started queue is started again, so it keeps running new tasks.
+    */
+   void
+   reset()
+   {
+      MPTaskQueueInfo info;
+      bool started = MPGetTaskQInfo(&mQueue, &info) &&
+                     (info.state & (MP_TASK_QUEUE_STATE_READY |
+                                    MP_TASK_QUEUE_STATE_FINISHED));
+
+      release();
+      MPTermTaskQ(&mQueue);
+      MPInitTaskQ(&mQueue, mQueueBuffer, MaxTasks);
+
+      if (started) {
+         MPStartTaskQ(&mQueue);
+      }
+   }
+
+   //! Get the MPTaskInfo, including duration, of the n-th enqueued task.
+   bool
+   task_info(std::size_t n, MPTaskInfo *info)
+   {
+      if (n >= mUsed) {
+         return false;
+      }
+
+      return MPGetTaskInfo(&mTasks[n].mpTask, info);
+   }
+
+   //! Sum of the duration of every finished task since the last reset().
+   OSTime
+   total_duration()
+   {
+      OSTime total = 0;
+      MPTaskInfo info;
+
+      for (std::size_t i = 0; i < mUsed; ++i) {
+         if (MPGetTaskInfo(&mTasks[i].mpTask, &info) &&
+             info.state == MP_TASK_STATE_FINISHED) {
+            total += info.duration;
+         }
+      }
+
+      return total;
+   }
+
+   MPTaskQueue *
+   native_handle()
+   {
+      return &mQueue;
+   }
+
+private:
+   template<typename Fn>
+   task *
+   acquire(Fn &&fn)
+   {
+      typedef typename std::decay<Fn>::type FnType;
+      static_assert(sizeof(FnType) <= InlineSize,
+                    "callable is too large for task_queue inline storage");
+      static_assert(alignof(FnType) <= 8,
+                    "callable is over-aligned for task_queue inline storage");
+
+      if (mUsed >= MaxTasks) {
+         return nullptr;
+      }
+
+      task *t = &mTasks[mUsed++];
+      new (&t->storage) FnType(std::forward<Fn>(fn));
+      t->invoke = [](task *self) {
+         (*reinterpret_cast<FnType *>(&self->storage))();
+      };
+      t->destroy = [](task *self) {
+         reinterpret_cast<FnType *>(&self->storage)->~FnType();
+      };
+
+      MPInitTask(&t->mpTask, &trampoline, reinterpret_cast<uint32_t>(t), 0);
+      return t;
+   }
+
+   //! Return the most recently acquired task to the pool.
+   void
+   unacquire(task *t)
+   {
+      t->destroy(t);
+      MPTermTask(&t->mpTask);
+      mUsed--;
+   }
+
+   void
+   release()
+   {
+      for (std::size_t i = 0; i < mUsed; ++i) {
+         mTasks[i].destroy(&mTasks[i]);
+         MPTermTask(&mTasks[i].mpTask);
+      }
+
+      mUsed = 0;
+   }
+
+   static uint32_t
+   trampoline(uint32_t arg1, uint32_t arg2)
+   {
+      task *t = reinterpret_cast<task *>(arg1);
+      t->invoke(t);
+      return 0;
+   }
+
+private:
+   MPTaskQueue mQueue;
+   MPTask *mQueueBuffer[MaxTasks];
+   task mTasks[MaxTasks];
+   std::size_t mUsed = 0;
+};
+
+} // namespace whb
+
+/** @} */
+
+#endif // ifdef __cplusplus
@@ -0,0 +1,99 @@
+#pragma once
+#include <wut.h>
+#include <coreinit/time.h>
+
+/**
+ * \defgroup whb_telemetry Telemetry
+ * \ingroup whb
+ *
+ * Named counters, gauges and timers which are sampled once per frame by
+ * WHBTelemetrySampleFrame and streamed to a TCP client from a background
+ * thread. Registration and updates are lock-free and may be called from any
+ * thread.
+ *
+ * The stream is a sequence of messages each starting with a big endian
+ * uint16_t type and uint16_t size of the rest of the message:
+ * - WHB_TELEMETRY_MSG_METRIC: uint16_t id, uint8_t type, uint8_t name length,
+ *   then the name, sent for every metric when a client connects or a new one
+ *   is registered.
+ * - WHB_TELEMETRY_MSG_FRAME: uint32_t frame, uint32_t OSGetSystemTick,
+ *   uint16_t count, then count pairs of uint16_t id and int32_t value, only
+ *   for metrics which changed since the previous frame sent.
+ *
+ * Frame time and free MEM2 are registered automatically, FS and GPU time can
+ * be fed in as gauges or timers.
+ * @{
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WHB_TELEMETRY_PORT          4407
+#define WHB_TELEMETRY_MAX_METRICS   128
+#define WHB_TELEMETRY_MAX_NAME      31
+#define WHB_TELEMETRY_RING_SIZE     64
+#define WHB_TELEMETRY_INVALID       -1
+
+#define WHB_TELEMETRY_MSG_METRIC    1
+#define WHB_TELEMETRY_MSG_FRAME     2
+
+typedef enum WHBTelemetryType
+{
+   //! Accumulates, the value sent is the change during the frame.
+   WHB_TELEMETRY_COUNTER      = 0,
+   //! Holds the last value set.
+   WHB_TELEMETRY_GAUGE        = 1,
+   //! Microseconds accumulated during the frame.
+   WHB_TELEMETRY_TIMER        = 2,
+} WHBTelemetryType;
+
+typedef int32_t WHBTelemetryId;
+
+BOOL
+WHBTelemetryInit(uint16_t port,
+                 int32_t priority);
+
+void
+WHBTelemetryShutdown();
+
+/**
+ * Register a metric, returns WHB_TELEMETRY_INVALID when the table is full.
+ * The name is copied, truncated to WHB_TELEMETRY_MAX_NAME characters.
+ */
+WHBTelemetryId
+WHBTelemetryRegister(const char *name,
+                     WHBTelemetryType type);
+
+void
+WHBTelemetryCounterAdd(WHBTelemetryId id,
+                       int32_t value);
+
+void
+WHBTelemetryGaugeSet(WHBTelemetryId id,
+                     int32_t value);
+
+/**
+ * Add the ticks elapsed since start, as returned by OSGetTime, to a timer.
+ */
+void
+WHBTelemetryTimerAdd(WHBTelemetryId id,
+                     OSTime start);
+
+/**
+ * Snapshot every metric into the sample ring, call once per frame.
+ */
+void
+WHBTelemetrySampleFrame();
+
+/**
+ * Number of frame samples discarded because the publisher fell behind.
+ */
+uint32_t
+WHBTelemetryGetDroppedFrames();
+
+#ifdef __cplusplus
+}
+#endif
+
+/** @} */
@@ -0,0 +1,102 @@
+#pragma once
+#include <wut.h>
+#include <coreinit/time.h>
+
+/**
+ * \defgroup whb_trace Trace Zones
+ * \ingroup whb
+ *
+ * Scoped CPU timeline instrumentation. WHB_ZONE("name") records the ticks
+ * at which the enclosing scope was entered and left, along with the core
+ * and thread, into a ring owned by the calling thread, so recording takes no
+ * locks. WHBTraceCaptureToFile and WHBTraceCaptureToSocket write everything
+ * currently in the rings as Chrome trace_event JSON, viewable in
+ * chrome://tracing or Perfetto with one process row per core.
+ *
+ * Zones are compiled out completely unless WHB_TRACE_ENABLED is defined to
+ * a non-zero value before including this header. Zone names must be string
+ * literals or otherwise outlive the capture.
+ *
+ * Each thread finds its ring through thread specific slot
+ * WHB_TRACE_THREAD_SPECIFIC_ID (15), which the application must not use while
+ * tracing is initialised.
+ *
+ * Captures and WHBTraceShutdown may be called while other threads record,
+ * they stop recording and wait for any zone end in progress to finish.
+ * Zones ended during a capture are not recorded.
+ * @{
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WHB_TRACE_MAX_THREADS          64
+#define WHB_TRACE_THREAD_SPECIFIC_ID   15
+
+typedef struct WHBTraceZone WHBTraceZone;
+
+struct WHBTraceZone
+{
+   const char *name;
+   OSTick begin;
+};
+
+/**
+ * Allocate eventsPerThread events, rounded up to a power of two, for each of
+ * up to maxThreads threads. A thread's oldest events are overwritten when its
+ * ring is full.
+ */
+BOOL
+WHBTraceInit(uint32_t maxThreads,
+             uint32_t eventsPerThread);
+
+void
+WHBTraceShutdown();
+
+static inline WHBTraceZone
+WHBTraceZoneBegin(const char *name)
+{
+   WHBTraceZone zone;
+   zone.name = name;
+   zone.begin = OSGetSystemTick();
+   return zone;
+}
+
+void
+WHBTraceZoneEnd(WHBTraceZone *zone);
+
+/**
+ * Write the trace to a file relative to the SD card root.
+ */
+BOOL
+WHBTraceCaptureToFile(const char *name);
+
+/**
+ * Connect to a host, e.g. "nc -l PORT > trace.json", and send the trace.
+ */
+BOOL
+WHBTraceCaptureToSocket(uint32_t address,
+                        uint16_t port);
+
+/**
+ * Number of threads which could not record because every ring was taken.
+ */
+uint32_t
+WHBTraceGetDroppedThreads();
+
+#if defined(WHB_TRACE_ENABLED) && WHB_TRACE_ENABLED
+#define WHB_TRACE_CONCAT_(a, b) a##b
+#define WHB_TRACE_CONCAT(a, b) WHB_TRACE_CONCAT_(a, b)
+#define WHB_ZONE(name) \
+   WHBTraceZone WHB_TRACE_CONCAT(__whb_zone_, __LINE__) \
+      __attribute__((cleanup(WHBTraceZoneEnd), unused)) = WHBTraceZoneBegin(name)
+#else
+#define WHB_ZONE(name) ((void)0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+/** @} */
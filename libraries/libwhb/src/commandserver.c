@@ -1,3 +1,9 @@
+#include <coreinit/memdefaultheap.h>
+#include <coreinit/mutex.h>
+#include <coreinit/semaphore.h>
+#include <coreinit/spinlock.h>
+#include <coreinit/thread.h>
+#include <coreinit/time.h>
 #include <nsysnet/socket.h>
 #include <whb/commandserver.h>
 #include <whb/libmanager.h>
@@ -5,16 +11,58 @@
 
 #include <string.h>
 
-#define SERVER_PORT 4406
+#define SERVER_THREAD_STACK_SIZE (16 * 1024)
+#define SELECT_TIMEOUT_US 100000
+#define FRAME_HEADER_SIZE 8
+#define SEND_RETRIES 100
 
-int
+typedef struct
+{
+   //! Held while sending, and to close or reuse the slot.
+   OSMutex mutex;
+   int socket;
+   uint32_t received;
+   uint8_t buffer[FRAME_HEADER_SIZE + WHB_SERVER_BUFFER_SIZE];
+} ServerClient;
+
+typedef struct
+{
+   uint32_t command;
+   WHBCommandHandlerFn fn;
+   void *userData;
+} ServerCommand;
+
+static int
 sSocket = -1;
 
-int
-sClient = -1;
+static ServerClient
+sClients[WHB_SERVER_MAX_CLIENTS];
+
+static ServerCommand
+sCommands[WHB_SERVER_MAX_COMMANDS];
+
+// Zero is the unlocked state, so the table can be used before InitEx
+static OSSpinLock
+sCommandLock;
+
+static OSThread
+sThread;
+
+static void *
+sThreadStack = NULL;
+
+static volatile BOOL
+sRunning = FALSE;
+
+// Mailbox for frames without a handler, read by WHBCommandServerListen
+static OSSemaphore
+sUnhandledReady;
 
-struct sockaddr_in
-sAddr;
+static OSSemaphore
+sUnhandledFree;
+
+static char
+sUnhandled[WHB_SERVER_BUFFER_SIZE];
 
 static inline void
 closeSocket(const char * funcName)
@@ -29,21 +77,221 @@ closeSocket(const char * funcName)
 }
 
 static inline void
-closeClient(const char * funcName)
+closeClient(const char * funcName,
+            ServerClient *client)
 {
-   int ret = socketclose(sClient);
+   int ret;
+
+   OSLockMutex(&client->mutex);
+   ret = socketclose(client->socket);
    if(ret < 0) {
       WHBLogPrintf("%s: Error occurred closing client socket: %d", funcName, socketlasterr());
    }
-   else {
-      sClient = -1;
+
+   client->socket = -1;
+   client->received = 0;
+   OSUnlockMutex(&client->mutex);
+}
+
+static inline uint32_t
+readBE32(const uint8_t *src)
+{
+   return ((uint32_t)src[0] << 24) | ((uint32_t)src[1] << 16) | ((uint32_t)src[2] << 8) | src[3];
+}
+
+static inline void
+writeBE32(uint8_t *dst,
+          uint32_t value)
+{
+   dst[0] = (uint8_t)(value >> 24);
+   dst[1] = (uint8_t)(value >> 16);
+   dst[2] = (uint8_t)(value >> 8);
+   dst[3] = (uint8_t)value;
+}
+
+static void
+dispatchFrame(int32_t client,
+              uint32_t command,
+              const uint8_t *data,
+              uint32_t size)
+{
+   WHBCommandHandlerFn fn = NULL;
+   void *userData = NULL;
+   int i;
+
+   OSUninterruptibleSpinLock_Acquire(&sCommandLock);
+   for (i = 0; i < WHB_SERVER_MAX_COMMANDS; ++i) {
+      if (sCommands[i].fn && sCommands[i].command == command) {
+         fn = sCommands[i].fn;
+         userData = sCommands[i].userData;
+         break;
+      }
+   }
+   OSUninterruptibleSpinLock_Release(&sCommandLock);
+
+   if (fn) {
+      fn(client, command, data, size, userData);
+      return;
+   }
+
+   // Never wait for WHBCommandServerListen, drop if it has not caught up
+   if (OSTryWaitSemaphore(&sUnhandledFree) > 0) {
+      if (size > WHB_SERVER_BUFFER_SIZE - 1) {
+         size = WHB_SERVER_BUFFER_SIZE - 1;
+      }
+
+      memcpy(sUnhandled, data, size);
+      sUnhandled[size] = 0;
+      OSSignalSemaphore(&sUnhandledReady);
    }
 }
 
+static void
+receiveClient(int32_t index)
+{
+   ServerClient *client = &sClients[index];
+   uint32_t frameSize;
+   uint32_t consumed = 0;
+   int ret;
+
+   ret = recv(client->socket,
+              client->buffer + client->received,
+              sizeof(client->buffer) - client->received,
+              0);
+   if (ret < 0) {
+      if (socketlasterr() == NSN_EWOULDBLOCK) {
+         return;
+      }
+
+      WHBLogPrintf("%s: Error occurred while receiving data from client: %d", __FUNCTION__, socketlasterr());
+      closeClient(__FUNCTION__, client);
+      return;
+   }
+
+   if (ret == 0) {
+      closeClient(__FUNCTION__, client);
+      return;
+   }
+
+   client->received += ret;
+
+   while (client->received - consumed >= FRAME_HEADER_SIZE) {
+      const uint8_t *frame = client->buffer + consumed;
+      frameSize = readBE32(frame);
+      if (frameSize < 4 || frameSize - 4 > WHB_SERVER_BUFFER_SIZE) {
+         WHBLogPrintf("%s: Invalid frame size %u from client %d.", __FUNCTION__, frameSize, index);
+         closeClient(__FUNCTION__, client);
+         return;
+      }
+
+      if (client->received - consumed < frameSize + 4) {
+         break;
+      }
+
+      dispatchFrame(index, readBE32(frame + 4), frame + FRAME_HEADER_SIZE, frameSize - 4);
+      consumed += frameSize + 4;
+
+      // A handler may have closed this client
+      if (client->socket < 0) {
+         return;
+      }
+   }
+
+   if (consumed) {
+      memmove(client->buffer, client->buffer + consumed, client->received - consumed);
+      client->received -= consumed;
+   }
+}
+
+static void
+acceptClient()
+{
+   struct sockaddr_in clientAddr;
+   socklen_t clientAddrLen = sizeof(struct sockaddr_in);
+   int nonBlocking = 1;
+   int clientSocket;
+   int i;
+
+   clientSocket = accept(sSocket, (struct sockaddr *)&clientAddr, &clientAddrLen);
+   if (clientSocket < 0) {
+      return;
+   }
+
+   for (i = 0; i < WHB_SERVER_MAX_CLIENTS; ++i) {
+      if (sClients[i].socket < 0) {
+         setsockopt(clientSocket, SOL_SOCKET, SO_NBIO, &nonBlocking, sizeof(nonBlocking));
+         OSLockMutex(&sClients[i].mutex);
+         sClients[i].socket = clientSocket;
+         sClients[i].received = 0;
+         OSUnlockMutex(&sClients[i].mutex);
+         return;
+      }
+   }
+
+   WHBLogPrintf("%s: Too many clients, rejecting connection.", __FUNCTION__);
+   socketclose(clientSocket);
+}
+
+static int
+serverThreadMain(int argc,
+                 const char **argv)
+{
+   struct timeval timeout;
+   fd_set readSet;
+   int maxSocket;
+   int ret;
+   int i;
+
+   while (sRunning) {
+      FD_ZERO(&readSet);
+      FD_SET(sSocket, &readSet);
+      maxSocket = sSocket;
+
+      for (i = 0; i < WHB_SERVER_MAX_CLIENTS; ++i) {
+         if (sClients[i].socket >= 0) {
+            FD_SET(sClients[i].socket, &readSet);
+            if (sClients[i].socket > maxSocket) {
+               maxSocket = sClients[i].socket;
+            }
+         }
+      }
+
+      // Time out so a stop request is noticed
+      timeout.tv_sec = 0;
+      timeout.tv_usec = SELECT_TIMEOUT_US;
+      ret = select(maxSocket + 1, &readSet, NULL, NULL, &timeout);
+      if (ret <= 0) {
+         continue;
+      }
+
+      if (FD_ISSET(sSocket, &readSet)) {
+         acceptClient();
+      }
+
+      for (i = 0; i < WHB_SERVER_MAX_CLIENTS; ++i) {
+         if (sClients[i].socket >= 0 && FD_ISSET(sClients[i].socket, &readSet)) {
+            receiveClient(i);
+         }
+      }
+   }
+
+   return 0;
+}
+
 BOOL
 WHBCommandServerInit()
 {
+   return WHBCommandServerInitEx(WHB_SERVER_PORT, WHB_SERVER_THREAD_PRIORITY);
+}
+
+BOOL
+WHBCommandServerInitEx(uint16_t port,
+                       int32_t priority)
+{
+   struct sockaddr_in addr;
+   int nonBlocking = 1;
    int ret = 0;
+   int i;
 
    if(sSocket >= 0) {
       WHBLogPrintf("%s: Command server is already running.", __FUNCTION__);
@@ -56,81 +304,226 @@ WHBCommandServerInit()
    if(sSocket < 0) {
       WHBLogPrintf("%s: Error occurred while creating socket: %d", __FUNCTION__, socketlasterr());
       sSocket = -1;
+      WHBDeinitializeSocketLibrary();
       return FALSE;
    }
 
-   memset(&sAddr, 0, sizeof(struct sockaddr_in));
-   sAddr.sin_family = AF_INET;
-   sAddr.sin_port = htons(SERVER_PORT);
-   sAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+   memset(&addr, 0, sizeof(struct sockaddr_in));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+   addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-   ret = bind(sSocket, (struct sockaddr *)&sAddr, sizeof(struct sockaddr_in));
+   ret = bind(sSocket, (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
    if(ret < 0) {
       WHBLogPrintf("%s: Error occurred while binding to socket: %d", __FUNCTION__, socketlasterr());
-      closeSocket(__FUNCTION__);
-      return FALSE;
+      goto error;
    }
 
    ret = listen(sSocket, 3);
    if(ret < 0) {
       WHBLogPrintf("%s: Error occurred while setting socket to listen mode: %d", __FUNCTION__, socketlasterr());
-      closeSocket(__FUNCTION__);
-      return FALSE;
+      goto error;
+   }
+
+   setsockopt(sSocket, SOL_SOCKET, SO_NBIO, &nonBlocking, sizeof(nonBlocking));
+
+   for (i = 0; i < WHB_SERVER_MAX_CLIENTS; ++i) {
+      OSInitMutex(&sClients[i].mutex);
+      sClients[i].socket = -1;
+      sClients[i].received = 0;
+   }
+
+   OSInitSemaphore(&sUnhandledReady, 0);
+   OSInitSemaphore(&sUnhandledFree, 1);
+
+   sThreadStack = MEMAllocFromDefaultHeapEx(SERVER_THREAD_STACK_SIZE, 16);
+   if (!sThreadStack) {
+      WHBLogPrintf("%s: Failed to allocate server thread stack.", __FUNCTION__);
+      goto error;
+   }
+
+   sRunning = TRUE;
+   if (!OSCreateThread(&sThread,
+                       serverThreadMain,
+                       0,
+                       NULL,
+                       (uint8_t *)sThreadStack + SERVER_THREAD_STACK_SIZE,
+                       SERVER_THREAD_STACK_SIZE,
+                       priority,
+                       OS_THREAD_ATTRIB_AFFINITY_ANY)) {
+      WHBLogPrintf("%s: Failed to create server thread.", __FUNCTION__);
+      sRunning = FALSE;
+      MEMFreeToDefaultHeap(sThreadStack);
+      sThreadStack = NULL;
+      goto error;
    }
 
+   OSSetThreadName(&sThread, "WHBCommandServer");
+   OSResumeThread(&sThread);
    return TRUE;
+
+error:
+   closeSocket(__FUNCTION__);
+   WHBDeinitializeSocketLibrary();
+   return FALSE;
 }
 
 void
 WHBCommandServerStop()
 {
+   int i;
+
    if(sSocket < 0) {
       WHBLogPrintf("%s: Socket is already closed.", __FUNCTION__);
       return;
    }
 
-   if(sClient >= 0) {
-      closeClient(__FUNCTION__);
+   sRunning = FALSE;
+   OSJoinThread(&sThread, NULL);
+   MEMFreeToDefaultHeap(sThreadStack);
+   sThreadStack = NULL;
+
+   // Release anyone blocked in WHBCommandServerListen
+   OSSignalSemaphore(&sUnhandledReady);
+
+   for (i = 0; i < WHB_SERVER_MAX_CLIENTS; ++i) {
+      if(sClients[i].socket >= 0) {
+         closeClient(__FUNCTION__, &sClients[i]);
+      }
    }
+
    closeSocket(__FUNCTION__);
    WHBDeinitializeSocketLibrary();
 }
 
 BOOL
-WHBCommandServerListen(char * stringLocation)
+WHBCommandServerRegister(uint32_t command,
+                         WHBCommandHandlerFn fn,
+                         void *userData)
+{
+   int free = -1;
+   int i;
+
+   OSUninterruptibleSpinLock_Acquire(&sCommandLock);
+   for (i = 0; i < WHB_SERVER_MAX_COMMANDS; ++i) {
+      if (sCommands[i].fn && sCommands[i].command == command) {
+         free = i;
+         break;
+      }
+
+      if (!sCommands[i].fn && free < 0) {
+         free = i;
+      }
+   }
+
+   if (free >= 0) {
+      sCommands[free].command = command;
+      sCommands[free].userData = userData;
+      sCommands[free].fn = fn;
+   }
+   OSUninterruptibleSpinLock_Release(&sCommandLock);
+
+   return free >= 0;
+}
+
+BOOL
+WHBCommandServerUnregister(uint32_t command)
 {
-   char buffer[WHB_SERVER_BUFFER_SIZE];
-   memset(buffer, 0, WHB_SERVER_BUFFER_SIZE);
+   BOOL found = FALSE;
+   int i;
+
+   OSUninterruptibleSpinLock_Acquire(&sCommandLock);
+   for (i = 0; i < WHB_SERVER_MAX_COMMANDS; ++i) {
+      if (sCommands[i].fn && sCommands[i].command == command) {
+         sCommands[i].fn = NULL;
+         found = TRUE;
+         break;
+      }
+   }
+   OSUninterruptibleSpinLock_Release(&sCommandLock);
+
+   return found;
+}
 
+static BOOL
+sendAll(int clientSocket,
+        const uint8_t *data,
+        uint32_t size)
+{
+   int retries = 0;
    int ret;
-   struct sockaddr_in sClientAddr;
-   socklen_t sClientAddrLen = sizeof(struct sockaddr_in);
 
-   if(sSocket < 0) {
-      WHBLogPrintf("%s: Socket is not open. Please run WHBCommandServerInit() first.", __FUNCTION__);
+   while (size) {
+      ret = send(clientSocket, data, size, 0);
+      if (ret < 0) {
+         if (socketlasterr() != NSN_EWOULDBLOCK || ++retries > SEND_RETRIES) {
+            return FALSE;
+         }
+
+         OSSleepTicks(OSMillisecondsToTicks(1));
+         continue;
+      }
+
+      data += ret;
+      size -= ret;
+   }
+
+   return TRUE;
+}
+
+BOOL
+WHBCommandServerSend(int32_t client,
+                     uint32_t command,
+                     const void *data,
+                     uint32_t size)
+{
+   ServerClient *serverClient;
+   uint8_t header[FRAME_HEADER_SIZE];
+   BOOL result;
+
+   if (!sRunning || client < 0 || client >= WHB_SERVER_MAX_CLIENTS) {
       return FALSE;
    }
 
-   if(sClient < 0) {
-      sClient = accept(sSocket, (struct sockaddr *)&sClientAddr, &sClientAddrLen);
-      if(sClient < 0) {
-         WHBLogPrintf("%s: Error occurred while accepting a client connection: %d", __FUNCTION__, socketlasterr());
-         return FALSE;
-      }
+   writeBE32(header, size + 4);
+   writeBE32(header + 4, command);
+
+   // Only senders to the same client wait for each other, and the slot can
+   // not be closed and handed to a new connection part way through a frame.
+   serverClient = &sClients[client];
+   OSLockMutex(&serverClient->mutex);
+   if (serverClient->socket < 0) {
+      OSUnlockMutex(&serverClient->mutex);
+      return FALSE;
    }
 
-   ret = recv(sClient, buffer, WHB_SERVER_BUFFER_SIZE, 0);
-   if(ret < 0) {
-      WHBLogPrintf("%s: Error occurred while receiving data from client: %d", __FUNCTION__, socketlasterr());
-      closeClient(__FUNCTION__);
+   result = sendAll(serverClient->socket, header, FRAME_HEADER_SIZE) &&
+            sendAll(serverClient->socket, data, size);
+   OSUnlockMutex(&serverClient->mutex);
+
+   if (!result) {
+      WHBLogPrintf("%s: Error occurred while sending to client %d: %d", __FUNCTION__, client, socketlasterr());
+   }
+
+   return result;
+}
+
+BOOL
+WHBCommandServerListen(char * stringLocation)
+{
+   if(sSocket < 0) {
+      WHBLogPrintf("%s: Socket is not open. Please run WHBCommandServerInit() first.", __FUNCTION__);
       return FALSE;
    }
-   if(ret == 0) {
-      WHBLogPrintf("%s: Remote socket was closed. Closing client connection...", __FUNCTION__);
-      closeClient(__FUNCTION__);
+
+   OSWaitSemaphore(&sUnhandledReady);
+   if (!sRunning) {
+      // Pass the wake up on to any other waiter
+      OSSignalSemaphore(&sUnhandledReady);
       return FALSE;
    }
 
-   memcpy(stringLocation, buffer, WHB_SERVER_BUFFER_SIZE);
+   memcpy(stringLocation, sUnhandled, WHB_SERVER_BUFFER_SIZE);
+   OSSignalSemaphore(&sUnhandledFree);
    return TRUE;
 }
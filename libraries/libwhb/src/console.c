@@ -11,19 +11,70 @@
 #define NUM_LINES (16)
 #define LINE_LENGTH (128)
 #define FRAME_HEAP_TAG (0x000DECAF)
-
-static char sConsoleBuffer[NUM_LINES][LINE_LENGTH];
-static int sLineNum = 0;
+#define BACKGROUND_COLOUR (0x993333FF)
+
+/*
+ * Lines are numbered from the first ever added and stored in a ring indexed
+ * by line number, so adding a line never moves the others.
+ *
+ * Each screen has two buffers, so we remember which lines each was last drawn
+ * with. Nothing is drawn if the visible buffer is already up to date, and if
+ * lines were only appended below those already in the work buffer just the
+ * new rows are drawn, without clearing.
+ */
+typedef struct
+{
+   BOOL valid;
+   uint32_t first;
+   uint32_t end;
+} ConsoleBufferState;
+
+static char *sConsoleBuffer = NULL;
+static uint32_t sNumLines = NUM_LINES;
+static uint32_t sLineLength = LINE_LENGTH;
+static volatile uint32_t sTotalLines = 0;
+static ConsoleBufferState sBufferState[2];
+static uint32_t sWorkBuffer = 0;
 static void *sBufferTV, *sBufferDRC;
 static uint32_t sBufferSizeTV, sBufferSizeDRC;
 
 static void
 consoleAddLine(const char *line);
 
+static inline char *
+consoleGetLine(uint32_t line)
+{
+   return sConsoleBuffer + (line % sNumLines) * sLineLength;
+}
+
+/*
+ * Flush the work buffer of a screen, which is half of its memory area. The
+ * visible half was not drawn to so it needs no flush.
+ */
+static void
+consoleFlushWorkBuffer(uint8_t *buffer,
+                       uint32_t bufferSize)
+{
+   uint32_t halfSize = bufferSize / 2;
+   DCFlushRange(buffer + sWorkBuffer * halfSize, halfSize);
+}
+
 BOOL
 WHBLogConsoleInit()
+{
+   return WHBLogConsoleInitEx(NUM_LINES, LINE_LENGTH);
+}
+
+BOOL
+WHBLogConsoleInitEx(uint32_t numLines,
+                    uint32_t lineLength)
 {
    MEMHeapHandle heap = MEMGetBaseHeapHandle(MEM_BASE_HEAP_MEM1);
+
+   if (!numLines || lineLength < 2) {
+      return FALSE;
+   }
+
    MEMRecordStateForFrmHeap(heap, FRAME_HEAP_TAG);
 
    OSScreenInit();
@@ -42,59 +93,97 @@ WHBLogConsoleInit()
       return FALSE;
    }
 
+   sConsoleBuffer = MEMAllocFromFrmHeapEx(heap, numLines * lineLength, 4);
+   if (!sConsoleBuffer) {
+      WHBLogPrintf("sConsoleBuffer = MEMAllocFromFrmHeapEx(heap, 0x%X, 4) returned NULL", numLines * lineLength);
+      return FALSE;
+   }
+
+   sNumLines = numLines;
+   sLineLength = lineLength;
+   sTotalLines = 0;
+   sWorkBuffer = 0;
+   memset(sBufferState, 0, sizeof(sBufferState));
+
    OSScreenSetBufferEx(SCREEN_TV, sBufferTV);
    OSScreenSetBufferEx(SCREEN_DRC, sBufferDRC);
 
    OSScreenEnableEx(SCREEN_TV, 1);
    OSScreenEnableEx(SCREEN_DRC, 1);
    WHBAddLogHandler(consoleAddLine);
-   return FALSE;
+   return TRUE;
 }
 
 void
 WHBLogConsoleFree()
 {
    MEMHeapHandle heap = MEMGetBaseHeapHandle(MEM_BASE_HEAP_MEM1);
+   WHBRemoveLogHandler(consoleAddLine);
    OSScreenShutdown();
    MEMFreeByStateToFrmHeap(heap, FRAME_HEAP_TAG);
+   sConsoleBuffer = NULL;
 }
 
 void
 WHBLogConsoleDraw()
 {
-   OSScreenClearBufferEx(SCREEN_TV, 0x993333FF);
-   OSScreenClearBufferEx(SCREEN_DRC, 0x993333FF);
+   ConsoleBufferState *work = &sBufferState[sWorkBuffer];
+   ConsoleBufferState *visible = &sBufferState[sWorkBuffer ^ 1];
+   uint32_t end = sTotalLines;
+   uint32_t first = end > sNumLines ? end - sNumLines : 0;
+   uint32_t line;
+
+   if (!sConsoleBuffer) {
+      return;
+   }
 
-   for (int y = 0; y < NUM_LINES; ++y) {
-      OSScreenPutFontEx(SCREEN_TV, 0, y, sConsoleBuffer[y]);
-      OSScreenPutFontEx(SCREEN_DRC, 0, y, sConsoleBuffer[y]);
+   if (visible->valid && visible->first == first && visible->end == end) {
+      return;
    }
 
-   DCFlushRange(sBufferTV, sBufferSizeTV);
-   DCFlushRange(sBufferDRC, sBufferSizeDRC);
+   if (!work->valid || work->first != first || work->end > end) {
+      OSScreenClearBufferEx(SCREEN_TV, BACKGROUND_COLOUR);
+      OSScreenClearBufferEx(SCREEN_DRC, BACKGROUND_COLOUR);
+      work->end = first;
+   }
+
+   for (line = work->end; line < end; ++line) {
+      OSScreenPutFontEx(SCREEN_TV, 0, line - first, consoleGetLine(line));
+      OSScreenPutFontEx(SCREEN_DRC, 0, line - first, consoleGetLine(line));
+   }
+
+   work->valid = TRUE;
+   work->first = first;
+   work->end = end;
+
+   consoleFlushWorkBuffer(sBufferTV, sBufferSizeTV);
+   consoleFlushWorkBuffer(sBufferDRC, sBufferSizeDRC);
    OSScreenFlipBuffersEx(SCREEN_TV);
    OSScreenFlipBuffersEx(SCREEN_DRC);
+   sWorkBuffer ^= 1;
 }
 
 static void
 consoleAddLine(const char *line)
 {
-   int length = strlen(line);
+   while (*line) {
+      const char *newline = strchr(line, '\n');
+      uint32_t length = newline ? (uint32_t)(newline - line) : strlen(line);
+      char *dst = consoleGetLine(sTotalLines);
+      uint32_t copy = length;
+
+      if (copy > sLineLength - 1) {
+         copy = sLineLength - 1;
+      }
 
-   if (length > LINE_LENGTH) {
-      length = LINE_LENGTH - 1;
-   }
+      memcpy(dst, line, copy);
+      dst[copy] = 0;
+      sTotalLines++;
 
-   if (sLineNum == NUM_LINES) {
-      for (int i = 0; i < NUM_LINES - 1; ++i) {
-         memcpy(sConsoleBuffer[i], sConsoleBuffer[i + 1], LINE_LENGTH);
+      if (!newline) {
+         break;
       }
 
-      memcpy(sConsoleBuffer[sLineNum - 1], line, length);
-      sConsoleBuffer[sLineNum - 1][length] = 0;
-   } else {
-      memcpy(sConsoleBuffer[sLineNum], line, length);
-      sConsoleBuffer[sLineNum][length] = 0;
-      ++sLineNum;
+      line = newline + 1;
    }
 }
@@ -2,19 +2,38 @@
 #include <coreinit/core.h>
 #include <coreinit/debug.h>
 #include <coreinit/exception.h>
+#include <coreinit/filesystem.h>
 #include <coreinit/internal.h>
+#include <coreinit/memdefaultheap.h>
+#include <coreinit/spinlock.h>
 #include <coreinit/systeminfo.h>
 #include <coreinit/thread.h>
 #include <coreinit/time.h>
+#include <nsysnet/socket.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+#include <whb/align.h>
+#include <whb/libmanager.h>
 #include <whb/log.h>
+#include <whb/sdcard.h>
+
+#include "crash_stack.h"
 
 #define LOG_DISASSEMBLY_SIZE (4096)
 #define LOG_STACK_TRACE_SIZE (4096)
 #define LOG_REGISTER_SIZE (4096)
 
-#define THREAD_STACK_SIZE (4096)
+#define THREAD_STACK_SIZE (16 * 1024)
+
+#define MINIDUMP_MAX_THREADS (128)
+#define MINIDUMP_PATH_SIZE (256)
+
+typedef struct MinidumpRange
+{
+   uint32_t address;
+   uint32_t size;
+} MinidumpRange;
 
 static const char *
 sCrashType = NULL;
@@ -43,15 +62,359 @@ sCrashThreadStack[THREAD_STACK_SIZE];
 static OSThread __attribute__((aligned(8)))
 sCrashThread;
 
+static uint8_t *
+sMinidumpBuffer = NULL;
+
+static uint32_t
+sMinidumpBufferSize = 0;
+
+static uint32_t
+sMinidumpSize = 0;
+
+static uint32_t
+sMinidumpOutputs = 0;
+
+static MinidumpRange
+sMinidumpRanges[WHB_MINIDUMP_MAX_RANGES];
+
+static int
+sMinidumpSocket = -1;
+
+static struct sockaddr_in
+sMinidumpAddr;
+
+static uint8_t
+sMinidumpPacket[sizeof(WHBMinidumpChunk) + WHB_MINIDUMP_CHUNK_SIZE];
+
+static FSClient
+sMinidumpClient;
+
+static FSCmdBlock
+sMinidumpCmd;
+
+static OSSpinLock
+sLogRingLock;
+
+static char
+sLogRing[WHB_MINIDUMP_LOG_SIZE];
+
+static uint32_t
+sLogRingPos = 0;
+
+static void
+minidumpLogHandler(const char *msg)
+{
+   uint32_t length = strlen(msg);
+   uint32_t offset, chunk;
+
+   // Only the tail of messages longer than the ring can survive anyway
+   if (length > WHB_MINIDUMP_LOG_SIZE - 1) {
+      msg += length - (WHB_MINIDUMP_LOG_SIZE - 1);
+      length = WHB_MINIDUMP_LOG_SIZE - 1;
+   }
+
+   OSUninterruptibleSpinLock_Acquire(&sLogRingLock);
+   offset = sLogRingPos % WHB_MINIDUMP_LOG_SIZE;
+   chunk = WHB_MINIDUMP_LOG_SIZE - offset;
+   if (chunk > length) {
+      chunk = length;
+   }
+
+   memcpy(sLogRing + offset, msg, chunk);
+   memcpy(sLogRing, msg + chunk, length - chunk);
+   sLogRing[(sLogRingPos + length) % WHB_MINIDUMP_LOG_SIZE] = '\n';
+   sLogRingPos += length + 1;
+   OSUninterruptibleSpinLock_Release(&sLogRingLock);
+}
+
+static uint32_t
+minidumpSpace()
+{
+   uint32_t used = sMinidumpSize + sizeof(WHBMinidumpSection);
+   return used < sMinidumpBufferSize ? (sMinidumpBufferSize - used) & ~3 : 0;
+}
+
+static void *
+minidumpBeginSection(WHBMinidumpSectionType type,
+                     uint32_t size)
+{
+   WHBMinidumpHeader *header = (WHBMinidumpHeader *)sMinidumpBuffer;
+   WHBMinidumpSection *section;
+   uint32_t padded = WHBAlignUp(size, 4);
+
+   if (padded > minidumpSpace()) {
+      return NULL;
+   }
+
+   section = (WHBMinidumpSection *)(sMinidumpBuffer + sMinidumpSize);
+   section->type = (uint16_t)type;
+   section->flags = 0;
+   section->size = size;
+   memset((uint8_t *)(section + 1) + size, 0, padded - size);
+
+   sMinidumpSize += sizeof(WHBMinidumpSection) + padded;
+   header->numSections++;
+   return section + 1;
+}
+
+static void
+minidumpAddThread(OSThread *thread)
+{
+   OSContext *context = &thread->context;
+   WHBMinidumpThread *info;
+   uint32_t top = (uint32_t)thread->stackStart;
+   uint32_t bottom = (uint32_t)thread->stackEnd;
+   uint32_t sp = context->gpr[1];
+   uint32_t stackSize = 0;
+   uint32_t space = minidumpSpace();
+
+   if (space < sizeof(WHBMinidumpThread)) {
+      return;
+   }
+
+   if (top < bottom) {
+      top = bottom;
+      bottom = (uint32_t)thread->stackStart;
+   }
+
+   // The stack grows down, so the innermost frames are just above sp
+   if (sp >= bottom && sp < top) {
+      stackSize = top - sp;
+   }
+
+   if (stackSize > WHB_MINIDUMP_MAX_STACK) {
+      stackSize = WHB_MINIDUMP_MAX_STACK;
+   }
+
+   if (stackSize > space - sizeof(WHBMinidumpThread)) {
+      stackSize = space - sizeof(WHBMinidumpThread);
+   }
+
+   info = minidumpBeginSection(WHB_MINIDUMP_SECTION_THREAD,
+                               sizeof(WHBMinidumpThread) + stackSize);
+   memset(info, 0, sizeof(WHBMinidumpThread));
+   info->thread = (uint32_t)thread;
+   info->stackStart = (uint32_t)thread->stackStart;
+   info->stackEnd = (uint32_t)thread->stackEnd;
+   info->sp = sp;
+   info->lr = context->lr;
+   info->pc = context->srr0;
+   info->priority = thread->priority;
+   info->state = thread->state;
+   info->attr = thread->attr;
+   info->id = thread->id;
+   info->stackSize = stackSize;
+
+   if (thread->name) {
+      strncpy(info->name, thread->name, sizeof(info->name) - 1);
+   }
+
+   memcpy(info + 1, (void *)sp, stackSize);
+}
+
+static void
+minidumpAddLog()
+{
+   uint32_t start = sLogRingPos > WHB_MINIDUMP_LOG_SIZE ? sLogRingPos - WHB_MINIDUMP_LOG_SIZE : 0;
+   uint32_t length = sLogRingPos - start;
+   uint32_t offset, chunk;
+   char *dst;
+
+   if (length > minidumpSpace()) {
+      start += length - minidumpSpace();
+      length = minidumpSpace();
+   }
+
+   dst = minidumpBeginSection(WHB_MINIDUMP_SECTION_LOG, length);
+   if (!dst) {
+      return;
+   }
+
+   offset = start % WHB_MINIDUMP_LOG_SIZE;
+   chunk = WHB_MINIDUMP_LOG_SIZE - offset;
+   if (chunk > length) {
+      chunk = length;
+   }
+
+   memcpy(dst, sLogRing + offset, chunk);
+   memcpy(dst + chunk, sLogRing, length - chunk);
+}
+
+static void
+captureMinidump(OSExceptionType type,
+                OSContext *context)
+{
+   WHBMinidumpHeader *header = (WHBMinidumpHeader *)sMinidumpBuffer;
+   WHBMinidumpContext *info;
+   OSThread *thread = (OSThread *)context;
+   int i;
+
+   memset(header, 0, sizeof(WHBMinidumpHeader));
+   header->magic = WHB_MINIDUMP_MAGIC;
+   header->version = WHB_MINIDUMP_VERSION;
+   header->exceptionType = type;
+   header->time = OSGetTime();
+   header->core = OSGetCoreId();
+   header->upid = OSGetUPID();
+   header->textAnchor = (uint32_t)WHBInitCrashHandler;
+   sMinidumpSize = sizeof(WHBMinidumpHeader);
+
+   info = minidumpBeginSection(WHB_MINIDUMP_SECTION_CONTEXT,
+                               sizeof(WHBMinidumpContext));
+   if (info) {
+      memcpy(info->gpr, context->gpr, sizeof(info->gpr));
+      info->cr = context->cr;
+      info->lr = context->lr;
+      info->ctr = context->ctr;
+      info->xer = context->xer;
+      info->srr0 = context->srr0;
+      info->srr1 = context->srr1;
+      info->dsisr = context->dsisr;
+      info->dar = context->dar;
+      info->fpscr = context->fpscr;
+      memcpy(info->gqr, context->gqr, sizeof(info->gqr));
+      info->thread = (uint32_t)thread;
+      memcpy(info->fpr, context->fpr, sizeof(info->fpr));
+      memcpy(info->psf, context->psf, sizeof(info->psf));
+   }
+
+   // Recent log output and the requested ranges are the most useful after
+   // the crashing thread, so reserve room for them before the other threads.
+   minidumpAddLog();
+
+   for (i = 0; i < WHB_MINIDUMP_MAX_RANGES; ++i) {
+      uint32_t size = sMinidumpRanges[i].size;
+      uint32_t *dst;
+
+      if (!size) {
+         continue;
+      }
+
+      if (size + 4 > minidumpSpace()) {
+         size = minidumpSpace() > 4 ? minidumpSpace() - 4 : 0;
+      }
+
+      dst = minidumpBeginSection(WHB_MINIDUMP_SECTION_MEMORY, size + 4);
+      if (dst) {
+         dst[0] = sMinidumpRanges[i].address;
+         memcpy(dst + 1, (void *)sMinidumpRanges[i].address, size);
+      }
+   }
+
+   minidumpAddThread(thread);
+
+   for (i = 0; i < MINIDUMP_MAX_THREADS && thread->activeLink.prev; ++i) {
+      thread = thread->activeLink.prev;
+   }
+
+   for (i = 0; thread && i < MINIDUMP_MAX_THREADS; ++i) {
+      if (thread != (OSThread *)context) {
+         minidumpAddThread(thread);
+      }
+
+      thread = thread->activeLink.next;
+   }
+
+   header->size = sMinidumpSize;
+}
+
+static void
+writeMinidumpSdCard()
+{
+   WHBMinidumpHeader *header = (WHBMinidumpHeader *)sMinidumpBuffer;
+   char path[MINIDUMP_PATH_SIZE];
+   FSFileHandle handle;
+   FSStatus result;
+
+   if (!WHBMountSdCard()) {
+      return;
+   }
+
+   snprintf(path, sizeof(path), "%s/whb_minidump_%08X.dmp",
+            WHBGetSdCardMountPath(), (unsigned)header->time);
+
+   result = FSAddClient(&sMinidumpClient, -1);
+   if (result != FS_STATUS_OK) {
+      WHBLogPrintf("%s: FSAddClient error %d", __FUNCTION__, result);
+      return;
+   }
+
+   FSInitCmdBlock(&sMinidumpCmd);
+   result = FSOpenFile(&sMinidumpClient, &sMinidumpCmd, path, "w", &handle, -1);
+   if (result < 0) {
+      WHBLogPrintf("%s: FSOpenFile(%s) error %d", __FUNCTION__, path, result);
+      goto out;
+   }
+
+   result = FSWriteFile(&sMinidumpClient, &sMinidumpCmd, sMinidumpBuffer,
+                        1, sMinidumpSize, handle, 0, -1);
+   FSCloseFile(&sMinidumpClient, &sMinidumpCmd, handle, -1);
+
+   if (result < 0) {
+      WHBLogPrintf("%s: FSWriteFile error %d", __FUNCTION__, result);
+   } else {
+      WHBLogPrintf("Minidump written to %s", path);
+   }
+
+out:
+   FSDelClient(&sMinidumpClient, -1);
+}
+
+static void
+sendMinidumpUdp()
+{
+   WHBMinidumpHeader *header = (WHBMinidumpHeader *)sMinidumpBuffer;
+   WHBMinidumpChunk *chunk = (WHBMinidumpChunk *)sMinidumpPacket;
+   uint32_t offset;
+
+   if (sMinidumpSocket < 0) {
+      return;
+   }
+
+   for (offset = 0; offset < sMinidumpSize; offset += WHB_MINIDUMP_CHUNK_SIZE) {
+      uint32_t size = sMinidumpSize - offset;
+      if (size > WHB_MINIDUMP_CHUNK_SIZE) {
+         size = WHB_MINIDUMP_CHUNK_SIZE;
+      }
+
+      chunk->magic = WHB_MINIDUMP_CHUNK_MAGIC;
+      chunk->id = (uint32_t)header->time;
+      chunk->offset = offset;
+      chunk->totalSize = sMinidumpSize;
+      memcpy(chunk + 1, sMinidumpBuffer + offset, size);
+
+      sendto(sMinidumpSocket,
+             sMinidumpPacket,
+             sizeof(WHBMinidumpChunk) + size,
+             0,
+             (struct sockaddr *)&sMinidumpAddr,
+             sizeof(struct sockaddr_in));
+
+      // Pace the datagrams so the receiver does not drop any
+      OSSleepTicks(OSMillisecondsToTicks(1));
+   }
+
+   WHBLogPrintf("Minidump of %u bytes sent", (unsigned)sMinidumpSize);
+}
+
 static int
 crashReportThread(int argc, const char **argv)
 {
+   if (sMinidumpSize) {
+      if (sMinidumpOutputs & WHB_MINIDUMP_OUTPUT_SDCARD) {
+         writeMinidumpSdCard();
+      }
+
+      if (sMinidumpOutputs & WHB_MINIDUMP_OUTPUT_UDP) {
+         sendMinidumpUdp();
+      }
+   }
+
    // Log crash dump
    WHBLogPrint(sRegistersBuffer);
    WHBLogPrint(sDisassemblyBuffer);
    WHBLogPrint(sStackTraceBuffer);
 
-   // TODO: Save crash dump to SD card?
    return 0;
 }
 
@@ -84,25 +447,21 @@ getDisassembly(OSContext *context)
 static void
 getStackTrace(OSContext *context)
 {
-   int i;
+   uint32_t frames[16];
+   uint32_t i, count;
    uint32_t *stackPtr;
    char name[256];
 
    sStackTraceLength = 0;
    sStackTraceBuffer[0] = 0;
-   stackPtr = (uint32_t *)context->gpr[1];
+   count = CrashWalkStack(context->gpr[1], 0, 0xFFFFFFFF, frames, 16);
 
    sStackTraceLength += sprintf(sStackTraceBuffer + sStackTraceLength,
                                 "Address:      Back Chain    LR Save\n");
 
-   for (i = 0; i < 16; ++i) {
+   for (i = 0; i < count; ++i) {
       uint32_t addr;
-
-      if (!stackPtr ||
-          (uintptr_t)stackPtr == 0x1 ||
-          (uintptr_t)stackPtr == 0xFFFFFFFF) {
-         break;
-      }
+      stackPtr = (uint32_t *)frames[i];
 
       sStackTraceLength += sprintf(sStackTraceBuffer + sStackTraceLength,
                                    "0x%08x:   0x%08x    0x%08x",
@@ -118,7 +477,6 @@ getStackTrace(OSContext *context)
       }
 
       sStackTraceLength += sprintf(sStackTraceBuffer + sStackTraceLength, "\n");
-      stackPtr = (uint32_t *)*stackPtr;
    }
 
    sStackTraceBuffer[sStackTraceLength] = 0;
@@ -215,9 +573,16 @@ getRegisters(OSContext *context)
 
 static BOOL
 handleException(const char *type,
+                OSExceptionType exceptionType,
                 OSContext *context)
 {
    sCrashType = type;
+
+   // Capture the minidump before anything else runs
+   if (sMinidumpBuffer) {
+      captureMinidump(exceptionType, context);
+   }
+
    getDisassembly(context);
    getStackTrace(context);
    getRegisters(context);
@@ -239,25 +604,25 @@ handleException(const char *type,
 static BOOL
 handleAlignment(OSContext *context)
 {
-   return handleException("ALIGNMENT", context);
+   return handleException("ALIGNMENT", OS_EXCEPTION_TYPE_ALIGNMENT, context);
 }
 
 static BOOL
 handleDSI(OSContext *context)
 {
-   return handleException("DSI", context);
+   return handleException("DSI", OS_EXCEPTION_TYPE_DSI, context);
 }
 
 static BOOL
 handleISI(OSContext *context)
 {
-   return handleException("ISI", context);
+   return handleException("ISI", OS_EXCEPTION_TYPE_ISI, context);
 }
 
 static BOOL
 handleProgram(OSContext *context)
 {
-   return handleException("PROGRAM", context);
+   return handleException("PROGRAM", OS_EXCEPTION_TYPE_PROGRAM, context);
 }
 
 BOOL
@@ -273,3 +638,109 @@ WHBInitCrashHandler()
                             OS_EXCEPTION_TYPE_PROGRAM, handleProgram);
    return TRUE;
 }
+
+BOOL
+WHBCrashEnableMinidump(uint32_t bufferSize,
+                       uint32_t outputs)
+{
+   int broadcastEnable = 1;
+
+   WHBCrashDisableMinidump();
+
+   bufferSize &= ~3;
+   if (bufferSize < sizeof(WHBMinidumpHeader) + sizeof(WHBMinidumpSection) + sizeof(WHBMinidumpContext)) {
+      return FALSE;
+   }
+
+   // FS requires 0x40 aligned buffers
+   sMinidumpBuffer = MEMAllocFromDefaultHeapEx(bufferSize, 0x40);
+   if (!sMinidumpBuffer) {
+      WHBLogPrintf("%s: MEMAllocFromDefaultHeapEx(0x%X, 0x40) returned NULL", __FUNCTION__, (unsigned)bufferSize);
+      return FALSE;
+   }
+
+   if (outputs & WHB_MINIDUMP_OUTPUT_UDP) {
+      WHBInitializeSocketLibrary();
+      sMinidumpSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+      if (sMinidumpSocket < 0) {
+         WHBLogPrintf("%s: socket error %d", __FUNCTION__, sMinidumpSocket);
+         WHBDeinitializeSocketLibrary();
+         MEMFreeToDefaultHeap(sMinidumpBuffer);
+         sMinidumpBuffer = NULL;
+         return FALSE;
+      }
+
+      setsockopt(sMinidumpSocket, SOL_SOCKET, SO_BROADCAST, &broadcastEnable, sizeof(broadcastEnable));
+      memset(&sMinidumpAddr, 0, sizeof(struct sockaddr_in));
+      sMinidumpAddr.sin_family = AF_INET;
+      sMinidumpAddr.sin_port = htons(WHB_MINIDUMP_PORT);
+      sMinidumpAddr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+   }
+
+   sMinidumpBufferSize = bufferSize;
+   sMinidumpSize = 0;
+   sMinidumpOutputs = outputs;
+   sLogRingPos = 0;
+   OSInitSpinLock(&sLogRingLock);
+   WHBAddLogHandler(minidumpLogHandler);
+   return TRUE;
+}
+
+void
+WHBCrashDisableMinidump()
+{
+   if (!sMinidumpBuffer) {
+      return;
+   }
+
+   WHBRemoveLogHandler(minidumpLogHandler);
+
+   if (sMinidumpSocket >= 0) {
+      socketclose(sMinidumpSocket);
+      sMinidumpSocket = -1;
+      WHBDeinitializeSocketLibrary();
+   }
+
+   MEMFreeToDefaultHeap(sMinidumpBuffer);
+   sMinidumpBuffer = NULL;
+   sMinidumpBufferSize = 0;
+   sMinidumpOutputs = 0;
+   memset(sMinidumpRanges, 0, sizeof(sMinidumpRanges));
+}
+
+BOOL
+WHBCrashMinidumpSetUdpTarget(uint32_t address,
+                             uint16_t port)
+{
+   int broadcastEnable = (address == INADDR_BROADCAST);
+
+   if (sMinidumpSocket < 0) {
+      return FALSE;
+   }
+
+   setsockopt(sMinidumpSocket, SOL_SOCKET, SO_BROADCAST, &broadcastEnable, sizeof(broadcastEnable));
+   sMinidumpAddr.sin_port = htons(port);
+   sMinidumpAddr.sin_addr.s_addr = htonl(address);
+   return TRUE;
+}
+
+BOOL
+WHBCrashMinidumpAddRange(const void *address,
+                         uint32_t size)
+{
+   int i;
+
+   if (!size) {
+      return FALSE;
+   }
+
+   for (i = 0; i < WHB_MINIDUMP_MAX_RANGES; ++i) {
+      if (!sMinidumpRanges[i].size) {
+         sMinidumpRanges[i].address = (uint32_t)address;
+         sMinidumpRanges[i].size = size;
+         return TRUE;
+      }
+   }
+
+   return FALSE;
+}
@@ -0,0 +1,27 @@
+#include "crash_stack.h"
+
+uint32_t
+CrashWalkStack(uint32_t sp,
+               uint32_t stackLow,
+               uint32_t stackHigh,
+               uint32_t *frames,
+               uint32_t maxFrames)
+{
+   uint32_t count = 0;
+
+   while (count < maxFrames) {
+      if (!sp || sp == 0x1 || sp == 0xFFFFFFFF || (sp & 3) ||
+          sp < stackLow || sp > stackHigh - 8) {
+         break;
+      }
+
+      if (count && sp <= frames[count - 1]) {
+         break;
+      }
+
+      frames[count++] = sp;
+      sp = *(uint32_t *)sp;
+   }
+
+   return count;
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include <wut.h>
+
+/**
+ * Follow the back chain from sp, storing the address of each stack frame.
+ * Frames must be word aligned, move towards the top of the stack and lie
+ * within [stackLow, stackHigh), so this is safe on a live stack.
+ */
+uint32_t
+CrashWalkStack(uint32_t sp,
+               uint32_t stackLow,
+               uint32_t stackHigh,
+               uint32_t *frames,
+               uint32_t maxFrames);
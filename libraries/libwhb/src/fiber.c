@@ -0,0 +1,652 @@
+#include <coreinit/atomic.h>
+#include <coreinit/coroutine.h>
+#include <coreinit/event.h>
+#include <coreinit/memdefaultheap.h>
+#include <coreinit/semaphore.h>
+#include <coreinit/spinlock.h>
+#include <coreinit/thread.h>
+#include <whb/fiber.h>
+#include <whb/log.h>
+
+#include <string.h>
+
+#define JOB_QUEUE_MASK (WHB_FIBER_JOB_QUEUE_SIZE - 1)
+
+// Room left above a fiber's stack pointer for its entry function's frame
+#define FIBER_STACK_HEADROOM 16
+
+typedef enum
+{
+   FIBER_STATE_FREE,
+   FIBER_STATE_RUNNING,
+   FIBER_STATE_WAITING,
+   FIBER_STATE_YIELDED,
+} FiberState;
+
+struct WHBFiber
+{
+   OSCoroutine coroutine;
+   FiberState state;
+   WHBFiberJob *job;
+   WHBFiberCounter *waitCounter;
+   int32_t waitTarget;
+   WHBFiber *next;
+   void *stack;
+};
+
+typedef struct
+{
+   OSThread thread;
+   OSCoroutine coroutine;
+   WHBFiber *current;
+   void *stack;
+} FiberScheduler;
+
+typedef struct
+{
+   WHBFiber *head;
+   WHBFiber *tail;
+} FiberList;
+
+// A thread which is not running a job, blocked in WHBFiberWaitForCounter.
+struct WHBFiberThreadWaiter
+{
+   OSEvent event;
+   int32_t target;
+   WHBFiberThreadWaiter *next;
+};
+
+static FiberScheduler *
+sSchedulers[WHB_FIBER_NUM_SCHEDULERS] = { 0 };
+
+static WHBFiber *
+sFibers = NULL;
+
+static uint32_t
+sNumFibers = 0;
+
+// Protects the free and ready lists and every counter's waiters.
+static OSSpinLock
+sFiberLock;
+
+static WHBFiber *
+sFreeFibers = NULL;
+
+static FiberList
+sReadyFibers = { 0 };
+
+static OSSpinLock
+sJobLock;
+
+static WHBFiberJob *
+sJobQueue[WHB_FIBER_JOB_QUEUE_SIZE];
+
+static uint32_t
+sJobHead = 0;
+
+static uint32_t
+sJobTail = 0;
+
+static OSSemaphore
+sWakeSemaphore;
+
+static volatile uint32_t
+sSleepingSchedulers = 0;
+
+static volatile BOOL
+sRunning = FALSE;
+
+static inline void
+listPush(FiberList *list,
+         WHBFiber *fiber)
+{
+   fiber->next = NULL;
+   if (list->tail) {
+      list->tail->next = fiber;
+   } else {
+      list->head = fiber;
+   }
+   list->tail = fiber;
+}
+
+static inline WHBFiber *
+listPop(FiberList *list)
+{
+   WHBFiber *fiber = list->head;
+   if (fiber) {
+      list->head = fiber->next;
+      if (!list->head) {
+         list->tail = NULL;
+      }
+   }
+   return fiber;
+}
+
+static inline FiberScheduler *
+getCurrentScheduler()
+{
+   OSThread *thread = OSGetCurrentThread();
+   int i;
+
+   for (i = 0; i < WHB_FIBER_NUM_SCHEDULERS; ++i) {
+      if (sSchedulers[i] && &sSchedulers[i]->thread == thread) {
+         return sSchedulers[i];
+      }
+   }
+
+   return NULL;
+}
+
+static void
+wakeScheduler()
+{
+   uint32_t sleeping;
+
+   while ((sleeping = sSleepingSchedulers) > 0) {
+      if (OSCompareAndSwapAtomic(&sSleepingSchedulers, sleeping, sleeping - 1)) {
+         OSSignalSemaphore(&sWakeSemaphore);
+         return;
+      }
+   }
+}
+
+static void
+makeReady(WHBFiber *fibers)
+{
+   WHBFiber *next;
+
+   if (!fibers) {
+      return;
+   }
+
+   OSUninterruptibleSpinLock_Acquire(&sFiberLock);
+   while (fibers) {
+      next = fibers->next;
+      listPush(&sReadyFibers, fibers);
+      fibers = next;
+   }
+   OSUninterruptibleSpinLock_Release(&sFiberLock);
+
+   wakeScheduler();
+}
+
+static BOOL
+pushJob(WHBFiberJob *job)
+{
+   BOOL result = FALSE;
+
+   OSUninterruptibleSpinLock_Acquire(&sJobLock);
+   if (sJobTail - sJobHead < WHB_FIBER_JOB_QUEUE_SIZE) {
+      sJobQueue[sJobTail & JOB_QUEUE_MASK] = job;
+      sJobTail++;
+      result = TRUE;
+   }
+   OSUninterruptibleSpinLock_Release(&sJobLock);
+   return result;
+}
+
+static WHBFiberJob *
+popJob()
+{
+   WHBFiberJob *job = NULL;
+
+   if (sJobHead == sJobTail) {
+      return NULL;
+   }
+
+   OSUninterruptibleSpinLock_Acquire(&sJobLock);
+   if (sJobHead != sJobTail) {
+      job = sJobQueue[sJobHead & JOB_QUEUE_MASK];
+      sJobHead++;
+   }
+   OSUninterruptibleSpinLock_Release(&sJobLock);
+   return job;
+}
+
+static void
+counterAdd(WHBFiberCounter *counter,
+           int32_t value)
+{
+   WHBFiber *ready = NULL;
+   WHBFiber **link;
+   WHBFiber *fiber;
+   WHBFiberThreadWaiter *wake = NULL;
+   WHBFiberThreadWaiter **waiterLink;
+   WHBFiberThreadWaiter *waiter;
+
+   // Update the value under the lock, so a fiber registering to wait sees
+   // either the old value and gets woken here, or the new value.
+   OSUninterruptibleSpinLock_Acquire(&sFiberLock);
+   counter->value += value;
+
+   link = &counter->waiters;
+   while ((fiber = *link)) {
+      if (counter->value <= fiber->waitTarget) {
+         *link = fiber->next;
+         fiber->next = ready;
+         ready = fiber;
+      } else {
+         link = &fiber->next;
+      }
+   }
+
+   waiterLink = &counter->threadWaiters;
+   while ((waiter = *waiterLink)) {
+      if (counter->value <= waiter->target) {
+         *waiterLink = waiter->next;
+         waiter->next = wake;
+         wake = waiter;
+      } else {
+         waiterLink = &waiter->next;
+      }
+   }
+   OSUninterruptibleSpinLock_Release(&sFiberLock);
+
+   makeReady(ready);
+
+   // A waiter lives on its thread's stack, so read next before waking it
+   while ((waiter = wake)) {
+      wake = waiter->next;
+      OSSignalEvent(&waiter->event);
+   }
+}
+
+static void
+switchToScheduler(WHBFiber *fiber)
+{
+   FiberScheduler *scheduler = getCurrentScheduler();
+   OSSwitchCoroutine(&fiber->coroutine, &scheduler->coroutine);
+}
+
+static void
+fiberMain()
+{
+   FiberScheduler *scheduler = getCurrentScheduler();
+   WHBFiber *fiber = scheduler->current;
+   WHBFiberJob *job;
+
+   while (TRUE) {
+      job = fiber->job;
+      job->fn(job->arg);
+
+      if (job->counter) {
+         counterAdd(job->counter, -1);
+      }
+
+      fiber->job = NULL;
+      fiber->state = FIBER_STATE_FREE;
+      switchToScheduler(fiber);
+   }
+}
+
+static void
+fiberSwitchedOut(WHBFiber *fiber)
+{
+   WHBFiberCounter *counter;
+
+   // Only now the fiber's context is saved may it be resumed elsewhere.
+   switch (fiber->state) {
+   case FIBER_STATE_FREE:
+      OSUninterruptibleSpinLock_Acquire(&sFiberLock);
+      fiber->next = sFreeFibers;
+      sFreeFibers = fiber;
+      OSUninterruptibleSpinLock_Release(&sFiberLock);
+
+      // Queued jobs may have been waiting for a free fiber
+      if (sJobHead != sJobTail) {
+         wakeScheduler();
+      }
+      break;
+   case FIBER_STATE_WAITING:
+      counter = fiber->waitCounter;
+      OSUninterruptibleSpinLock_Acquire(&sFiberLock);
+      if (counter->value <= fiber->waitTarget) {
+         listPush(&sReadyFibers, fiber);
+      } else {
+         fiber->next = counter->waiters;
+         counter->waiters = fiber;
+      }
+      OSUninterruptibleSpinLock_Release(&sFiberLock);
+      break;
+   case FIBER_STATE_YIELDED:
+      makeReady(fiber);
+      break;
+   default:
+      break;
+   }
+}
+
+static WHBFiber *
+findFiber()
+{
+   WHBFiber *fiber;
+   WHBFiberJob *job;
+
+   OSUninterruptibleSpinLock_Acquire(&sFiberLock);
+   fiber = listPop(&sReadyFibers);
+   if (!fiber && sFreeFibers && sJobHead != sJobTail) {
+      fiber = sFreeFibers;
+      sFreeFibers = fiber->next;
+      fiber->job = NULL;
+   }
+   OSUninterruptibleSpinLock_Release(&sFiberLock);
+
+   if (!fiber || fiber->job || fiber->state != FIBER_STATE_FREE) {
+      return fiber;
+   }
+
+   // A free fiber, give it a job
+   job = popJob();
+   if (!job) {
+      fiber->next = NULL;
+      fiberSwitchedOut(fiber);
+      return NULL;
+   }
+
+   fiber->job = job;
+   return fiber;
+}
+
+static void
+schedulerIdle()
+{
+   uint32_t sleeping;
+
+   OSAddAtomic((volatile int32_t *)&sSleepingSchedulers, 1);
+
+   // Queued jobs can only run once a fiber is free, as in findFiber
+   if (sRunning && !sReadyFibers.head && (!sFreeFibers || sJobHead == sJobTail)) {
+      OSWaitSemaphore(&sWakeSemaphore);
+      return;
+   }
+
+   // See workerIdle in job.c
+   while (TRUE) {
+      sleeping = sSleepingSchedulers;
+      if (sleeping == 0) {
+         OSWaitSemaphore(&sWakeSemaphore);
+         break;
+      }
+
+      if (OSCompareAndSwapAtomic(&sSleepingSchedulers, sleeping, sleeping - 1)) {
+         break;
+      }
+   }
+}
+
+static int
+schedulerMain(int argc,
+              const char **argv)
+{
+   FiberScheduler *scheduler = (FiberScheduler *)argv;
+   WHBFiber *fiber;
+
+   while (sRunning) {
+      fiber = findFiber();
+      if (!fiber) {
+         schedulerIdle();
+         continue;
+      }
+
+      fiber->state = FIBER_STATE_RUNNING;
+      scheduler->current = fiber;
+      OSSwitchCoroutine(&scheduler->coroutine, &fiber->coroutine);
+      scheduler->current = NULL;
+      fiberSwitchedOut(fiber);
+   }
+
+   return 0;
+}
+
+BOOL
+WHBFiberSystemInit(uint32_t numFibers,
+                   uint32_t fiberStackSize,
+                   int32_t priority)
+{
+   uint32_t i;
+
+   if (sRunning) {
+      WHBLogPrintf("%s: Fiber system is already running.", __FUNCTION__);
+      return TRUE;
+   }
+
+   OSInitSpinLock(&sFiberLock);
+   OSInitSpinLock(&sJobLock);
+   OSInitSemaphore(&sWakeSemaphore, 0);
+   sJobHead = sJobTail = 0;
+   sSleepingSchedulers = 0;
+   sFreeFibers = NULL;
+   sReadyFibers.head = sReadyFibers.tail = NULL;
+
+   sFibers = MEMAllocFromDefaultHeapEx(sizeof(WHBFiber) * numFibers, 16);
+   if (!sFibers) {
+      WHBLogPrintf("%s: Failed to allocate %u fibers.", __FUNCTION__, numFibers);
+      return FALSE;
+   }
+
+   memset(sFibers, 0, sizeof(WHBFiber) * numFibers);
+   sNumFibers = numFibers;
+
+   for (i = 0; i < numFibers; ++i) {
+      WHBFiber *fiber = &sFibers[i];
+      fiber->stack = MEMAllocFromDefaultHeapEx(fiberStackSize, 16);
+      if (!fiber->stack) {
+         WHBLogPrintf("%s: Failed to allocate fiber stack %u.", __FUNCTION__, i);
+         WHBFiberSystemShutdown();
+         return FALSE;
+      }
+
+      OSInitCoroutine(&fiber->coroutine, (void *)fiberMain,
+                      (uint8_t *)fiber->stack + fiberStackSize - FIBER_STACK_HEADROOM);
+      fiber->state = FIBER_STATE_FREE;
+      fiber->next = sFreeFibers;
+      sFreeFibers = fiber;
+   }
+
+   sRunning = TRUE;
+
+   for (i = 0; i < WHB_FIBER_NUM_SCHEDULERS; ++i) {
+      // The scheduler thread only switches between fibers, a small stack is enough
+      uint32_t stackSize = 16 * 1024;
+      FiberScheduler *scheduler = MEMAllocFromDefaultHeapEx(sizeof(FiberScheduler), 16);
+      void *stack = MEMAllocFromDefaultHeapEx(stackSize, 16);
+      if (!scheduler || !stack) {
+         WHBLogPrintf("%s: Failed to allocate scheduler %u.", __FUNCTION__, i);
+         if (scheduler) {
+            MEMFreeToDefaultHeap(scheduler);
+         }
+         if (stack) {
+            MEMFreeToDefaultHeap(stack);
+         }
+         WHBFiberSystemShutdown();
+         return FALSE;
+      }
+
+      memset(scheduler, 0, sizeof(FiberScheduler));
+      scheduler->stack = stack;
+
+      if (!OSCreateThread(&scheduler->thread,
+                          schedulerMain,
+                          0,
+                          (char *)scheduler,
+                          (uint8_t *)stack + stackSize,
+                          stackSize,
+                          priority,
+                          (OSThreadAttributes)(OS_THREAD_ATTRIB_AFFINITY_CPU0 << i))) {
+         WHBLogPrintf("%s: Failed to create scheduler %u.", __FUNCTION__, i);
+         MEMFreeToDefaultHeap(scheduler);
+         MEMFreeToDefaultHeap(stack);
+         WHBFiberSystemShutdown();
+         return FALSE;
+      }
+
+      OSSetThreadName(&scheduler->thread, "WHBFiberScheduler");
+      sSchedulers[i] = scheduler;
+      OSResumeThread(&scheduler->thread);
+   }
+
+   return TRUE;
+}
+
+void
+WHBFiberSystemShutdown()
+{
+   uint32_t i;
+
+   sRunning = FALSE;
+
+   for (i = 0; i < WHB_FIBER_NUM_SCHEDULERS; ++i) {
+      OSSignalSemaphore(&sWakeSemaphore);
+   }
+
+   for (i = 0; i < WHB_FIBER_NUM_SCHEDULERS; ++i) {
+      if (!sSchedulers[i]) {
+         continue;
+      }
+
+      OSJoinThread(&sSchedulers[i]->thread, NULL);
+      MEMFreeToDefaultHeap(sSchedulers[i]->stack);
+      MEMFreeToDefaultHeap(sSchedulers[i]);
+      sSchedulers[i] = NULL;
+   }
+
+   if (sFibers) {
+      for (i = 0; i < sNumFibers; ++i) {
+         if (sFibers[i].stack) {
+            MEMFreeToDefaultHeap(sFibers[i].stack);
+         }
+      }
+
+      MEMFreeToDefaultHeap(sFibers);
+      sFibers = NULL;
+      sNumFibers = 0;
+   }
+}
+
+void
+WHBFiberCounterInit(WHBFiberCounter *counter)
+{
+   counter->value = 0;
+   counter->waiters = NULL;
+   counter->threadWaiters = NULL;
+}
+
+void
+WHBFiberCounterAdd(WHBFiberCounter *counter,
+                   int32_t value)
+{
+   counterAdd(counter, value);
+}
+
+void
+WHBFiberCounterDecrement(WHBFiberCounter *counter)
+{
+   counterAdd(counter, -1);
+}
+
+int32_t
+WHBFiberCounterGet(WHBFiberCounter *counter)
+{
+   int32_t value;
+
+   OSUninterruptibleSpinLock_Acquire(&sFiberLock);
+   value = counter->value;
+   OSUninterruptibleSpinLock_Release(&sFiberLock);
+   return value;
+}
+
+void
+WHBFiberRunJobs(WHBFiberJob *jobs,
+                uint32_t count,
+                WHBFiberCounter *counter)
+{
+   uint32_t i;
+
+   if (counter) {
+      counterAdd(counter, (int32_t)count);
+   }
+
+   for (i = 0; i < count; ++i) {
+      jobs[i].counter = counter;
+
+      while (!pushJob(&jobs[i])) {
+         // Queue is full, let the schedulers catch up
+         wakeScheduler();
+         if (WHBFiberIsInJob()) {
+            WHBFiberYield();
+         } else {
+            OSYieldThread();
+         }
+      }
+
+      wakeScheduler();
+   }
+}
+
+static void
+waitForCounterOnThread(WHBFiberCounter *counter,
+                       int32_t target)
+{
+   WHBFiberThreadWaiter waiter;
+
+   // Not in a job, so block the thread until counterAdd signals us
+   OSInitEvent(&waiter.event, FALSE, OS_EVENT_MODE_MANUAL);
+   waiter.target = target;
+
+   OSUninterruptibleSpinLock_Acquire(&sFiberLock);
+   if (counter->value <= target) {
+      OSUninterruptibleSpinLock_Release(&sFiberLock);
+      return;
+   }
+
+   waiter.next = counter->threadWaiters;
+   counter->threadWaiters = &waiter;
+   OSUninterruptibleSpinLock_Release(&sFiberLock);
+
+   OSWaitEvent(&waiter.event);
+}
+
+void
+WHBFiberWaitForCounter(WHBFiberCounter *counter,
+                       int32_t target)
+{
+   FiberScheduler *scheduler = getCurrentScheduler();
+   WHBFiber *fiber = scheduler ? scheduler->current : NULL;
+
+   if (!fiber) {
+      waitForCounterOnThread(counter, target);
+      return;
+   }
+
+   if (WHBFiberCounterGet(counter) <= target) {
+      return;
+   }
+
+   fiber->waitCounter = counter;
+   fiber->waitTarget = target;
+   fiber->state = FIBER_STATE_WAITING;
+   switchToScheduler(fiber);
+   fiber->waitCounter = NULL;
+}
+
+void
+WHBFiberYield()
+{
+   FiberScheduler *scheduler = getCurrentScheduler();
+   WHBFiber *fiber = scheduler ? scheduler->current : NULL;
+
+   if (!fiber) {
+      OSYieldThread();
+      return;
+   }
+
+   fiber->state = FIBER_STATE_YIELDED;
+   switchToScheduler(fiber);
+}
+
+BOOL
+WHBFiberIsInJob()
+{
+   FiberScheduler *scheduler = getCurrentScheduler();
+   return scheduler && scheduler->current;
+}
@@ -1,8 +1,10 @@
 #include "gfx_heap.h"
+#include "gfx_profiler.h"
 
 #include <gx2/clear.h>
 #include <gx2/context.h>
 #include <gx2/display.h>
+#include <gx2/displaylist.h>
 #include <gx2/event.h>
 #include <gx2/mem.h>
 #include <gx2/registers.h>
@@ -17,11 +19,29 @@
 #include <whb/gfx.h>
 #include <whb/log.h>
 
-#define WHB_GFX_COMMAND_BUFFER_POOL_SIZE (0x400000)
+#define COMMAND_BUFFER_HISTORY (8)
+
+typedef struct GfxFrameCommands
+{
+   OSTime timeStamp;
+   uint32_t bytes;
+} GfxFrameCommands;
 
 static void *
 sCommandBufferPool = NULL;
 
+static uint32_t
+sCommandBufferPoolSize = 0;
+
+static uintptr_t
+sCommandBufferStart = 0;
+
+static GfxFrameCommands
+sFrameCommands[COMMAND_BUFFER_HISTORY];
+
+static WHBGfxCommandBufferStats
+sCommandBufferStats;
+
 static GX2DrcRenderMode
 sDrcRenderMode;
 
@@ -67,6 +87,24 @@ sDrcContextState = NULL;
 static BOOL
 sDrawingTv = FALSE;
 
+static WHBGfxMode
+sMode = WHB_GFX_MODE_SEPARATE;
+
+static GX2BufferingMode
+sBufferingMode = GX2_BUFFERING_MODE_DOUBLE;
+
+static uint32_t
+sMaxFramesInFlight = 0;
+
+static uint32_t
+sFrameCount = 0;
+
+static OSTime
+sFrameTimeStamps[WHB_GFX_MAX_FRAMES_IN_FLIGHT] = { 0 };
+
+static OSTime
+sLastWaitTime = 0;
+
 static BOOL
 sGpuTimedOut = FALSE;
 
@@ -175,7 +213,7 @@ GfxProcCallbackAcquired(void *context)
       goto error;
    }
    GX2Invalidate(GX2_INVALIDATE_MODE_CPU, sTvScanBuffer, sTvScanBufferSize);
-   GX2SetTVBuffer(sTvScanBuffer, sTvScanBufferSize, sTvRenderMode, sTvSurfaceFormat, GX2_BUFFERING_MODE_DOUBLE);
+   GX2SetTVBuffer(sTvScanBuffer, sTvScanBufferSize, sTvRenderMode, sTvSurfaceFormat, sBufferingMode);
 
    // Allocate TV colour buffer.
    sTvColourBuffer.surface.image = GfxHeapAllocMEM1(sTvColourBuffer.surface.imageSize, sTvColourBuffer.surface.alignment);
@@ -209,7 +247,12 @@ GfxProcCallbackAcquired(void *context)
       goto error;
    }
    GX2Invalidate(GX2_INVALIDATE_MODE_CPU, sDrcScanBuffer, sDrcScanBufferSize);
-   GX2SetDRCBuffer(sDrcScanBuffer, sDrcScanBufferSize, sDrcRenderMode, sDrcSurfaceFormat, GX2_BUFFERING_MODE_DOUBLE);
+   GX2SetDRCBuffer(sDrcScanBuffer, sDrcScanBufferSize, sDrcRenderMode, sDrcSurfaceFormat, sBufferingMode);
+
+   // When mirroring the DRC is scanned out from the TV colour buffer.
+   if (sMode == WHB_GFX_MODE_MIRROR_TV_TO_DRC) {
+      return 0;
+   }
 
    // Allocate DRC colour buffer.
    sDrcColourBuffer.surface.image = GfxHeapAllocMEM1(sDrcColourBuffer.surface.imageSize, sDrcColourBuffer.surface.alignment);
@@ -278,14 +321,47 @@ GfxProcCallbackReleased(void *context)
    return 0;
 }
 
+void
+WHBGfxGetDefaultConfig(WHBGfxConfig *config)
+{
+   memset(config, 0, sizeof(WHBGfxConfig));
+   config->mode = WHB_GFX_MODE_SEPARATE;
+   config->bufferingMode = GX2_BUFFERING_MODE_DOUBLE;
+   config->swapInterval = 1;
+   config->maxFramesInFlight = 0;
+   config->commandBufferPoolSize = WHB_GFX_DEFAULT_COMMAND_BUFFER_POOL_SIZE;
+}
+
 BOOL
 WHBGfxInit()
+{
+   return WHBGfxInitEx(NULL);
+}
+
+BOOL
+WHBGfxInitEx(const WHBGfxConfig *config)
 {
    uint32_t drcWidth, drcHeight;
    uint32_t tvWidth, tvHeight;
    uint32_t unk;
+   WHBGfxConfig defaultConfig;
 
-   sCommandBufferPool = GfxHeapAllocMEM2(WHB_GFX_COMMAND_BUFFER_POOL_SIZE,
+   if (!config) {
+      WHBGfxGetDefaultConfig(&defaultConfig);
+      config = &defaultConfig;
+   }
+
+   sMode = config->mode;
+   sBufferingMode = config->bufferingMode == GX2_BUFFERING_MODE_TRIPLE ?
+      GX2_BUFFERING_MODE_TRIPLE : GX2_BUFFERING_MODE_DOUBLE;
+   sMaxFramesInFlight = config->maxFramesInFlight < WHB_GFX_MAX_FRAMES_IN_FLIGHT ?
+      config->maxFramesInFlight : WHB_GFX_MAX_FRAMES_IN_FLIGHT;
+   sFrameCount = 0;
+   memset(sFrameTimeStamps, 0, sizeof(sFrameTimeStamps));
+
+   sCommandBufferPoolSize = config->commandBufferPoolSize ?
+      config->commandBufferPoolSize : WHB_GFX_DEFAULT_COMMAND_BUFFER_POOL_SIZE;
+   sCommandBufferPool = GfxHeapAllocMEM2(sCommandBufferPoolSize,
                                          GX2_COMMAND_BUFFER_ALIGNMENT);
    if (!sCommandBufferPool) {
       WHBLogPrintf("%s: failed to allocate command buffer pool", __FUNCTION__);
@@ -294,12 +370,15 @@ WHBGfxInit()
 
    uint32_t initAttribs[] = {
       GX2_INIT_CMD_BUF_BASE, (uintptr_t)sCommandBufferPool,
-      GX2_INIT_CMD_BUF_POOL_SIZE, WHB_GFX_COMMAND_BUFFER_POOL_SIZE,
+      GX2_INIT_CMD_BUF_POOL_SIZE, sCommandBufferPoolSize,
       GX2_INIT_ARGC, 0,
       GX2_INIT_ARGV, 0,
       GX2_INIT_END
    };
    GX2Init(initAttribs);
+   WHBGfxResetCommandBufferStats();
+   memset(sFrameCommands, 0, sizeof(sFrameCommands));
+   sCommandBufferStart = 0;
 
    sDrcRenderMode = GX2GetSystemDRCScanMode();
    sTvSurfaceFormat = GX2_SURFACE_FORMAT_UNORM_R8_G8_B8_A8;
@@ -331,13 +410,19 @@ WHBGfxInit()
    drcHeight = 480;
 
    // Setup TV and DRC buffers - they will be allocated in GfxProcCallbackAcquired.
-   GX2CalcTVSize(sTvRenderMode, sTvSurfaceFormat, GX2_BUFFERING_MODE_DOUBLE, &sTvScanBufferSize, &unk);
+   GX2CalcTVSize(sTvRenderMode, sTvSurfaceFormat, sBufferingMode, &sTvScanBufferSize, &unk);
    GfxInitTvColourBuffer(&sTvColourBuffer, tvWidth, tvHeight, sTvSurfaceFormat, GX2_AA_MODE1X);
    GfxInitDepthBuffer(&sTvDepthBuffer, sTvColourBuffer.surface.width, sTvColourBuffer.surface.height, GX2_SURFACE_FORMAT_FLOAT_R32, sTvColourBuffer.surface.aa);
 
-   GX2CalcDRCSize(sDrcRenderMode, sDrcSurfaceFormat, GX2_BUFFERING_MODE_DOUBLE, &sDrcScanBufferSize, &unk);
-   GfxInitTvColourBuffer(&sDrcColourBuffer, drcWidth, drcHeight, sDrcSurfaceFormat, GX2_AA_MODE1X);
-   GfxInitDepthBuffer(&sDrcDepthBuffer, sDrcColourBuffer.surface.width, sDrcColourBuffer.surface.height, GX2_SURFACE_FORMAT_FLOAT_R32, sDrcColourBuffer.surface.aa);
+   GX2CalcDRCSize(sDrcRenderMode, sDrcSurfaceFormat, sBufferingMode, &sDrcScanBufferSize, &unk);
+   if (sMode == WHB_GFX_MODE_SEPARATE) {
+      GfxInitTvColourBuffer(&sDrcColourBuffer, drcWidth, drcHeight, sDrcSurfaceFormat, GX2_AA_MODE1X);
+      GfxInitDepthBuffer(&sDrcDepthBuffer, sDrcColourBuffer.surface.width, sDrcColourBuffer.surface.height, GX2_SURFACE_FORMAT_FLOAT_R32, sDrcColourBuffer.surface.aa);
+   } else {
+      memset(&sDrcColourBuffer, 0, sizeof(GX2ColorBuffer));
+      memset(&sDrcDepthBuffer, 0, sizeof(GX2DepthBuffer));
+   }
+
    if (GfxProcCallbackAcquired(NULL) != 0) {
       WHBLogPrintf("%s: GfxProcCallbackAcquired failed", __FUNCTION__);
       goto error;
@@ -362,21 +447,26 @@ WHBGfxInit()
    GX2SetTVScale((float)sTvColourBuffer.surface.width, (float)sTvColourBuffer.surface.height);
 
    // Initialise DRC context state.
-   sDrcContextState = GfxHeapAllocMEM2(sizeof(GX2ContextState), GX2_CONTEXT_STATE_ALIGNMENT);
-   if (!sDrcContextState) {
-      WHBLogPrintf("%s: failed to allocate sDrcContextState", __FUNCTION__);
-      goto error;
+   if (sMode == WHB_GFX_MODE_SEPARATE) {
+      sDrcContextState = GfxHeapAllocMEM2(sizeof(GX2ContextState), GX2_CONTEXT_STATE_ALIGNMENT);
+      if (!sDrcContextState) {
+         WHBLogPrintf("%s: failed to allocate sDrcContextState", __FUNCTION__);
+         goto error;
+      }
+      GX2SetupContextStateEx(sDrcContextState, TRUE);
+      GX2SetContextState(sDrcContextState);
+      GX2SetColorBuffer(&sDrcColourBuffer, GX2_RENDER_TARGET_0);
+      GX2SetDepthBuffer(&sDrcDepthBuffer);
+      GX2SetViewport(0, 0, (float)sDrcColourBuffer.surface.width, (float)sDrcColourBuffer.surface.height, 0.0f, 1.0f);
+      GX2SetScissor(0, 0, (float)sDrcColourBuffer.surface.width, (float)sDrcColourBuffer.surface.height);
+      GX2SetDRCScale((float)sDrcColourBuffer.surface.width, (float)sDrcColourBuffer.surface.height);
+   } else {
+      GX2SetDRCScale((float)drcWidth, (float)drcHeight);
+      GX2SetContextState(sTvContextState);
    }
-   GX2SetupContextStateEx(sDrcContextState, TRUE);
-   GX2SetContextState(sDrcContextState);
-   GX2SetColorBuffer(&sDrcColourBuffer, GX2_RENDER_TARGET_0);
-   GX2SetDepthBuffer(&sDrcDepthBuffer);
-   GX2SetViewport(0, 0, (float)sDrcColourBuffer.surface.width, (float)sDrcColourBuffer.surface.height, 0.0f, 1.0f);
-   GX2SetScissor(0, 0, (float)sDrcColourBuffer.surface.width, (float)sDrcColourBuffer.surface.height);
-   GX2SetDRCScale((float)sDrcColourBuffer.surface.width, (float)sDrcColourBuffer.surface.height);
 
-   // Set 60fps VSync
-   GX2SetSwapInterval(1);
+   // 0 would turn vsync off, treat it as unset like the other fields
+   GX2SetSwapInterval(config->swapInterval ? config->swapInterval : 1);
 
    return TRUE;
 
@@ -463,11 +553,20 @@ WHBGfxBeginRender()
    uint32_t swapCount, flipCount;
    OSTime lastFlip, lastVsync;
    uint32_t waitCount = 0;
+   OSTime start = OSGetSystemTime();
+
+   // Let the CPU run at most sMaxFramesInFlight frames ahead of the GPU.
+   if (sMaxFramesInFlight && sFrameCount >= sMaxFramesInFlight) {
+      GX2WaitTimeStamp(sFrameTimeStamps[(sFrameCount - sMaxFramesInFlight) % WHB_GFX_MAX_FRAMES_IN_FLIGHT]);
+   }
 
+   // The scan buffer we copy to must not be waiting to be displayed, with
+   // triple buffering one swap can still be queued.
    while (1) {
       GX2GetSwapStatus(&swapCount, &flipCount, &lastFlip, &lastVsync);
 
-      if (flipCount >= swapCount) {
+      if (flipCount >= swapCount ||
+          swapCount - flipCount < (uint32_t)sBufferingMode - 1) {
          break;
       }
 
@@ -478,20 +577,140 @@ WHBGfxBeginRender()
       }
 
       waitCount++;
-      GX2WaitForVsync();
+      GX2WaitForFlip();
    }
+
+   sLastWaitTime = OSGetSystemTime() - start;
+   GfxProfilerBeginFrame();
+}
+
+static void
+GfxUpdateCommandBufferStats()
+{
+   GfxFrameCommands *frame = &sFrameCommands[sFrameCount % COMMAND_BUFFER_HISTORY];
+   OSTime retired = GX2GetRetiredTimeStamp();
+   void *displayList;
+   uint32_t size, i;
+   uintptr_t start;
+
+   // Nothing to measure while the app is recording its own display list
+   if (GX2GetDisplayListWriteStatus() ||
+       !GX2GetCurrentDisplayList(&displayList, &size)) {
+      return;
+   }
+
+   // The flush at the end of the frame starts a new command buffer, so the
+   // distance from the previous frame's start is this frame's usage.
+   start = (uintptr_t)displayList;
+   if (sCommandBufferStart) {
+      frame->bytes = start >= sCommandBufferStart ?
+         start - sCommandBufferStart :
+         start + sCommandBufferPoolSize - sCommandBufferStart;
+      frame->timeStamp = GX2GetLastSubmittedTimeStamp();
+
+      sCommandBufferStats.frameBytes = frame->bytes;
+      if (frame->bytes > sCommandBufferStats.maxFrameBytes) {
+         sCommandBufferStats.maxFrameBytes = frame->bytes;
+      }
+
+      sCommandBufferStats.inFlightBytes = 0;
+      for (i = 0; i < COMMAND_BUFFER_HISTORY; ++i) {
+         if (sFrameCommands[i].timeStamp > retired) {
+            sCommandBufferStats.inFlightBytes += sFrameCommands[i].bytes;
+         }
+      }
+
+      if (sCommandBufferStats.inFlightBytes > sCommandBufferStats.maxInFlightBytes) {
+         sCommandBufferStats.maxInFlightBytes = sCommandBufferStats.inFlightBytes;
+      }
+   }
+
+   sCommandBufferStart = start;
 }
 
 void
 WHBGfxFinishRender()
 {
+   GfxProfilerEndFrame();
    GX2SwapScanBuffers();
    GX2Flush();
-   GX2DrawDone();
+   GfxUpdateCommandBufferStats();
+
+   if (sMaxFramesInFlight) {
+      sFrameTimeStamps[sFrameCount % WHB_GFX_MAX_FRAMES_IN_FLIGHT] = GX2GetLastSubmittedTimeStamp();
+   } else {
+      GX2DrawDone();
+   }
+
+   sFrameCount++;
    GX2SetTVEnable(TRUE);
    GX2SetDRCEnable(TRUE);
 }
 
+void
+WHBGfxSetSwapInterval(uint32_t interval)
+{
+   // 0 means the default of 1, as in WHBGfxConfig
+   GX2SetSwapInterval(interval ? interval : 1);
+}
+
+void
+WHBGfxSetTargetFrameRate(uint32_t framesPerSecond)
+{
+   uint32_t interval = 1;
+
+   if (framesPerSecond && framesPerSecond < 60) {
+      interval = (60 + framesPerSecond / 2) / framesPerSecond;
+   }
+
+   GX2SetSwapInterval(interval);
+}
+
+void
+WHBGfxSetMaxFramesInFlight(uint32_t frames)
+{
+   int i;
+
+   if (frames > WHB_GFX_MAX_FRAMES_IN_FLIGHT) {
+      frames = WHB_GFX_MAX_FRAMES_IN_FLIGHT;
+   }
+
+   // Frames submitted with a lower limit have no timestamp recorded, so
+   // wait for them and treat every slot as retired.
+   if (frames > sMaxFramesInFlight) {
+      GX2DrawDone();
+      for (i = 0; i < WHB_GFX_MAX_FRAMES_IN_FLIGHT; ++i) {
+         sFrameTimeStamps[i] = GX2GetLastSubmittedTimeStamp();
+      }
+   }
+
+   sMaxFramesInFlight = frames;
+}
+
+void
+WHBGfxGetFrameStats(WHBGfxFrameStats *stats)
+{
+   uint32_t swapCount, flipCount;
+
+   GX2GetSwapStatus(&swapCount, &flipCount, &stats->lastFlip, &stats->lastVsync);
+   stats->frameCount = sFrameCount;
+   stats->pendingSwaps = flipCount < swapCount ? swapCount - flipCount : 0;
+   stats->waitTime = sLastWaitTime;
+}
+
+void
+WHBGfxGetCommandBufferStats(WHBGfxCommandBufferStats *stats)
+{
+   *stats = sCommandBufferStats;
+}
+
+void
+WHBGfxResetCommandBufferStats()
+{
+   memset(&sCommandBufferStats, 0, sizeof(sCommandBufferStats));
+   sCommandBufferStats.poolSize = sCommandBufferPoolSize;
+}
+
 void
 WHBGfxClearColor(float r, float g, float b, float a)
 {
@@ -506,9 +725,23 @@ WHBGfxClearColor(float r, float g, float b, float a)
    }
 }
 
+BOOL
+WHBGfxIsDRCMirrored()
+{
+   return sMode == WHB_GFX_MODE_MIRROR_TV_TO_DRC;
+}
+
 void
 WHBGfxBeginRenderDRC()
 {
+   if (sMode == WHB_GFX_MODE_MIRROR_TV_TO_DRC) {
+      // There is no DRC target, anything drawn now goes to the TV buffer
+      // after it has already been copied out.
+      GX2SetContextState(sTvContextState);
+      sDrawingTv = TRUE;
+      return;
+   }
+
    GX2SetContextState(sDrcContextState);
    sDrawingTv = FALSE;
 }
@@ -516,6 +749,10 @@ WHBGfxBeginRenderDRC()
 void
 WHBGfxFinishRenderDRC()
 {
+   if (sMode == WHB_GFX_MODE_MIRROR_TV_TO_DRC) {
+      return;
+   }
+
    GX2CopyColorBufferToScanBuffer(&sDrcColourBuffer, GX2_SCAN_TARGET_DRC);
 }
 
@@ -530,4 +767,9 @@ void
 WHBGfxFinishRenderTV()
 {
    GX2CopyColorBufferToScanBuffer(&sTvColourBuffer, GX2_SCAN_TARGET_TV);
+
+   // The scan buffer copy scales to the DRC resolution
+   if (sMode == WHB_GFX_MODE_MIRROR_TV_TO_DRC) {
+      GX2CopyColorBufferToScanBuffer(&sTvColourBuffer, GX2_SCAN_TARGET_DRC);
+   }
 }
@@ -0,0 +1,162 @@
+#include "gfx_heap.h"
+#include <gx2/displaylist.h>
+#include <gx2/enum.h>
+#include <gx2/event.h>
+#include <gx2/mem.h>
+#include <string.h>
+#include <whb/gfx.h>
+#include <whb/log.h>
+
+static BOOL
+GfxDisplayListIsRetired(BOOL called,
+                        OSTime timeStamp)
+{
+   // Only a submission after timeStamp is sure to contain the call
+   return !called || GX2GetRetiredTimeStamp() > timeStamp;
+}
+
+static void
+GfxDisplayListFreeRetired(WHBGfxDisplayList *list,
+                          BOOL wait)
+{
+   if (!list->retiredBuffer) {
+      return;
+   }
+
+   if (!GfxDisplayListIsRetired(TRUE, list->retiredTimeStamp)) {
+      if (!wait) {
+         return;
+      }
+
+      GX2DrawDone();
+   }
+
+   GfxHeapFreeMEM2(list->retiredBuffer);
+   list->retiredBuffer = NULL;
+}
+
+void
+WHBGfxInitDisplayList(WHBGfxDisplayList *list,
+                      WHBGfxDisplayListRecordFn record,
+                      void *userData,
+                      uint32_t maxSize)
+{
+   memset(list, 0, sizeof(WHBGfxDisplayList));
+   list->record = record;
+   list->userData = userData;
+   list->maxSize = maxSize ? maxSize : WHB_GFX_DISPLAY_LIST_DEFAULT_MAX_SIZE;
+}
+
+BOOL
+WHBGfxRecordDisplayList(WHBGfxDisplayList *list)
+{
+   void *scratch;
+   uint32_t size, capacity;
+
+   if (!list->record) {
+      return FALSE;
+   }
+
+   if (GX2GetDisplayListWriteStatus()) {
+      WHBLogPrintf("%s: another display list is being recorded", __FUNCTION__);
+      return FALSE;
+   }
+
+   // Measure pass, the size is not known until the commands are written
+   scratch = GfxHeapAllocMEM2(list->maxSize, GX2_DISPLAY_LIST_ALIGNMENT);
+   if (!scratch) {
+      WHBLogPrintf("%s: GfxHeapAllocMEM2(0x%X, 0x%X) returned NULL",
+                   __FUNCTION__, (unsigned)list->maxSize, GX2_DISPLAY_LIST_ALIGNMENT);
+      return FALSE;
+   }
+
+   GX2BeginDisplayListEx(scratch, list->maxSize, TRUE);
+   list->record(list->userData);
+   size = GX2EndDisplayList(scratch);
+
+   if (!size || size >= list->maxSize) {
+      WHBLogPrintf("%s: recorded 0x%X bytes into a 0x%X byte buffer",
+                   __FUNCTION__, (unsigned)size, (unsigned)list->maxSize);
+      GfxHeapFreeMEM2(scratch);
+      return FALSE;
+   }
+
+   // The GPU may still be reading the current buffer from an earlier frame,
+   // in which case it is kept until then and a new one is used.
+   if (list->buffer &&
+       (size > list->capacity || !GfxDisplayListIsRetired(list->called, list->callTimeStamp))) {
+      GfxDisplayListFreeRetired(list, TRUE);
+      if (list->called) {
+         list->retiredBuffer = list->buffer;
+         list->retiredTimeStamp = GX2GetLastSubmittedTimeStamp();
+      } else {
+         GfxHeapFreeMEM2(list->buffer);
+      }
+
+      list->buffer = NULL;
+   }
+
+   if (!list->buffer) {
+      capacity = (size + GX2_DISPLAY_LIST_ALIGNMENT - 1) & ~(GX2_DISPLAY_LIST_ALIGNMENT - 1);
+      list->buffer = GfxHeapAllocMEM2(capacity, GX2_DISPLAY_LIST_ALIGNMENT);
+      if (!list->buffer) {
+         WHBLogPrintf("%s: GfxHeapAllocMEM2(0x%X, 0x%X) returned NULL",
+                      __FUNCTION__, (unsigned)capacity, GX2_DISPLAY_LIST_ALIGNMENT);
+         GfxHeapFreeMEM2(scratch);
+         list->capacity = 0;
+         list->valid = FALSE;
+         return FALSE;
+      }
+
+      list->capacity = capacity;
+   }
+
+   memcpy(list->buffer, scratch, size);
+   GX2Invalidate(GX2_INVALIDATE_MODE_CPU, list->buffer, size);
+   GfxHeapFreeMEM2(scratch);
+
+   list->size = size;
+   list->valid = TRUE;
+   list->called = FALSE;
+   return TRUE;
+}
+
+void
+WHBGfxInvalidateDisplayList(WHBGfxDisplayList *list)
+{
+   list->valid = FALSE;
+}
+
+BOOL
+WHBGfxCallDisplayList(WHBGfxDisplayList *list)
+{
+   if (!list->valid && !WHBGfxRecordDisplayList(list)) {
+      return FALSE;
+   }
+
+   GfxDisplayListFreeRetired(list, FALSE);
+   GX2CallDisplayList(list->buffer, list->size);
+   list->called = TRUE;
+   list->callTimeStamp = GX2GetLastSubmittedTimeStamp();
+   return TRUE;
+}
+
+void
+WHBGfxFreeDisplayList(WHBGfxDisplayList *list)
+{
+   GfxDisplayListFreeRetired(list, TRUE);
+
+   if (list->buffer) {
+      if (!GfxDisplayListIsRetired(list->called, list->callTimeStamp)) {
+         GX2DrawDone();
+      }
+
+      GfxHeapFreeMEM2(list->buffer);
+      list->buffer = NULL;
+   }
+
+   list->size = 0;
+   list->capacity = 0;
+   list->valid = FALSE;
+   list->called = FALSE;
+}
@@ -0,0 +1,356 @@
+#include "gfx_profiler.h"
+#include <coreinit/cache.h>
+#include <coreinit/memdefaultheap.h>
+#include <coreinit/time.h>
+#include <gx2/event.h>
+#include <stdio.h>
+#include <string.h>
+#include <whb/gfx.h>
+#include <whb/log.h>
+#include <whb/telemetry.h>
+
+// One more than can be in flight, so a frame has always retired when its
+// query memory comes round again.
+#define NUM_FRAMES (WHB_GFX_MAX_FRAMES_IN_FLIGHT + 1)
+#define QUERY_ALIGNMENT (0x40)
+#define QUERY_FRAME_SIZE \
+   ((sizeof(GfxProfilerQuery) * (WHB_GFX_PROFILER_MAX_PASSES + 1) + QUERY_ALIGNMENT - 1) & ~(QUERY_ALIGNMENT - 1))
+
+typedef struct GfxProfilerQuery
+{
+   uint64_t begin;
+   uint64_t end;
+} GfxProfilerQuery;
+
+typedef struct GfxProfilerFrame
+{
+   //! Written by the GPU, queries[0] is the whole frame.
+   GfxProfilerQuery *queries;
+   const char *names[WHB_GFX_PROFILER_MAX_PASSES];
+   uint32_t depths[WHB_GFX_PROFILER_MAX_PASSES];
+   uint32_t numPasses;
+   OSTime submitted;
+   BOOL pending;
+} GfxProfilerFrame;
+
+typedef struct GfxProfilerMetric
+{
+   const char *name;
+   WHBTelemetryId id;
+} GfxProfilerMetric;
+
+static void *
+sQueryMemory = NULL;
+
+static GfxProfilerFrame
+sFrames[NUM_FRAMES];
+
+static GfxProfilerFrame *
+sCurrentFrame = NULL;
+
+static uint32_t
+sFrameCount = 0;
+
+static int32_t
+sPassStack[WHB_GFX_PROFILER_MAX_DEPTH];
+
+static uint32_t
+sPassDepth = 0;
+
+static uint32_t
+sOverflowDepth = 0;
+
+static uint32_t
+sOutputs = 0;
+
+static uint32_t
+sLogInterval = 0;
+
+static uint32_t
+sLogCount = 0;
+
+static uint32_t
+sDroppedFrames = 0;
+
+static float
+sFrameTime = 0.0f;
+
+static WHBGfxProfilerPass
+sPasses[WHB_GFX_PROFILER_MAX_PASSES];
+
+static uint32_t
+sNumPasses = 0;
+
+static WHBTelemetryId
+sFrameMetric = WHB_TELEMETRY_INVALID;
+
+static GfxProfilerMetric
+sPassMetrics[WHB_GFX_PROFILER_MAX_PASSES];
+
+static uint32_t
+sNumPassMetrics = 0;
+
+static float
+GfxProfilerMilliseconds(const GfxProfilerQuery *query)
+{
+   OSTime begin, end;
+
+   if (query->end <= query->begin) {
+      return 0.0f;
+   }
+
+   begin = GX2GPUTimeToCPUTime(query->begin);
+   end = GX2GPUTimeToCPUTime(query->end);
+   return (float)OSTicksToMicroseconds(end - begin) / 1000.0f;
+}
+
+static WHBTelemetryId
+GfxProfilerGetMetric(const char *name)
+{
+   char metricName[WHB_TELEMETRY_MAX_NAME + 1];
+   GfxProfilerMetric *metric;
+   uint32_t i;
+
+   for (i = 0; i < sNumPassMetrics; ++i) {
+      if (sPassMetrics[i].name == name) {
+         return sPassMetrics[i].id;
+      }
+   }
+
+   if (sNumPassMetrics >= WHB_GFX_PROFILER_MAX_PASSES) {
+      return WHB_TELEMETRY_INVALID;
+   }
+
+   snprintf(metricName, sizeof(metricName), "gpu.%s", name);
+   metric = &sPassMetrics[sNumPassMetrics++];
+   metric->name = name;
+   metric->id = WHBTelemetryRegister(metricName, WHB_TELEMETRY_GAUGE);
+   return metric->id;
+}
+
+static void
+GfxProfilerReport()
+{
+   uint32_t i;
+
+   if (sOutputs & WHB_GFX_PROFILER_OUTPUT_TELEMETRY) {
+      if (sFrameMetric == WHB_TELEMETRY_INVALID) {
+         sFrameMetric = WHBTelemetryRegister("gpu.frame", WHB_TELEMETRY_GAUGE);
+      }
+
+      WHBTelemetryGaugeSet(sFrameMetric, (int32_t)(sFrameTime * 1000.0f));
+      for (i = 0; i < sNumPasses; ++i) {
+         WHBTelemetryGaugeSet(GfxProfilerGetMetric(sPasses[i].name),
+                              (int32_t)(sPasses[i].milliseconds * 1000.0f));
+      }
+   }
+
+   if ((sOutputs & WHB_GFX_PROFILER_OUTPUT_LOG) && ++sLogCount >= sLogInterval) {
+      sLogCount = 0;
+      WHBLogPrintf("GPU frame %.3fms", sFrameTime);
+      for (i = 0; i < sNumPasses; ++i) {
+         WHBLogPrintf("  %*s%s %.3fms", (int)(sPasses[i].depth * 2), "",
+                      sPasses[i].name, sPasses[i].milliseconds);
+      }
+   }
+}
+
+static void
+GfxProfilerReadFrame(GfxProfilerFrame *frame)
+{
+   uint32_t i;
+
+   DCInvalidateRange(frame->queries, QUERY_FRAME_SIZE);
+   sFrameTime = GfxProfilerMilliseconds(&frame->queries[0]);
+
+   for (i = 0; i < frame->numPasses; ++i) {
+      sPasses[i].name = frame->names[i];
+      sPasses[i].depth = frame->depths[i];
+      sPasses[i].milliseconds = GfxProfilerMilliseconds(&frame->queries[i + 1]);
+   }
+
+   sNumPasses = frame->numPasses;
+   GfxProfilerReport();
+}
+
+void
+GfxProfilerBeginFrame()
+{
+   GfxProfilerFrame *frame;
+
+   if (!sQueryMemory) {
+      return;
+   }
+
+   // The previous frame was flushed by WHBGfxFinishRender
+   if (sFrameCount) {
+      sFrames[(sFrameCount - 1) % NUM_FRAMES].submitted = GX2GetLastSubmittedTimeStamp();
+   }
+
+   // Read the frame NUM_FRAMES ago from the query memory we are about to
+   // reuse, but never wait for it.
+   frame = &sFrames[sFrameCount % NUM_FRAMES];
+   if (frame->pending) {
+      if (GX2GetRetiredTimeStamp() >= frame->submitted) {
+         GfxProfilerReadFrame(frame);
+      } else {
+         sDroppedFrames++;
+      }
+
+      frame->pending = FALSE;
+   }
+
+   frame->numPasses = 0;
+   sPassDepth = 0;
+   sOverflowDepth = 0;
+   sCurrentFrame = frame;
+   GX2SampleTopGPUCycle(&frame->queries[0].begin);
+}
+
+void
+GfxProfilerEndFrame()
+{
+   if (!sCurrentFrame) {
+      return;
+   }
+
+   while (sPassDepth || sOverflowDepth) {
+      WHBGfxProfilerEndPass();
+   }
+
+   GX2SampleBottomGPUCycle(&sCurrentFrame->queries[0].end);
+   sCurrentFrame->pending = TRUE;
+   sCurrentFrame = NULL;
+   sFrameCount++;
+}
+
+BOOL
+WHBGfxProfilerInit(uint32_t outputs,
+                   uint32_t logInterval)
+{
+   uint32_t i;
+
+   if (sQueryMemory) {
+      return FALSE;
+   }
+
+   sQueryMemory = MEMAllocFromDefaultHeapEx(QUERY_FRAME_SIZE * NUM_FRAMES, QUERY_ALIGNMENT);
+   if (!sQueryMemory) {
+      WHBLogPrintf("%s: MEMAllocFromDefaultHeapEx(0x%X, 0x%X) returned NULL",
+                   __FUNCTION__, (unsigned)(QUERY_FRAME_SIZE * NUM_FRAMES), QUERY_ALIGNMENT);
+      return FALSE;
+   }
+
+   // Nothing dirty may be left in the cache to be written over GPU results
+   memset(sQueryMemory, 0, QUERY_FRAME_SIZE * NUM_FRAMES);
+   DCFlushRange(sQueryMemory, QUERY_FRAME_SIZE * NUM_FRAMES);
+
+   for (i = 0; i < NUM_FRAMES; ++i) {
+      memset(&sFrames[i], 0, sizeof(GfxProfilerFrame));
+      sFrames[i].queries = (GfxProfilerQuery *)((uint8_t *)sQueryMemory + QUERY_FRAME_SIZE * i);
+   }
+
+   sCurrentFrame = NULL;
+   sFrameCount = 0;
+   sOutputs = outputs;
+   sLogInterval = logInterval;
+   sLogCount = 0;
+   sDroppedFrames = 0;
+   sFrameTime = 0.0f;
+   sNumPasses = 0;
+   return TRUE;
+}
+
+void
+WHBGfxProfilerShutdown()
+{
+   BOOL pending = sCurrentFrame != NULL;
+   uint32_t i;
+
+   if (!sQueryMemory) {
+      return;
+   }
+
+   for (i = 0; i < NUM_FRAMES; ++i) {
+      pending |= sFrames[i].pending;
+   }
+
+   // The GPU may still have timestamps to write into the query memory
+   if (pending) {
+      GX2DrawDone();
+   }
+
+   MEMFreeToDefaultHeap(sQueryMemory);
+   sQueryMemory = NULL;
+   sCurrentFrame = NULL;
+}
+
+void
+WHBGfxProfilerBeginPass(const char *name)
+{
+   GfxProfilerFrame *frame = sCurrentFrame;
+   int32_t index = -1;
+
+   if (!frame) {
+      return;
+   }
+
+   if (sPassDepth >= WHB_GFX_PROFILER_MAX_DEPTH) {
+      sOverflowDepth++;
+      return;
+   }
+
+   if (frame->numPasses < WHB_GFX_PROFILER_MAX_PASSES) {
+      index = frame->numPasses++;
+      frame->names[index] = name;
+      frame->depths[index] = sPassDepth;
+      GX2SampleTopGPUCycle(&frame->queries[index + 1].begin);
+   }
+
+   sPassStack[sPassDepth++] = index;
+}
+
+void
+WHBGfxProfilerEndPass()
+{
+   int32_t index;
+
+   if (!sCurrentFrame) {
+      return;
+   }
+
+   if (sOverflowDepth) {
+      sOverflowDepth--;
+      return;
+   }
+
+   if (!sPassDepth) {
+      return;
+   }
+
+   index = sPassStack[--sPassDepth];
+   if (index >= 0) {
+      GX2SampleBottomGPUCycle(&sCurrentFrame->queries[index + 1].end);
+   }
+}
+
+float
+WHBGfxProfilerGetFrameTime()
+{
+   return sFrameTime;
+}
+
+uint32_t
+WHBGfxProfilerGetPasses(WHBGfxProfilerPass *passes,
+                        uint32_t maxPasses)
+{
+   uint32_t count = sNumPasses < maxPasses ? sNumPasses : maxPasses;
+   memcpy(passes, sPasses, count * sizeof(WHBGfxProfilerPass));
+   return count;
+}
+
+uint32_t
+WHBGfxProfilerGetDroppedFrames()
+{
+   return sDroppedFrames;
+}
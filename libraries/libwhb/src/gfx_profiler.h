@@ -0,0 +1,8 @@
+#pragma once
+#include <wut.h>
+
+void
+GfxProfilerBeginFrame();
+
+void
+GfxProfilerEndFrame();
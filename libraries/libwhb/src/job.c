@@ -0,0 +1,654 @@
+#include <coreinit/atomic.h>
+#include <coreinit/condition.h>
+#include <coreinit/memdefaultheap.h>
+#include <coreinit/mutex.h>
+#include <coreinit/semaphore.h>
+#include <coreinit/spinlock.h>
+#include <coreinit/thread.h>
+#include <coreinit/time.h>
+#include <whb/job.h>
+#include <whb/log.h>
+
+#include <string.h>
+
+#define DEQUE_MASK (WHB_JOB_DEQUE_SIZE - 1)
+#define STEAL_ATTEMPTS 8
+
+/*
+ * Each worker owns a Chase-Lev deque: the owner pushes and pops at the bottom
+ * and other threads steal from the top. The deque does not grow, a job which
+ * does not fit is run immediately by the submitting thread instead.
+ */
+typedef struct
+{
+   volatile int32_t top;
+   uint8_t topPadding[28];
+   volatile int32_t bottom;
+   uint8_t bottomPadding[28];
+   WHBJob *jobs[WHB_JOB_DEQUE_SIZE];
+} JobDeque;
+
+typedef struct
+{
+   OSThread thread;
+   JobDeque deque;
+   uint32_t random;
+   uint32_t index;
+   void *stack;
+} JobWorker;
+
+typedef struct
+{
+   OSSpinLock lock;
+   uint32_t head;
+   uint32_t tail;
+   WHBJob *jobs[WHB_JOB_DEQUE_SIZE];
+} JobQueue;
+
+typedef struct
+{
+   WHBJob job;
+   uint32_t begin;
+   uint32_t end;
+   WHBJobRangeFn fn;
+   void *arg;
+} JobRange;
+
+static JobWorker *
+sWorkers[WHB_JOB_NUM_WORKERS] = { 0 };
+
+static JobQueue
+sQueue;
+
+static OSSemaphore
+sWakeSemaphore;
+
+static volatile uint32_t
+sSleepingWorkers = 0;
+
+static OSMutex
+sWaitMutex;
+
+static OSCondition
+sWaitCondition;
+
+static volatile int32_t
+sBlockedWaiters = 0;
+
+static volatile BOOL
+sRunning = FALSE;
+
+static inline void
+memoryBarrier()
+{
+   // sync on PowerPC, and lets the tests build this file on the host
+   __sync_synchronize();
+}
+
+static inline BOOL
+dequePush(JobDeque *deque,
+          WHBJob *job)
+{
+   int32_t bottom = deque->bottom;
+   int32_t top = deque->top;
+
+   if (bottom - top >= WHB_JOB_DEQUE_SIZE) {
+      return FALSE;
+   }
+
+   deque->jobs[bottom & DEQUE_MASK] = job;
+   memoryBarrier();
+   deque->bottom = bottom + 1;
+   return TRUE;
+}
+
+static inline WHBJob *
+dequePop(JobDeque *deque)
+{
+   int32_t bottom = deque->bottom - 1;
+   int32_t top;
+   WHBJob *job = NULL;
+
+   deque->bottom = bottom;
+   memoryBarrier();
+   top = deque->top;
+
+   if (top <= bottom) {
+      job = deque->jobs[bottom & DEQUE_MASK];
+
+      if (top == bottom) {
+         // Last job, race any thieves for it
+         if (!OSCompareAndSwapAtomic((volatile uint32_t *)&deque->top, top, top + 1)) {
+            job = NULL;
+         }
+
+         deque->bottom = bottom + 1;
+      }
+   } else {
+      deque->bottom = bottom + 1;
+   }
+
+   return job;
+}
+
+static inline WHBJob *
+dequeSteal(JobDeque *deque)
+{
+   int32_t top = deque->top;
+   int32_t bottom;
+   WHBJob *job;
+
+   memoryBarrier();
+   bottom = deque->bottom;
+
+   if (top >= bottom) {
+      return NULL;
+   }
+
+   job = deque->jobs[top & DEQUE_MASK];
+   if (!OSCompareAndSwapAtomic((volatile uint32_t *)&deque->top, top, top + 1)) {
+      return NULL;
+   }
+
+   return job;
+}
+
+static BOOL
+queuePush(WHBJob *job)
+{
+   BOOL result = FALSE;
+
+   OSUninterruptibleSpinLock_Acquire(&sQueue.lock);
+   if (sQueue.tail - sQueue.head < WHB_JOB_DEQUE_SIZE) {
+      sQueue.jobs[sQueue.tail & DEQUE_MASK] = job;
+      sQueue.tail++;
+      result = TRUE;
+   }
+   OSUninterruptibleSpinLock_Release(&sQueue.lock);
+   return result;
+}
+
+static WHBJob *
+queuePop()
+{
+   WHBJob *job = NULL;
+
+   // Unlocked peek so idle workers do not all hammer the lock
+   if (sQueue.head == sQueue.tail) {
+      return NULL;
+   }
+
+   OSUninterruptibleSpinLock_Acquire(&sQueue.lock);
+   if (sQueue.head != sQueue.tail) {
+      job = sQueue.jobs[sQueue.head & DEQUE_MASK];
+      sQueue.head++;
+   }
+   OSUninterruptibleSpinLock_Release(&sQueue.lock);
+   return job;
+}
+
+static inline JobWorker *
+getCurrentWorker()
+{
+   OSThread *thread = OSGetCurrentThread();
+   int i;
+
+   for (i = 0; i < WHB_JOB_NUM_WORKERS; ++i) {
+      if (sWorkers[i] && &sWorkers[i]->thread == thread) {
+         return sWorkers[i];
+      }
+   }
+
+   return NULL;
+}
+
+static inline uint32_t
+nextRandom(uint32_t *state)
+{
+   uint32_t x = *state;
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   *state = x;
+   return x;
+}
+
+static WHBJob *
+findJob(JobWorker *self)
+{
+   WHBJob *job = NULL;
+   uint32_t random;
+   int i;
+
+   if (self) {
+      job = dequePop(&self->deque);
+      if (job) {
+         return job;
+      }
+   }
+
+   job = queuePop();
+   if (job) {
+      return job;
+   }
+
+   random = self ? nextRandom(&self->random) : (uint32_t)OSGetTick();
+
+   for (i = 0; i < STEAL_ATTEMPTS; ++i) {
+      JobWorker *victim = sWorkers[(random + i) % WHB_JOB_NUM_WORKERS];
+      if (!victim || victim == self) {
+         continue;
+      }
+
+      job = dequeSteal(&victim->deque);
+      if (job) {
+         return job;
+      }
+   }
+
+   return NULL;
+}
+
+static void
+wakeWorker()
+{
+   uint32_t sleeping;
+
+   while ((sleeping = sSleepingWorkers) > 0) {
+      if (OSCompareAndSwapAtomic(&sSleepingWorkers, sleeping, sleeping - 1)) {
+         OSSignalSemaphore(&sWakeSemaphore);
+         return;
+      }
+   }
+}
+
+static void
+submitJob(WHBJob *job);
+
+static void
+wakeWaiters()
+{
+   memoryBarrier();
+   if (sBlockedWaiters) {
+      OSLockMutex(&sWaitMutex);
+      OSSignalCond(&sWaitCondition);
+      OSUnlockMutex(&sWaitMutex);
+   }
+}
+
+static void
+releaseCounter(WHBJobCounter *counter)
+{
+   WHBJob *continuation = NULL;
+   BOOL done = FALSE;
+
+   // A waiter may release the counter's storage once it is done, so it is
+   // held busy until we have read the continuation of the final release.
+   OSAddAtomic(&counter->busy, 1);
+   memoryBarrier();
+
+   if (OSAddAtomic(&counter->value, -1) == 1) {
+      memoryBarrier();
+      continuation = counter->continuation;
+      done = TRUE;
+   }
+
+   memoryBarrier();
+   OSAddAtomic(&counter->busy, -1);
+
+   if (done) {
+      wakeWaiters();
+   }
+
+   if (continuation) {
+      submitJob(continuation);
+   }
+}
+
+static void
+runJob(WHBJob *job)
+{
+   WHBJobCounter *counter = job->counter;
+
+   job->fn(job->arg);
+
+   if (counter) {
+      releaseCounter(counter);
+   }
+}
+
+static void
+submitJob(WHBJob *job)
+{
+   JobWorker *self = getCurrentWorker();
+
+   if (self && dequePush(&self->deque, job)) {
+      wakeWorker();
+   } else if (queuePush(job)) {
+      wakeWorker();
+   } else {
+      // Nowhere to put it, just run it now
+      runJob(job);
+   }
+}
+
+static void
+workerIdle(JobWorker *self)
+{
+   WHBJob *job;
+   uint32_t sleeping;
+
+   OSAddAtomic((volatile int32_t *)&sSleepingWorkers, 1);
+
+   // Check again now we are registered as sleeping, a job submitted before
+   // that would not have tried to wake us.
+   job = findJob(self);
+   if (!job && sRunning) {
+      OSWaitSemaphore(&sWakeSemaphore);
+      return;
+   }
+
+   // Withdraw from sleeping, unless a submitter already consumed our entry in
+   // which case the semaphore has been or is about to be signalled for us.
+   while (TRUE) {
+      sleeping = sSleepingWorkers;
+      if (sleeping == 0) {
+         OSWaitSemaphore(&sWakeSemaphore);
+         break;
+      }
+
+      if (OSCompareAndSwapAtomic(&sSleepingWorkers, sleeping, sleeping - 1)) {
+         break;
+      }
+   }
+
+   if (job) {
+      runJob(job);
+   }
+}
+
+static int
+workerMain(int argc,
+           const char **argv)
+{
+   JobWorker *self = (JobWorker *)argv;
+   WHBJob *job;
+
+   while (sRunning) {
+      job = findJob(self);
+      if (job) {
+         runJob(job);
+      } else {
+         workerIdle(self);
+      }
+   }
+
+   return 0;
+}
+
+BOOL
+WHBJobSystemInit(int32_t priority,
+                 uint32_t stackSize)
+{
+   int i;
+
+   if (sRunning) {
+      WHBLogPrintf("%s: Job system is already running.", __FUNCTION__);
+      return TRUE;
+   }
+
+   memset(&sQueue, 0, sizeof(sQueue));
+   OSInitSpinLock(&sQueue.lock);
+   OSInitSemaphore(&sWakeSemaphore, 0);
+   OSInitMutex(&sWaitMutex);
+   OSInitCond(&sWaitCondition);
+   sSleepingWorkers = 0;
+   sBlockedWaiters = 0;
+   sRunning = TRUE;
+
+   for (i = 0; i < WHB_JOB_NUM_WORKERS; ++i) {
+      JobWorker *worker = MEMAllocFromDefaultHeapEx(sizeof(JobWorker), 32);
+      void *stack = MEMAllocFromDefaultHeapEx(stackSize, 16);
+      if (!worker || !stack) {
+         WHBLogPrintf("%s: Failed to allocate worker %d.", __FUNCTION__, i);
+         if (worker) {
+            MEMFreeToDefaultHeap(worker);
+         }
+         if (stack) {
+            MEMFreeToDefaultHeap(stack);
+         }
+         WHBJobSystemShutdown();
+         return FALSE;
+      }
+
+      memset(worker, 0, sizeof(JobWorker));
+      worker->stack = stack;
+      worker->index = i;
+      worker->random = 0x9E3779B9u * (i + 1);
+
+      if (!OSCreateThread(&worker->thread,
+                          workerMain,
+                          0,
+                          (char *)worker,
+                          (uint8_t *)stack + stackSize,
+                          stackSize,
+                          priority,
+                          (OSThreadAttributes)(OS_THREAD_ATTRIB_AFFINITY_CPU0 << i))) {
+         WHBLogPrintf("%s: Failed to create worker %d.", __FUNCTION__, i);
+         MEMFreeToDefaultHeap(worker);
+         MEMFreeToDefaultHeap(stack);
+         WHBJobSystemShutdown();
+         return FALSE;
+      }
+
+      OSSetThreadName(&worker->thread, "WHBJobWorker");
+      sWorkers[i] = worker;
+      OSResumeThread(&worker->thread);
+   }
+
+   return TRUE;
+}
+
+void
+WHBJobSystemShutdown()
+{
+   int i;
+
+   sRunning = FALSE;
+   memoryBarrier();
+
+   for (i = 0; i < WHB_JOB_NUM_WORKERS; ++i) {
+      OSSignalSemaphore(&sWakeSemaphore);
+   }
+
+   for (i = 0; i < WHB_JOB_NUM_WORKERS; ++i) {
+      if (!sWorkers[i]) {
+         continue;
+      }
+
+      OSJoinThread(&sWorkers[i]->thread, NULL);
+      MEMFreeToDefaultHeap(sWorkers[i]->stack);
+      MEMFreeToDefaultHeap(sWorkers[i]);
+      sWorkers[i] = NULL;
+   }
+}
+
+void
+WHBJobInit(WHBJob *job,
+           WHBJobFn fn,
+           void *arg)
+{
+   job->fn = fn;
+   job->arg = arg;
+   job->counter = NULL;
+}
+
+void
+WHBJobCounterInit(WHBJobCounter *counter)
+{
+   counter->value = 0;
+   counter->busy = 0;
+   counter->continuation = NULL;
+}
+
+void
+WHBJobCounterSetContinuation(WHBJobCounter *counter,
+                             WHBJob *continuation,
+                             WHBJobCounter *continuationCounter)
+{
+   continuation->counter = continuationCounter;
+   if (continuationCounter) {
+      OSAddAtomic(&continuationCounter->value, 1);
+   }
+
+   // Hold a count while installing the continuation, so the release which
+   // brings the counter to zero sees it, even when that release is ours
+   // because the jobs had already finished.
+   OSAddAtomic(&counter->value, 1);
+   counter->continuation = continuation;
+   memoryBarrier();
+   releaseCounter(counter);
+}
+
+void
+WHBJobRun(WHBJob *job,
+          WHBJobCounter *counter)
+{
+   job->counter = counter;
+   if (counter) {
+      OSAddAtomic(&counter->value, 1);
+   }
+
+   submitJob(job);
+}
+
+void
+WHBJobRunBatch(WHBJob *jobs,
+               uint32_t count,
+               WHBJobCounter *counter)
+{
+   uint32_t i;
+
+   // Count every job up front so the counter cannot reach zero part way
+   // through submitting the batch.
+   if (counter) {
+      OSAddAtomic(&counter->value, (int32_t)count);
+   }
+
+   for (i = 0; i < count; ++i) {
+      jobs[i].counter = counter;
+      submitJob(&jobs[i]);
+   }
+}
+
+BOOL
+WHBJobCounterIsDone(WHBJobCounter *counter)
+{
+   if (counter->value != 0) {
+      return FALSE;
+   }
+
+   memoryBarrier();
+   return counter->busy == 0;
+}
+
+static void
+waitForCounter(WHBJobCounter *counter)
+{
+   // Register before checking, so the final release either sees us and
+   // signals, or finished before our check.
+   OSAddAtomic(&sBlockedWaiters, 1);
+   memoryBarrier();
+
+   OSLockMutex(&sWaitMutex);
+   while (!WHBJobCounterIsDone(counter)) {
+      OSWaitCond(&sWaitCondition, &sWaitMutex);
+   }
+   OSUnlockMutex(&sWaitMutex);
+
+   OSAddAtomic(&sBlockedWaiters, -1);
+}
+
+void
+WHBJobWait(WHBJobCounter *counter)
+{
+   JobWorker *self = getCurrentWorker();
+   WHBJob *job;
+
+   while (!WHBJobCounterIsDone(counter)) {
+      job = findJob(self);
+      if (job) {
+         runJob(job);
+      } else if (self) {
+         // Workers keep looking, the jobs we wait on may be pushed to our
+         // own deque by the jobs we run.
+         OSYieldThread();
+      } else {
+         // OSYieldThread never gives the core to a lower priority thread,
+         // so block until a counter is released.
+         waitForCounter(counter);
+      }
+   }
+
+   memoryBarrier();
+}
+
+static void
+parallelForJob(void *arg)
+{
+   JobRange *range = (JobRange *)arg;
+   range->fn(range->begin, range->end, range->arg);
+}
+
+void
+WHBJobParallelFor(uint32_t begin,
+                  uint32_t end,
+                  uint32_t grainSize,
+                  WHBJobRangeFn fn,
+                  void *arg)
+{
+   JobRange ranges[WHB_JOB_MAX_PARALLEL_FOR_CHUNKS];
+   WHBJobCounter counter;
+   uint32_t count, numChunks, chunkSize, i;
+
+   if (end <= begin) {
+      return;
+   }
+
+   if (grainSize == 0) {
+      grainSize = 1;
+   }
+
+   count = end - begin;
+   numChunks = (count + grainSize - 1) / grainSize;
+   if (numChunks > WHB_JOB_MAX_PARALLEL_FOR_CHUNKS) {
+      numChunks = WHB_JOB_MAX_PARALLEL_FOR_CHUNKS;
+   }
+
+   if (numChunks == 1) {
+      fn(begin, end, arg);
+      return;
+   }
+
+   chunkSize = (count + numChunks - 1) / numChunks;
+   numChunks = (count + chunkSize - 1) / chunkSize;
+   WHBJobCounterInit(&counter);
+   OSAddAtomic(&counter.value, (int32_t)numChunks);
+
+   for (i = 0; i < numChunks; ++i) {
+      JobRange *range = &ranges[i];
+      range->begin = begin + i * chunkSize;
+      range->end = range->begin + chunkSize;
+      if (range->end > end) {
+         range->end = end;
+      }
+      range->fn = fn;
+      range->arg = arg;
+
+      WHBJobInit(&range->job, parallelForJob, range);
+      range->job.counter = &counter;
+      submitJob(&range->job);
+   }
+
+   WHBJobWait(&counter);
+}
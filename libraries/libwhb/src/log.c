@@ -1,33 +1,344 @@
+#include <coreinit/atomic.h>
+#include <coreinit/event.h>
 #include <coreinit/memdefaultheap.h>
+#include <coreinit/thread.h>
+#include <coreinit/time.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <whb/align.h>
 #include <whb/log.h>
 
 #define MAX_HANDLERS 16
 #define PRINTF_BUFFER_LENGTH 2048
+#define ASYNC_THREAD_STACK_SIZE (16 * 1024)
+
+/*
+ * In async mode messages go through a bounded MPSC ring. A producer claims a
+ * slot by advancing enqueuePos, formats directly into it and publishes it by
+ * setting the slot sequence, the drain thread consumes slots in order.
+ */
+typedef struct
+{
+   volatile uint32_t sequence;
+   uint32_t level;
+   char text[];
+} LogSlot;
+
+typedef struct
+{
+   volatile uint32_t enqueuePos;
+   uint8_t enqueuePadding[28];
+   volatile uint32_t dequeuePos;
+   uint8_t dequeuePadding[28];
+   volatile uint32_t dropped;
+   volatile uint32_t drainSleeping;
+   volatile BOOL running;
+   WHBLogAsyncPolicy policy;
+   uint32_t numMessages;
+   uint32_t messageSize;
+   uint32_t slotStride;
+   uint8_t *slots;
+   void *stack;
+   OSEvent wakeEvent;
+   OSThread thread;
+} LogAsync;
 
 static LogHandlerFn
 sHandlers[MAX_HANDLERS] = { 0 };
 
+static uint32_t
+sHandlerLevelMasks[MAX_HANDLERS] = { 0 };
+
+#define DEFAULT_FILTER 0xFFFFFFFFu
+
+volatile uint32_t
+__whb_log_filter[WHB_LOG_NUM_LEVELS] = {
+   DEFAULT_FILTER, // WHB_LOG_LEVEL_ERROR
+   DEFAULT_FILTER, // WHB_LOG_LEVEL_WARN
+   DEFAULT_FILTER, // WHB_LOG_LEVEL_INFO
+   0,              // WHB_LOG_LEVEL_DEBUG
+   0,              // WHB_LOG_LEVEL_VERBOSE
+};
+
+static LogAsync *
+sAsync = NULL;
+
+// Threads which may be using sAsync, WHBLogAsyncDeinit waits for them
+static volatile int32_t
+sAsyncWriters = 0;
+
+static inline void
+memoryBarrier()
+{
+   __asm__ __volatile__ ("sync" : : : "memory");
+}
+
 static inline void
-dispatchMessage(const char * str)
+dispatchMessage(uint32_t level,
+                const char * str)
 {
    int i;
    for (i = 0; i < MAX_HANDLERS; ++i) {
-      if (sHandlers[i]) {
+      if (sHandlers[i] && (sHandlerLevelMasks[i] & WHB_LOG_LEVEL_MASK(level))) {
          sHandlers[i](str);
       }
    }
 }
 
+/*
+ * Returns the async logger with the caller counted as a writer, or NULL for
+ * synchronous logging. A non-NULL result must be passed to asyncRelease.
+ */
+static LogAsync *
+asyncAcquire()
+{
+   LogAsync *async;
+
+   if (!sAsync) {
+      return NULL;
+   }
+
+   // Pairs with the barrier in WHBLogAsyncDeinit between clearing sAsync and
+   // reading sAsyncWriters, so either it sees us or we see NULL.
+   OSAddAtomic(&sAsyncWriters, 1);
+   memoryBarrier();
+
+   async = sAsync;
+   if (!async) {
+      OSAddAtomic(&sAsyncWriters, -1);
+   }
+
+   return async;
+}
+
+static inline void
+asyncRelease()
+{
+   memoryBarrier();
+   OSAddAtomic(&sAsyncWriters, -1);
+}
+
+static inline LogSlot *
+asyncGetSlot(LogAsync *async,
+             uint32_t pos)
+{
+   return (LogSlot *)(async->slots + (pos & (async->numMessages - 1)) * async->slotStride);
+}
+
+static LogSlot *
+asyncReserve(LogAsync *async,
+             uint32_t *outPos)
+{
+   uint32_t pos = async->enqueuePos;
+   LogSlot *slot;
+   int32_t diff;
+
+   while (TRUE) {
+      slot = asyncGetSlot(async, pos);
+      diff = (int32_t)(slot->sequence - pos);
+
+      if (diff == 0) {
+         if (OSCompareAndSwapAtomic(&async->enqueuePos, pos, pos + 1)) {
+            *outPos = pos;
+            return slot;
+         }
+      } else if (diff < 0) {
+         // Nothing frees a slot once the drain thread is stopping
+         if (async->policy == WHB_LOG_ASYNC_DROP || !async->running) {
+            OSAddAtomic((volatile int32_t *)&async->dropped, 1);
+            return NULL;
+         }
+
+         // The drain thread usually runs at a low priority, so sleep rather
+         // than yield to make sure it gets to run.
+         OSSleepTicks(OSMicrosecondsToTicks(100));
+      }
+
+      pos = async->enqueuePos;
+   }
+}
+
+static void
+asyncCommit(LogAsync *async,
+            LogSlot *slot,
+            uint32_t pos)
+{
+   memoryBarrier();
+   slot->sequence = pos + 1;
+   memoryBarrier();
+
+   if (async->drainSleeping &&
+       OSCompareAndSwapAtomic(&async->drainSleeping, 1, 0)) {
+      OSSignalEvent(&async->wakeEvent);
+   }
+}
+
+static BOOL
+asyncWrite(LogAsync *async,
+           uint32_t level,
+           const char *str,
+           BOOL newline)
+{
+   uint32_t pos;
+   uint32_t length;
+   LogSlot *slot = asyncReserve(async, &pos);
+   if (!slot) {
+      return FALSE;
+   }
+
+   slot->level = level;
+   length = strnlen(str, async->messageSize - 2);
+   memcpy(slot->text, str, length);
+   if (newline) {
+      slot->text[length++] = '\n';
+   }
+   slot->text[length] = 0;
+
+   asyncCommit(async, slot, pos);
+   return TRUE;
+}
+
+static BOOL
+asyncWritev(LogAsync *async,
+            uint32_t level,
+            BOOL newline,
+            const char *fmt,
+            va_list va)
+{
+   uint32_t pos;
+   uint32_t length;
+   int result;
+   LogSlot *slot = asyncReserve(async, &pos);
+   if (!slot) {
+      return FALSE;
+   }
+
+   // Leave room for the newline
+   slot->level = level;
+   result = vsnprintf(slot->text, async->messageSize - 1, fmt, va);
+   if (result < 0) {
+      result = 0;
+   }
+
+   length = (uint32_t)result;
+   if (length > async->messageSize - 2) {
+      length = async->messageSize - 2;
+   }
+
+   if (newline) {
+      slot->text[length++] = '\n';
+   }
+   slot->text[length] = 0;
+
+   asyncCommit(async, slot, pos);
+   return TRUE;
+}
+
+static BOOL
+asyncDrainOne(LogAsync *async)
+{
+   uint32_t pos = async->dequeuePos;
+   LogSlot *slot = asyncGetSlot(async, pos);
+
+   if (slot->sequence != pos + 1) {
+      return FALSE;
+   }
+
+   memoryBarrier();
+   dispatchMessage(slot->level, slot->text);
+   memoryBarrier();
+
+   slot->sequence = pos + async->numMessages;
+   async->dequeuePos = pos + 1;
+   return TRUE;
+}
+
+static int
+asyncThreadMain(int argc,
+                const char **argv)
+{
+   LogAsync *async = (LogAsync *)argv;
+
+   while (async->running) {
+      if (asyncDrainOne(async)) {
+         continue;
+      }
+
+      async->drainSleeping = 1;
+      memoryBarrier();
+
+      // Check again now we are registered as sleeping, a message committed
+      // before that would not have tried to wake us.
+      if (asyncGetSlot(async, async->dequeuePos)->sequence == async->dequeuePos + 1 ||
+          !async->running) {
+         if (OSCompareAndSwapAtomic(&async->drainSleeping, 1, 0)) {
+            continue;
+         }
+      }
+
+      OSWaitEvent(&async->wakeEvent);
+   }
+
+   while (asyncDrainOne(async));
+   return 0;
+}
+
+static BOOL
+logv(uint32_t level,
+     BOOL newline,
+     const char *fmt,
+     va_list va)
+{
+   LogAsync *async = asyncAcquire();
+   char *buf;
+   int length;
+   BOOL result;
+
+   if (async) {
+      result = asyncWritev(async, level, newline, fmt, va);
+      asyncRelease();
+      return result;
+   }
+
+   buf = MEMAllocFromDefaultHeapEx(PRINTF_BUFFER_LENGTH, 4);
+   if (!buf) {
+      return FALSE;
+   }
+
+   // Format once, leaving room to append the newline
+   length = vsnprintf(buf, PRINTF_BUFFER_LENGTH - 1, fmt, va);
+   if (length < 0) {
+      length = 0;
+   } else if (length > PRINTF_BUFFER_LENGTH - 2) {
+      length = PRINTF_BUFFER_LENGTH - 2;
+   }
+
+   if (newline) {
+      buf[length++] = '\n';
+   }
+   buf[length] = 0;
+   dispatchMessage(level, buf);
+
+   MEMFreeToDefaultHeap(buf);
+   return TRUE;
+}
+
 BOOL
 WHBAddLogHandler(LogHandlerFn fn)
+{
+   return WHBAddLogHandlerEx(fn, WHB_LOG_LEVEL_MASK_ALL);
+}
+
+BOOL
+WHBAddLogHandlerEx(LogHandlerFn fn,
+                   uint32_t levelMask)
 {
    int i;
 
    for (i = 0; i < MAX_HANDLERS; ++i) {
       if (!sHandlers[i]) {
+         sHandlerLevelMasks[i] = levelMask;
          sHandlers[i] = fn;
          return TRUE;
       }
@@ -54,20 +365,39 @@ WHBRemoveLogHandler(LogHandlerFn fn)
 BOOL
 WHBLogWrite(const char *str)
 {
-   dispatchMessage(str);
+   LogAsync *async = asyncAcquire();
+   BOOL result;
+
+   if (async) {
+      result = asyncWrite(async, WHB_LOG_LEVEL_INFO, str, FALSE);
+      asyncRelease();
+      return result;
+   }
+
+   dispatchMessage(WHB_LOG_LEVEL_INFO, str);
    return TRUE;
 }
 
 BOOL
 WHBLogPrint(const char *str)
 {
-   char *buf = MEMAllocFromDefaultHeapEx(PRINTF_BUFFER_LENGTH, 4);
+   LogAsync *async = asyncAcquire();
+   char *buf;
+   BOOL result;
+
+   if (async) {
+      result = asyncWrite(async, WHB_LOG_LEVEL_INFO, str, TRUE);
+      asyncRelease();
+      return result;
+   }
+
+   buf = MEMAllocFromDefaultHeapEx(PRINTF_BUFFER_LENGTH, 4);
    if(!buf) {
       return FALSE;
    }
 
    snprintf(buf, PRINTF_BUFFER_LENGTH, "%s\n", str);
-   dispatchMessage(buf);
+   dispatchMessage(WHB_LOG_LEVEL_INFO, buf);
 
    MEMFreeToDefaultHeap(buf);
    return TRUE;
@@ -76,46 +406,210 @@ WHBLogPrint(const char *str)
 BOOL
 WHBLogWritef(const char *fmt, ...)
 {
-   char *buf = MEMAllocFromDefaultHeapEx(PRINTF_BUFFER_LENGTH, 4);
    va_list va;
+   BOOL result;
 
-   if (!buf) {
+   va_start(va, fmt);
+   result = logv(WHB_LOG_LEVEL_INFO, FALSE, fmt, va);
+   va_end(va);
+   return result;
+}
+
+BOOL
+WHBLogPrintf(const char *fmt, ...)
+{
+   va_list va;
+   BOOL result;
+
+   va_start(va, fmt);
+   result = logv(WHB_LOG_LEVEL_INFO, TRUE, fmt, va);
+   va_end(va);
+   return result;
+}
+
+BOOL
+WHBLogLevelPrintf(uint32_t level,
+                  const char *fmt, ...)
+{
+   va_list va;
+   BOOL result;
+
+   if (level >= WHB_LOG_NUM_LEVELS) {
       return FALSE;
    }
 
    va_start(va, fmt);
-   vsnprintf(buf, PRINTF_BUFFER_LENGTH, fmt, va);
-   dispatchMessage(buf);
-
-   MEMFreeToDefaultHeap(buf);
+   result = logv(level, TRUE, fmt, va);
    va_end(va);
-   return TRUE;
+   return result;
+}
+
+void
+WHBLogSetCategoryLevel(int32_t category,
+                       uint32_t maxLevel)
+{
+   uint32_t mask = category < 0 ? 0xFFFFFFFFu : (1u << category);
+   uint32_t level;
+
+   if (category >= WHB_LOG_NUM_CATEGORIES) {
+      return;
+   }
+
+   for (level = 0; level < WHB_LOG_NUM_LEVELS; ++level) {
+      if (level <= maxLevel) {
+         OSOrAtomic(&__whb_log_filter[level], mask);
+      } else {
+         OSAndAtomic(&__whb_log_filter[level], ~mask);
+      }
+   }
+}
+
+void
+WHBLogDisableCategory(int32_t category)
+{
+   uint32_t mask = category < 0 ? 0xFFFFFFFFu : (1u << category);
+   uint32_t level;
+
+   if (category >= WHB_LOG_NUM_CATEGORIES) {
+      return;
+   }
+
+   for (level = 0; level < WHB_LOG_NUM_LEVELS; ++level) {
+      OSAndAtomic(&__whb_log_filter[level], ~mask);
+   }
 }
 
 BOOL
-WHBLogPrintf(const char *fmt, ...)
+WHBLogAsyncInit(uint32_t numMessages,
+                uint32_t messageSize,
+                int32_t priority,
+                WHBLogAsyncPolicy policy)
 {
-   char *buf1 = MEMAllocFromDefaultHeapEx(PRINTF_BUFFER_LENGTH, 4);
-   char *buf2 = MEMAllocFromDefaultHeapEx(PRINTF_BUFFER_LENGTH, 4);
-   va_list va;
+   LogAsync *async;
+   uint32_t i;
 
-   if (!buf1) {
+   if (sAsync) {
+      return TRUE;
+   }
+
+   if (!numMessages || (numMessages & (numMessages - 1)) || messageSize < 4) {
       return FALSE;
    }
 
-   if(!buf2) {
-      MEMFreeToDefaultHeap(buf1);
+   async = MEMAllocFromDefaultHeapEx(sizeof(LogAsync), 32);
+   if (!async) {
       return FALSE;
    }
 
-   va_start(va, fmt);
+   memset(async, 0, sizeof(LogAsync));
+   async->policy = policy;
+   async->numMessages = numMessages;
+   async->messageSize = messageSize;
+   async->slotStride = WHBAlignUp(sizeof(LogSlot) + messageSize, 32);
+   async->slots = MEMAllocFromDefaultHeapEx(async->slotStride * numMessages, 32);
+   async->stack = MEMAllocFromDefaultHeapEx(ASYNC_THREAD_STACK_SIZE, 16);
+   if (!async->slots || !async->stack) {
+      goto error;
+   }
 
-   vsnprintf(buf1, PRINTF_BUFFER_LENGTH, fmt, va);
-   snprintf(buf2, PRINTF_BUFFER_LENGTH, "%s\n", buf1);
-   dispatchMessage(buf2);
+   for (i = 0; i < numMessages; ++i) {
+      asyncGetSlot(async, i)->sequence = i;
+   }
 
-   MEMFreeToDefaultHeap(buf1);
-   MEMFreeToDefaultHeap(buf2);
-   va_end(va);
+   OSInitEvent(&async->wakeEvent, FALSE, OS_EVENT_MODE_AUTO);
+   async->running = TRUE;
+
+   if (!OSCreateThread(&async->thread,
+                       asyncThreadMain,
+                       0,
+                       (char *)async,
+                       (uint8_t *)async->stack + ASYNC_THREAD_STACK_SIZE,
+                       ASYNC_THREAD_STACK_SIZE,
+                       priority,
+                       OS_THREAD_ATTRIB_AFFINITY_ANY)) {
+      goto error;
+   }
+
+   OSSetThreadName(&async->thread, "WHBLogAsync");
+   OSResumeThread(&async->thread);
+
+   memoryBarrier();
+   sAsync = async;
    return TRUE;
+
+error:
+   if (async->slots) {
+      MEMFreeToDefaultHeap(async->slots);
+   }
+
+   if (async->stack) {
+      MEMFreeToDefaultHeap(async->stack);
+   }
+
+   MEMFreeToDefaultHeap(async);
+   return FALSE;
+}
+
+void
+WHBLogAsyncDeinit()
+{
+   LogAsync *async = sAsync;
+   if (!async) {
+      return;
+   }
+
+   sAsync = NULL;
+   memoryBarrier();
+
+   // Writers which already loaded sAsync finish their message while the
+   // drain thread is still running to make room for them.
+   while (sAsyncWriters) {
+      OSSleepTicks(OSMicrosecondsToTicks(100));
+   }
+
+   async->running = FALSE;
+   memoryBarrier();
+   OSSignalEvent(&async->wakeEvent);
+   OSJoinThread(&async->thread, NULL);
+
+   MEMFreeToDefaultHeap(async->slots);
+   MEMFreeToDefaultHeap(async->stack);
+   MEMFreeToDefaultHeap(async);
+}
+
+void
+WHBLogAsyncFlush()
+{
+   LogAsync *async = asyncAcquire();
+   uint32_t target;
+
+   if (!async) {
+      return;
+   }
+
+   target = async->enqueuePos;
+   while ((int32_t)(async->dequeuePos - target) < 0) {
+      if (async->drainSleeping &&
+          OSCompareAndSwapAtomic(&async->drainSleeping, 1, 0)) {
+         OSSignalEvent(&async->wakeEvent);
+      }
+
+      OSSleepTicks(OSMicrosecondsToTicks(100));
+   }
+
+   asyncRelease();
+}
+
+uint32_t
+WHBLogAsyncGetDroppedCount()
+{
+   LogAsync *async = asyncAcquire();
+   uint32_t dropped = 0;
+
+   if (async) {
+      dropped = async->dropped;
+      asyncRelease();
+   }
+
+   return dropped;
 }
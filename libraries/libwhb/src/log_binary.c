@@ -0,0 +1,361 @@
+#include <coreinit/atomic.h>
+#include <coreinit/core.h>
+#include <coreinit/interrupts.h>
+#include <coreinit/memdefaultheap.h>
+#include <coreinit/time.h>
+#include <stdarg.h>
+#include <string.h>
+#include <whb/log_binary.h>
+
+#define NUM_CORES 3
+
+/*
+ * One ring per core. A writer disables interrupts while it appends, so
+ * nothing else can touch its core's ring, and the reader only consumes up to
+ * the published tail.
+ */
+typedef struct
+{
+   volatile uint32_t head;
+   uint8_t headPadding[28];
+   volatile uint32_t tail;
+   uint8_t tailPadding[28];
+   uint32_t size;
+   uint8_t *data;
+} BinLogRing;
+
+typedef enum
+{
+   ARG_INT32,
+   ARG_INT64,
+   ARG_DOUBLE,
+   ARG_STRING,
+} BinLogArgType;
+
+static BinLogRing *
+sRings[NUM_CORES] = { 0 };
+
+static volatile uint32_t
+sDropped = 0;
+
+/*
+ * Format ids are offsets from this string, which the linker script places in
+ * the same .rodata output section as every string literal.
+ */
+__attribute__((section(".rodata")))
+const char
+__whb_binlog_format_base[] = "WHBBinLogFormatBase";
+
+static inline void
+memoryBarrier()
+{
+   __asm__ __volatile__ ("sync" : : : "memory");
+}
+
+static void
+ringWrite(BinLogRing *ring,
+          uint32_t pos,
+          const void *src,
+          uint32_t size)
+{
+   uint32_t offset = pos & (ring->size - 1);
+   uint32_t first = ring->size - offset;
+
+   if (first >= size) {
+      memcpy(ring->data + offset, src, size);
+   } else {
+      memcpy(ring->data + offset, src, first);
+      memcpy(ring->data, (const uint8_t *)src + first, size - first);
+   }
+}
+
+static void
+ringRead(BinLogRing *ring,
+         uint32_t pos,
+         void *dst,
+         uint32_t size)
+{
+   uint32_t offset = pos & (ring->size - 1);
+   uint32_t first = ring->size - offset;
+
+   if (first >= size) {
+      memcpy(dst, ring->data + offset, size);
+   } else {
+      memcpy(dst, ring->data + offset, first);
+      memcpy((uint8_t *)dst + first, ring->data, size - first);
+   }
+}
+
+/*
+ * Find the argument types consumed by the next conversion in fmt, a '*' width
+ * or precision takes an int before the value itself. Returns the position
+ * after the conversion or NULL at the end of the string.
+ */
+static const char *
+nextConversion(const char *fmt,
+               BinLogArgType *types,
+               uint32_t *numTypes)
+{
+   int longCount = 0;
+
+   *numTypes = 0;
+
+   while (*fmt) {
+      if (*fmt++ != '%') {
+         continue;
+      }
+
+      if (*fmt == '%') {
+         ++fmt;
+         continue;
+      }
+
+      while (*fmt && strchr("-+ #0", *fmt)) {
+         ++fmt;
+      }
+
+      if (*fmt == '*') {
+         types[(*numTypes)++] = ARG_INT32;
+         ++fmt;
+      }
+
+      while (*fmt >= '0' && *fmt <= '9') {
+         ++fmt;
+      }
+
+      if (*fmt == '.') {
+         ++fmt;
+         if (*fmt == '*') {
+            types[(*numTypes)++] = ARG_INT32;
+            ++fmt;
+         }
+
+         while (*fmt >= '0' && *fmt <= '9') {
+            ++fmt;
+         }
+      }
+
+      while (*fmt && strchr("hlLjztq", *fmt)) {
+         if (*fmt == 'l') {
+            longCount += 1;
+         } else if (*fmt == 'L' || *fmt == 'q' || *fmt == 'j') {
+            longCount += 2;
+         }
+         ++fmt;
+      }
+
+      switch (*fmt) {
+      case 'f': case 'F': case 'e': case 'E':
+      case 'g': case 'G': case 'a': case 'A':
+         types[(*numTypes)++] = ARG_DOUBLE;
+         break;
+      case 's':
+         types[(*numTypes)++] = ARG_STRING;
+         break;
+      case '\0':
+         return NULL;
+      default:
+         types[(*numTypes)++] = longCount >= 2 ? ARG_INT64 : ARG_INT32;
+         break;
+      }
+
+      return fmt + 1;
+   }
+
+   return NULL;
+}
+
+BOOL
+WHBBinLogInit(uint32_t bufferSize)
+{
+   int i;
+
+   if (!bufferSize || (bufferSize & (bufferSize - 1))) {
+      return FALSE;
+   }
+
+   for (i = 0; i < NUM_CORES; ++i) {
+      BinLogRing *ring = MEMAllocFromDefaultHeapEx(sizeof(BinLogRing), 32);
+      uint8_t *data = MEMAllocFromDefaultHeapEx(bufferSize, 32);
+      if (!ring || !data) {
+         if (ring) {
+            MEMFreeToDefaultHeap(ring);
+         }
+         if (data) {
+            MEMFreeToDefaultHeap(data);
+         }
+         WHBBinLogDeinit();
+         return FALSE;
+      }
+
+      memset(ring, 0, sizeof(BinLogRing));
+      ring->size = bufferSize;
+      ring->data = data;
+      sRings[i] = ring;
+   }
+
+   sDropped = 0;
+   return TRUE;
+}
+
+void
+WHBBinLogDeinit()
+{
+   int i;
+
+   for (i = 0; i < NUM_CORES; ++i) {
+      BinLogRing *ring = sRings[i];
+      if (ring) {
+         sRings[i] = NULL;
+         MEMFreeToDefaultHeap(ring->data);
+         MEMFreeToDefaultHeap(ring);
+      }
+   }
+}
+
+BOOL
+WHBBinLogPrintf(const char *fmt, ...)
+{
+   uint32_t words[WHB_BINLOG_MAX_WORDS];
+   WHBBinLogRecord record;
+   BinLogArgType types[3];
+   uint32_t numTypes;
+   uint32_t i;
+   BinLogRing *ring;
+   const char *p = fmt;
+   uint32_t numWords = 0;
+   uint32_t recordSize;
+   uint32_t length;
+   uint64_t value64;
+   const char *str;
+   va_list va;
+   BOOL enabled;
+
+   va_start(va, fmt);
+
+   while ((p = nextConversion(p, types, &numTypes))) {
+      for (i = 0; i < numTypes; ++i) {
+         switch (types[i]) {
+         case ARG_INT32:
+            if (numWords + 1 > WHB_BINLOG_MAX_WORDS) {
+               goto done;
+            }
+            words[numWords++] = va_arg(va, uint32_t);
+            break;
+         case ARG_INT64:
+         case ARG_DOUBLE:
+            if (numWords + 2 > WHB_BINLOG_MAX_WORDS) {
+               goto done;
+            }
+            if (types[i] == ARG_DOUBLE) {
+               double d = va_arg(va, double);
+               memcpy(&value64, &d, sizeof(value64));
+            } else {
+               value64 = va_arg(va, uint64_t);
+            }
+            words[numWords++] = (uint32_t)(value64 >> 32);
+            words[numWords++] = (uint32_t)value64;
+            break;
+         case ARG_STRING:
+            str = va_arg(va, const char *);
+            length = str ? strnlen(str, WHB_BINLOG_MAX_STRING) : 0;
+            if (numWords + 1 + (length + 3) / 4 > WHB_BINLOG_MAX_WORDS) {
+               goto done;
+            }
+            words[numWords++] = length;
+            if (length % 4) {
+               words[numWords + length / 4] = 0;
+            }
+            memcpy(&words[numWords], str, length);
+            numWords += (length + 3) / 4;
+            break;
+         }
+      }
+   }
+
+done:
+   va_end(va);
+
+   record.formatId = (uint32_t)(fmt - __whb_binlog_format_base);
+   record.flags = 0;
+   record.numWords = (uint16_t)numWords;
+   recordSize = sizeof(WHBBinLogRecord) + numWords * 4;
+
+   // Stay on this core, and alone on its ring, until the record is published
+   enabled = OSDisableInterrupts();
+   record.core = (uint8_t)OSGetCoreId();
+   record.tick = (uint32_t)OSGetSystemTick();
+   ring = sRings[record.core];
+
+   if (!ring || ring->size - (ring->tail - ring->head) < recordSize) {
+      OSRestoreInterrupts(enabled);
+      if (ring) {
+         OSAddAtomic((volatile int32_t *)&sDropped, 1);
+      }
+      return FALSE;
+   }
+
+   ringWrite(ring, ring->tail, &record, sizeof(WHBBinLogRecord));
+   ringWrite(ring, ring->tail + sizeof(WHBBinLogRecord), words, numWords * 4);
+   memoryBarrier();
+   ring->tail += recordSize;
+
+   OSRestoreInterrupts(enabled);
+   return TRUE;
+}
+
+void
+WHBBinLogGetStreamHeader(WHBBinLogStreamHeader *header)
+{
+   header->magic = WHB_BINLOG_MAGIC;
+   header->version = WHB_BINLOG_VERSION;
+   header->tickRate = OSTimerClockSpeed;
+   header->formatBase = (uint32_t)__whb_binlog_format_base;
+}
+
+uint32_t
+WHBBinLogRead(void *buffer,
+              uint32_t size)
+{
+   uint8_t *out = buffer;
+   uint32_t written = 0;
+   WHBBinLogRecord record;
+   uint32_t recordSize;
+   uint32_t head;
+   uint32_t tail;
+   int i;
+
+   for (i = 0; i < NUM_CORES; ++i) {
+      BinLogRing *ring = sRings[i];
+      if (!ring) {
+         continue;
+      }
+
+      head = ring->head;
+      tail = ring->tail;
+      memoryBarrier();
+
+      while (head != tail) {
+         ringRead(ring, head, &record, sizeof(WHBBinLogRecord));
+         recordSize = sizeof(WHBBinLogRecord) + record.numWords * 4;
+         if (written + recordSize > size) {
+            break;
+         }
+
+         ringRead(ring, head, out + written, recordSize);
+         written += recordSize;
+         head += recordSize;
+      }
+
+      memoryBarrier();
+      ring->head = head;
+   }
+
+   return written;
+}
+
+uint32_t
+WHBBinLogGetDroppedCount()
+{
+   return sDropped;
+}
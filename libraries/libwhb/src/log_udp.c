@@ -1,32 +1,230 @@
+#include <coreinit/condition.h>
+#include <coreinit/core.h>
+#include <coreinit/event.h>
 #include <coreinit/memdefaultheap.h>
 #include <coreinit/mutex.h>
+#include <coreinit/thread.h>
+#include <coreinit/time.h>
 #include <nsysnet/socket.h>
 #include <string.h>
 #include <whb/log.h>
 #include <whb/log_udp.h>
 #include <whb/libmanager.h>
 
+#define FLUSH_THREAD_STACK_SIZE (8 * 1024)
+#define FLUSH_THREAD_PRIORITY 16
+
+typedef enum
+{
+   SEND_STATE_IDLE,
+   //! The packet not being filled holds a datagram for the flush thread.
+   SEND_STATE_PENDING,
+   SEND_STATE_SENDING,
+} SendState;
+
+typedef struct
+{
+   uint32_t data[WHB_LOG_UDP_MAX_PAYLOAD / 4];
+   uint32_t size;
+   uint16_t count;
+} LogUdpPacket;
+
 static int
 sSocket = -1;
 
 static struct sockaddr_in
 sSendAddr;
 
-#define SERVER_PORT 4405
+static OSMutex
+sMutex;
+
+static OSEvent
+sPendingEvent;
+
+static OSCondition
+sSentCondition;
+
+static OSThread
+sFlushThread;
+
+static void *
+sFlushThreadStack = NULL;
+
+static volatile BOOL
+sRunning = FALSE;
+
+static OSTime
+sFlushInterval;
+
+static uint32_t
+sSequence = 0;
+
+// Loggers fill one packet while the flush thread sends the other
+static LogUdpPacket
+sPackets[2];
+
+static uint32_t
+sFillIndex = 0;
+
+static SendState
+sSendState = SEND_STATE_IDLE;
 
 static void
-udpLogHandler(const char *msg)
+resetPacket(LogUdpPacket *packet)
 {
+   packet->size = sizeof(WHBLogUdpPacketHeader);
+   packet->count = 0;
+}
+
+/*
+ * Hand the packet being filled to the flush thread and start filling the
+ * other one, called with sMutex held.
+ */
+static void
+queuePacket()
+{
+   LogUdpPacket *packet = &sPackets[sFillIndex];
+   WHBLogUdpPacketHeader *header = (WHBLogUdpPacketHeader *)packet->data;
+
+   header->magic = WHB_LOG_UDP_MAGIC;
+   header->sequence = sSequence++;
+   header->count = packet->count;
+   header->size = (uint16_t)packet->size;
+
+   sSendState = SEND_STATE_PENDING;
+   sFillIndex ^= 1;
+   resetPacket(&sPackets[sFillIndex]);
+}
+
+/*
+ * Queue the partially filled packet if nothing is pending, then send the
+ * pending packet. Returns FALSE when there was nothing to send.
+ */
+static BOOL
+sendPackets()
+{
+   LogUdpPacket *packet;
+
+   OSLockMutex(&sMutex);
+   if (sSendState == SEND_STATE_IDLE && sPackets[sFillIndex].count) {
+      queuePacket();
+   }
+
+   if (sSendState != SEND_STATE_PENDING) {
+      OSUnlockMutex(&sMutex);
+      return FALSE;
+   }
+
+   sSendState = SEND_STATE_SENDING;
+   packet = &sPackets[sFillIndex ^ 1];
+   OSUnlockMutex(&sMutex);
+
    sendto(sSocket,
-          msg,
-          strlen(msg),
+          packet->data,
+          packet->size,
           0,
           (struct sockaddr *)&sSendAddr,
           sizeof(struct sockaddr_in));
+
+   OSLockMutex(&sMutex);
+   sSendState = SEND_STATE_IDLE;
+   OSSignalCond(&sSentCondition);
+   OSUnlockMutex(&sMutex);
+   return TRUE;
+}
+
+static void
+udpLogHandler(const char *msg)
+{
+   const uint32_t maxChunk = WHB_LOG_UDP_MAX_PAYLOAD
+                           - sizeof(WHBLogUdpPacketHeader)
+                           - sizeof(WHBLogUdpMessageHeader);
+   uint32_t length = strlen(msg);
+   WHBLogUdpMessageHeader header;
+   LogUdpPacket *packet;
+   BOOL signal;
+
+   header.tick = (uint32_t)OSGetSystemTick();
+   header.core = (uint8_t)OSGetCoreId();
+   header.flags = 0;
+
+   OSLockMutex(&sMutex);
+   signal = (sPackets[sFillIndex].count == 0);
+
+   // Messages larger than a datagram are split across several
+   do {
+      uint32_t chunk = length < maxChunk ? length : maxChunk;
+      packet = &sPackets[sFillIndex];
+
+      if (packet->size + sizeof(WHBLogUdpMessageHeader) + chunk > WHB_LOG_UDP_MAX_PAYLOAD) {
+         // Only waits when logging outpaces the network by a whole datagram
+         while (sSendState != SEND_STATE_IDLE) {
+            OSWaitCond(&sSentCondition, &sMutex);
+         }
+
+         queuePacket();
+         packet = &sPackets[sFillIndex];
+         signal = TRUE;
+      }
+
+      header.length = (uint16_t)chunk;
+      memcpy((uint8_t *)packet->data + packet->size, &header, sizeof(WHBLogUdpMessageHeader));
+      memcpy((uint8_t *)packet->data + packet->size + sizeof(WHBLogUdpMessageHeader), msg, chunk);
+      packet->size += sizeof(WHBLogUdpMessageHeader) + chunk;
+      packet->count++;
+
+      msg += chunk;
+      length -= chunk;
+   } while (length);
+
+   OSUnlockMutex(&sMutex);
+
+   if (signal) {
+      OSSignalEvent(&sPendingEvent);
+   }
+}
+
+static int
+flushThreadMain(int argc,
+                const char **argv)
+{
+   SendState state;
+
+   while (sRunning) {
+      // Wait for the first message of a datagram or a full datagram. A full
+      // one is sent straight away, otherwise give it flushInterval to fill
+      // up before sending whatever we have.
+      OSWaitEvent(&sPendingEvent);
+      if (!sRunning) {
+         break;
+      }
+
+      OSLockMutex(&sMutex);
+      state = sSendState;
+      OSUnlockMutex(&sMutex);
+
+      if (state != SEND_STATE_PENDING) {
+         OSSleepTicks(sFlushInterval);
+      }
+
+      while (sendPackets());
+   }
+
+   return 0;
 }
 
 BOOL
 WHBLogUdpInit()
+{
+   return WHBLogUdpInitEx(INADDR_BROADCAST,
+                          WHB_LOG_UDP_PORT,
+                          WHB_LOG_UDP_DEFAULT_INTERVAL);
+}
+
+BOOL
+WHBLogUdpInitEx(uint32_t address,
+                uint16_t port,
+                uint32_t flushInterval)
 {
    int broadcastEnable = 1;
    WHBInitializeSocketLibrary();
@@ -36,23 +234,85 @@ WHBLogUdpInit()
       return FALSE;
    }
 
-   setsockopt(sSocket, SOL_SOCKET, SO_BROADCAST, &broadcastEnable, sizeof(broadcastEnable));
+   if (address == INADDR_BROADCAST) {
+      setsockopt(sSocket, SOL_SOCKET, SO_BROADCAST, &broadcastEnable, sizeof(broadcastEnable));
+   }
 
    memset(&sSendAddr, 0, sizeof(struct sockaddr_in));
    sSendAddr.sin_family = AF_INET;
-   sSendAddr.sin_port = htons(SERVER_PORT);
-   sSendAddr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+   sSendAddr.sin_port = htons(port);
+   sSendAddr.sin_addr.s_addr = htonl(address);
+
+   OSInitMutex(&sMutex);
+   OSInitCond(&sSentCondition);
+   OSInitEvent(&sPendingEvent, FALSE, OS_EVENT_MODE_AUTO);
+   sFlushInterval = OSMillisecondsToTicks(flushInterval);
+   sFillIndex = 0;
+   sSendState = SEND_STATE_IDLE;
+   resetPacket(&sPackets[0]);
+   resetPacket(&sPackets[1]);
+
+   sFlushThreadStack = MEMAllocFromDefaultHeapEx(FLUSH_THREAD_STACK_SIZE, 16);
+   if (!sFlushThreadStack) {
+      socketclose(sSocket);
+      sSocket = -1;
+      return FALSE;
+   }
+
+   sRunning = TRUE;
+   if (!OSCreateThread(&sFlushThread,
+                       flushThreadMain,
+                       0,
+                       NULL,
+                       (uint8_t *)sFlushThreadStack + FLUSH_THREAD_STACK_SIZE,
+                       FLUSH_THREAD_STACK_SIZE,
+                       FLUSH_THREAD_PRIORITY,
+                       OS_THREAD_ATTRIB_AFFINITY_ANY)) {
+      sRunning = FALSE;
+      MEMFreeToDefaultHeap(sFlushThreadStack);
+      sFlushThreadStack = NULL;
+      socketclose(sSocket);
+      sSocket = -1;
+      return FALSE;
+   }
+
+   OSSetThreadName(&sFlushThread, "WHBLogUdpFlush");
+   OSResumeThread(&sFlushThread);
 
    return WHBAddLogHandler(udpLogHandler);
 }
 
+void
+WHBLogUdpFlush()
+{
+   if (sSocket < 0) {
+      return;
+   }
+
+   while (sendPackets());
+}
+
 BOOL
 WHBLogUdpDeinit()
 {
-   if(shutdown(sSocket, SHUT_WR) != 0) {
-      return FALSE;
+   WHBRemoveLogHandler(udpLogHandler);
+
+   if (sRunning) {
+      sRunning = FALSE;
+      OSSignalEvent(&sPendingEvent);
+      OSJoinThread(&sFlushThread, NULL);
+      MEMFreeToDefaultHeap(sFlushThreadStack);
+      sFlushThreadStack = NULL;
+   }
+
+   WHBLogUdpFlush();
+
+   // A UDP socket is never connected, so there is nothing to shut down
+   if (sSocket >= 0) {
+      socketclose(sSocket);
+      sSocket = -1;
    }
 
    WHBDeinitializeSocketLibrary();
-   return WHBRemoveLogHandler(udpLogHandler);
+   return TRUE;
 }
@@ -0,0 +1,422 @@
+#include <coreinit/alarm.h>
+#include <coreinit/core.h>
+#include <coreinit/debug.h>
+#include <coreinit/memdefaultheap.h>
+#include <coreinit/systeminfo.h>
+#include <coreinit/thread.h>
+#include <coreinit/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <whb/log.h>
+#include <whb/profiler.h>
+
+#include "crash_stack.h"
+
+#define NUM_CORES (3)
+#define SETUP_THREAD_STACK_SIZE (4096)
+#define SETUP_THREAD_PRIORITY (16)
+#define SYMBOL_NAME_SIZE (128)
+#define LINE_SIZE (1024)
+
+typedef struct ProfilerSample
+{
+   uint32_t depth;
+   uint32_t pcs[WHB_PROFILER_MAX_DEPTH];
+} ProfilerSample;
+
+typedef struct ProfilerStack
+{
+   uint32_t core;
+   ProfilerSample sample;
+} ProfilerStack;
+
+typedef struct ProfilerEntry
+{
+   uint32_t address;
+   uint32_t count;
+} ProfilerEntry;
+
+typedef struct ProfilerCore
+{
+   OSAlarm alarm;
+   ProfilerSample *samples;
+   volatile uint32_t count;
+   volatile uint32_t dropped;
+   BOOL enabled;
+} ProfilerCore;
+
+static ProfilerCore
+sCores[NUM_CORES];
+
+static uint32_t
+sCapacity = 0;
+
+static OSTime
+sInterval;
+
+static BOOL
+sRunning = FALSE;
+
+static OSThread __attribute__((aligned(8)))
+sSetupThread;
+
+static uint8_t __attribute__((aligned(8)))
+sSetupThreadStack[SETUP_THREAD_STACK_SIZE];
+
+static inline void
+memoryBarrier()
+{
+   __asm__ __volatile__ ("sync" : : : "memory");
+}
+
+static void
+sampleAlarmCallback(OSAlarm *alarm,
+                    OSContext *context)
+{
+   ProfilerCore *core = &sCores[OSGetCoreId()];
+   OSThread *thread = OSGetCurrentThread();
+   uint32_t frames[WHB_PROFILER_MAX_DEPTH];
+   ProfilerSample *sample;
+   uint32_t i, count;
+
+   // Only this core's alarm writes to its buffer, so no locking is needed
+   if (core->count >= sCapacity) {
+      core->dropped++;
+      return;
+   }
+
+   sample = &core->samples[core->count];
+   sample->pcs[0] = context->srr0;
+   sample->depth = 1;
+
+   if (thread) {
+      uint32_t low = (uint32_t)thread->stackEnd;
+      uint32_t high = (uint32_t)thread->stackStart;
+      if (low > high) {
+         low = high;
+         high = (uint32_t)thread->stackEnd;
+      }
+
+      // Each caller's return address is in the LR save word of its frame
+      count = CrashWalkStack(context->gpr[1], low, high,
+                             frames, WHB_PROFILER_MAX_DEPTH);
+      for (i = 1; i < count; ++i) {
+         sample->pcs[sample->depth++] = ((uint32_t *)frames[i])[1];
+      }
+   }
+
+   memoryBarrier();
+   core->count++;
+}
+
+static int
+setupThreadMain(int argc,
+                const char **argv)
+{
+   ProfilerCore *core = &sCores[OSGetCoreId()];
+
+   // Alarms fire on the core which set them
+   if (argc) {
+      OSCreateAlarm(&core->alarm);
+      OSSetPeriodicAlarm(&core->alarm, sInterval, sInterval, sampleAlarmCallback);
+   } else {
+      OSCancelAlarm(&core->alarm);
+   }
+
+   return 0;
+}
+
+static void
+runOnEnabledCores(BOOL start)
+{
+   int i;
+
+   for (i = 0; i < NUM_CORES; ++i) {
+      if (!sCores[i].enabled) {
+         continue;
+      }
+
+      if (!OSCreateThread(&sSetupThread,
+                          setupThreadMain,
+                          start ? 1 : 0,
+                          NULL,
+                          sSetupThreadStack + SETUP_THREAD_STACK_SIZE,
+                          SETUP_THREAD_STACK_SIZE,
+                          SETUP_THREAD_PRIORITY,
+                          OS_THREAD_ATTRIB_AFFINITY_CPU0 << i)) {
+         WHBLogPrintf("%s: OSCreateThread failed for core %d", __FUNCTION__, i);
+         continue;
+      }
+
+      OSSetThreadName(&sSetupThread, "WHBProfilerSetup");
+      OSResumeThread(&sSetupThread);
+      OSJoinThread(&sSetupThread, NULL);
+   }
+}
+
+static void
+freeSamples()
+{
+   int i;
+
+   for (i = 0; i < NUM_CORES; ++i) {
+      if (sCores[i].samples) {
+         MEMFreeToDefaultHeap(sCores[i].samples);
+         sCores[i].samples = NULL;
+      }
+
+      sCores[i].count = 0;
+      sCores[i].dropped = 0;
+      sCores[i].enabled = FALSE;
+   }
+
+   sCapacity = 0;
+}
+
+BOOL
+WHBProfilerStart(uint32_t rateHz,
+                 uint32_t samplesPerCore,
+                 uint32_t coreMask)
+{
+   int i;
+
+   if (sRunning || !rateHz || !samplesPerCore || !(coreMask & 7)) {
+      return FALSE;
+   }
+
+   freeSamples();
+
+   for (i = 0; i < NUM_CORES; ++i) {
+      if (!(coreMask & (1 << i))) {
+         continue;
+      }
+
+      sCores[i].samples = MEMAllocFromDefaultHeapEx(samplesPerCore * sizeof(ProfilerSample), 4);
+      if (!sCores[i].samples) {
+         WHBLogPrintf("%s: MEMAllocFromDefaultHeapEx(0x%X, 4) returned NULL",
+                      __FUNCTION__, (uint32_t)(samplesPerCore * sizeof(ProfilerSample)));
+         freeSamples();
+         return FALSE;
+      }
+
+      sCores[i].enabled = TRUE;
+   }
+
+   sCapacity = samplesPerCore;
+   sInterval = OSTimerClockSpeed / rateHz;
+   runOnEnabledCores(TRUE);
+   sRunning = TRUE;
+   return TRUE;
+}
+
+void
+WHBProfilerStop()
+{
+   if (!sRunning) {
+      return;
+   }
+
+   runOnEnabledCores(FALSE);
+   sRunning = FALSE;
+}
+
+void
+WHBProfilerShutdown()
+{
+   WHBProfilerStop();
+   freeSamples();
+}
+
+uint32_t
+WHBProfilerGetSampleCount(uint32_t core)
+{
+   if (core >= NUM_CORES) {
+      return 0;
+   }
+
+   return sCores[core].count;
+}
+
+uint32_t
+WHBProfilerGetDroppedCount()
+{
+   return sCores[0].dropped + sCores[1].dropped + sCores[2].dropped;
+}
+
+static void
+writeLine(WHBProfilerOutputFn fn,
+          void *userData,
+          const char *line)
+{
+   if (fn) {
+      fn(line, userData);
+   } else {
+      WHBLogPrint(line);
+   }
+}
+
+static uint32_t
+getTotalSamples()
+{
+   return sCores[0].count + sCores[1].count + sCores[2].count;
+}
+
+static uint32_t
+getSymbolStart(uint32_t address)
+{
+   char name[SYMBOL_NAME_SIZE];
+   uint32_t start = OSGetSymbolName(address, name, sizeof(name));
+   return start ? start : address;
+}
+
+static int
+getSymbolName(uint32_t address,
+              char *buffer,
+              uint32_t size)
+{
+   if (!OSGetSymbolName(address, buffer, size)) {
+      snprintf(buffer, size, "0x%08X", (unsigned)address);
+   }
+
+   return strlen(buffer);
+}
+
+static int
+compareAddress(const void *a,
+               const void *b)
+{
+   uint32_t lhs = ((const ProfilerEntry *)a)->address;
+   uint32_t rhs = ((const ProfilerEntry *)b)->address;
+   return lhs < rhs ? -1 : (lhs > rhs ? 1 : 0);
+}
+
+static int
+compareCount(const void *a,
+             const void *b)
+{
+   uint32_t lhs = ((const ProfilerEntry *)a)->count;
+   uint32_t rhs = ((const ProfilerEntry *)b)->count;
+   return lhs > rhs ? -1 : (lhs < rhs ? 1 : 0);
+}
+
+static int
+compareStack(const void *a,
+             const void *b)
+{
+   return memcmp(a, b, sizeof(ProfilerStack));
+}
+
+BOOL
+WHBProfilerWriteHistogram(WHBProfilerOutputFn fn,
+                          void *userData,
+                          uint32_t maxEntries)
+{
+   char line[LINE_SIZE];
+   ProfilerEntry *entries;
+   uint32_t total = getTotalSamples();
+   uint32_t i, j, numEntries = 0;
+   int length;
+
+   if (sRunning || !total) {
+      return FALSE;
+   }
+
+   entries = MEMAllocFromDefaultHeapEx(total * sizeof(ProfilerEntry), 4);
+   if (!entries) {
+      return FALSE;
+   }
+
+   for (i = 0; i < NUM_CORES; ++i) {
+      for (j = 0; j < sCores[i].count; ++j) {
+         entries[numEntries].address = getSymbolStart(sCores[i].samples[j].pcs[0]);
+         entries[numEntries].count = 1;
+         numEntries++;
+      }
+   }
+
+   // Merge samples in the same function, then order by sample count
+   qsort(entries, numEntries, sizeof(ProfilerEntry), compareAddress);
+   for (i = 1, j = 0; i < numEntries; ++i) {
+      if (entries[i].address == entries[j].address) {
+         entries[j].count++;
+      } else {
+         entries[++j] = entries[i];
+      }
+   }
+
+   numEntries = j + 1;
+   qsort(entries, numEntries, sizeof(ProfilerEntry), compareCount);
+
+   snprintf(line, sizeof(line), "%u samples, %u dropped",
+            (unsigned)total, (unsigned)WHBProfilerGetDroppedCount());
+   writeLine(fn, userData, line);
+
+   for (i = 0; i < numEntries && i < maxEntries; ++i) {
+      length = snprintf(line, sizeof(line), "%8u %5.1f%% ",
+                        (unsigned)entries[i].count, entries[i].count * 100.0f / total);
+      getSymbolName(entries[i].address, line + length, sizeof(line) - length);
+      writeLine(fn, userData, line);
+   }
+
+   MEMFreeToDefaultHeap(entries);
+   return TRUE;
+}
+
+BOOL
+WHBProfilerWriteCollapsed(WHBProfilerOutputFn fn,
+                          void *userData)
+{
+   char line[LINE_SIZE];
+   ProfilerStack *stacks;
+   uint32_t total = getTotalSamples();
+   uint32_t i, j, k, count, numStacks = 0;
+   int length;
+
+   if (sRunning || !total) {
+      return FALSE;
+   }
+
+   stacks = MEMAllocFromDefaultHeapEx(total * sizeof(ProfilerStack), 4);
+   if (!stacks) {
+      return FALSE;
+   }
+
+   // Reduce every frame to its function so identical stacks can be merged
+   memset(stacks, 0, total * sizeof(ProfilerStack));
+   for (i = 0; i < NUM_CORES; ++i) {
+      for (j = 0; j < sCores[i].count; ++j) {
+         ProfilerSample *sample = &sCores[i].samples[j];
+         ProfilerStack *stack = &stacks[numStacks++];
+         stack->core = i;
+         stack->sample.depth = sample->depth;
+         for (k = 0; k < sample->depth; ++k) {
+            stack->sample.pcs[k] = getSymbolStart(sample->pcs[k]);
+         }
+      }
+   }
+
+   qsort(stacks, numStacks, sizeof(ProfilerStack), compareStack);
+
+   for (i = 0; i < numStacks; i += count) {
+      ProfilerStack *stack = &stacks[i];
+
+      for (count = 1; i + count < numStacks; ++count) {
+         if (compareStack(stack, &stacks[i + count])) {
+            break;
+         }
+      }
+
+      length = snprintf(line, sizeof(line), "core%u", (unsigned)stack->core);
+      for (k = stack->sample.depth; k > 0 && length < LINE_SIZE - 16; --k) {
+         line[length++] = ';';
+         length += getSymbolName(stack->sample.pcs[k - 1], line + length, LINE_SIZE - 16 - length);
+      }
+
+      snprintf(line + length, sizeof(line) - length, " %u", (unsigned)count);
+      writeLine(fn, userData, line);
+   }
+
+   MEMFreeToDefaultHeap(stacks);
+   return TRUE;
+}
@@ -0,0 +1,557 @@
+#include <coreinit/atomic.h>
+#include <coreinit/memdefaultheap.h>
+#include <coreinit/memexpheap.h>
+#include <coreinit/memheap.h>
+#include <coreinit/thread.h>
+#include <coreinit/time.h>
+#include <nsysnet/socket.h>
+#include <whb/libmanager.h>
+#include <whb/log.h>
+#include <whb/telemetry.h>
+
+#include <string.h>
+
+#define PUBLISHER_STACK_SIZE (16 * 1024)
+#define SELECT_TIMEOUT_US 100000
+#define MESSAGE_HEADER_SIZE 4
+#define FRAME_HEADER_SIZE 10
+#define FRAME_ENTRY_SIZE 6
+#define MESSAGE_BUFFER_SIZE (MESSAGE_HEADER_SIZE + FRAME_HEADER_SIZE \
+                             + WHB_TELEMETRY_MAX_METRICS * FRAME_ENTRY_SIZE)
+
+typedef struct
+{
+   volatile int32_t value;
+   volatile uint32_t ready;
+   //! Counter value at the previous sample, only touched by the sampler.
+   int32_t lastValue;
+   WHBTelemetryType type;
+   char name[WHB_TELEMETRY_MAX_NAME + 1];
+} TelemetryMetric;
+
+typedef struct
+{
+   uint32_t frame;
+   uint32_t tick;
+   uint32_t numMetrics;
+   int32_t values[WHB_TELEMETRY_MAX_METRICS];
+} TelemetrySample;
+
+/*
+ * Samples go from the sampling thread to the publisher through a single
+ * producer, single consumer ring.
+ */
+typedef struct
+{
+   volatile uint32_t head;
+   uint8_t headPadding[28];
+   volatile uint32_t tail;
+   uint8_t tailPadding[28];
+   TelemetrySample samples[WHB_TELEMETRY_RING_SIZE];
+} TelemetryRing;
+
+static TelemetryMetric
+sMetrics[WHB_TELEMETRY_MAX_METRICS];
+
+static volatile uint32_t
+sNumMetrics = 0;
+
+static TelemetryRing *
+sRing = NULL;
+
+static volatile uint32_t
+sDroppedFrames = 0;
+
+static uint32_t
+sFrame = 0;
+
+static OSTime
+sLastFrameTime = 0;
+
+static WHBTelemetryId
+sFrameTimeId = WHB_TELEMETRY_INVALID;
+
+static WHBTelemetryId
+sMem2FreeId = WHB_TELEMETRY_INVALID;
+
+static int
+sSocket = -1;
+
+static int
+sClient = -1;
+
+static OSThread
+sPublisherThread;
+
+static void *
+sPublisherStack = NULL;
+
+static volatile BOOL
+sRunning = FALSE;
+
+// Publisher state, only touched by the publisher thread
+static uint32_t
+sSentMetrics = 0;
+
+static int32_t
+sSentValues[WHB_TELEMETRY_MAX_METRICS];
+
+// Metrics below this have had a value sent to the current client
+static uint32_t
+sNumSentValues = 0;
+
+static uint8_t
+sMessage[MESSAGE_BUFFER_SIZE];
+
+static inline void
+memoryBarrier()
+{
+   __asm__ __volatile__ ("sync" : : : "memory");
+}
+
+static inline uint8_t *
+writeBE16(uint8_t *dst,
+          uint16_t value)
+{
+   dst[0] = (uint8_t)(value >> 8);
+   dst[1] = (uint8_t)value;
+   return dst + 2;
+}
+
+static inline uint8_t *
+writeBE32(uint8_t *dst,
+          uint32_t value)
+{
+   dst[0] = (uint8_t)(value >> 24);
+   dst[1] = (uint8_t)(value >> 16);
+   dst[2] = (uint8_t)(value >> 8);
+   dst[3] = (uint8_t)value;
+   return dst + 4;
+}
+
+static inline TelemetryMetric *
+getMetric(WHBTelemetryId id)
+{
+   if (id < 0 || id >= WHB_TELEMETRY_MAX_METRICS) {
+      return NULL;
+   }
+
+   return &sMetrics[id];
+}
+
+//! Metrics are usable up to the first one still being registered.
+static uint32_t
+readyMetricCount()
+{
+   uint32_t count = sNumMetrics;
+   uint32_t i;
+
+   if (count > WHB_TELEMETRY_MAX_METRICS) {
+      count = WHB_TELEMETRY_MAX_METRICS;
+   }
+
+   for (i = 0; i < count; ++i) {
+      if (!sMetrics[i].ready) {
+         return i;
+      }
+   }
+
+   return count;
+}
+
+static inline void
+closeClient(const char * funcName)
+{
+   int ret = socketclose(sClient);
+   if(ret < 0) {
+      WHBLogPrintf("%s: Error occurred closing client socket: %d", funcName, socketlasterr());
+   }
+
+   sClient = -1;
+}
+
+static BOOL
+sendMessage(uint8_t *end)
+{
+   uint32_t size = (uint32_t)(end - sMessage);
+   uint8_t *data = sMessage;
+   int ret;
+
+   writeBE16(sMessage + 2, (uint16_t)(size - MESSAGE_HEADER_SIZE));
+
+   while (size) {
+      ret = send(sClient, data, size, 0);
+      if (ret <= 0) {
+         return FALSE;
+      }
+
+      data += ret;
+      size -= ret;
+   }
+
+   return TRUE;
+}
+
+static BOOL
+publishMetrics()
+{
+   uint32_t count = readyMetricCount();
+   uint32_t length;
+   uint8_t *p;
+
+   for (; sSentMetrics < count; ++sSentMetrics) {
+      TelemetryMetric *metric = &sMetrics[sSentMetrics];
+      length = strlen(metric->name);
+
+      p = writeBE16(sMessage, WHB_TELEMETRY_MSG_METRIC);
+      p += 2;
+      p = writeBE16(p, (uint16_t)sSentMetrics);
+      *p++ = (uint8_t)metric->type;
+      *p++ = (uint8_t)length;
+      memcpy(p, metric->name, length);
+
+      if (!sendMessage(p + length)) {
+         return FALSE;
+      }
+   }
+
+   return TRUE;
+}
+
+static BOOL
+publishSample(TelemetrySample *sample)
+{
+   uint8_t *countPos;
+   uint16_t changed = 0;
+   uint32_t i;
+   uint8_t *p;
+
+   p = writeBE16(sMessage, WHB_TELEMETRY_MSG_FRAME);
+   p += 2;
+   p = writeBE32(p, sample->frame);
+   p = writeBE32(p, sample->tick);
+   countPos = p;
+   p += 2;
+
+   for (i = 0; i < sample->numMetrics && i < sSentMetrics; ++i) {
+      if (i < sNumSentValues && sample->values[i] == sSentValues[i]) {
+         continue;
+      }
+
+      p = writeBE16(p, (uint16_t)i);
+      p = writeBE32(p, (uint32_t)sample->values[i]);
+      sSentValues[i] = sample->values[i];
+      changed++;
+   }
+
+   if (i > sNumSentValues) {
+      sNumSentValues = i;
+   }
+
+   writeBE16(countPos, changed);
+   return sendMessage(p);
+}
+
+static void
+acceptClient()
+{
+   struct sockaddr_in clientAddr;
+   socklen_t clientAddrLen = sizeof(struct sockaddr_in);
+   struct timeval timeout;
+   fd_set readSet;
+   int blocking = 1;
+
+   FD_ZERO(&readSet);
+   FD_SET(sSocket, &readSet);
+   timeout.tv_sec = 0;
+   timeout.tv_usec = SELECT_TIMEOUT_US;
+
+   if (select(sSocket + 1, &readSet, NULL, NULL, &timeout) <= 0) {
+      return;
+   }
+
+   sClient = accept(sSocket, (struct sockaddr *)&clientAddr, &clientAddrLen);
+   if (sClient < 0) {
+      sClient = -1;
+      return;
+   }
+
+   // Sends happen on this thread only, so it is fine for them to block
+   setsockopt(sClient, SOL_SOCKET, SO_BIO, &blocking, sizeof(blocking));
+
+   // A new client gets every metric and a full first frame
+   sSentMetrics = 0;
+   sNumSentValues = 0;
+}
+
+static int
+publisherThreadMain(int argc,
+                    const char **argv)
+{
+   TelemetrySample *sample;
+   uint32_t head;
+
+   while (sRunning) {
+      if (sClient < 0) {
+         acceptClient();
+      }
+
+      // Nobody is listening, drop everything so a new client starts with
+      // fresh samples and nothing counts as a dropped frame.
+      if (sClient < 0) {
+         sRing->head = sRing->tail;
+         continue;
+      }
+
+      if (!publishMetrics()) {
+         closeClient(__FUNCTION__);
+         continue;
+      }
+
+      head = sRing->head;
+      if (head == sRing->tail) {
+         OSSleepTicks(OSMillisecondsToTicks(4));
+         continue;
+      }
+
+      memoryBarrier();
+      sample = &sRing->samples[head % WHB_TELEMETRY_RING_SIZE];
+
+      if (!publishSample(sample)) {
+         closeClient(__FUNCTION__);
+      }
+
+      memoryBarrier();
+      sRing->head = head + 1;
+   }
+
+   return 0;
+}
+
+BOOL
+WHBTelemetryInit(uint16_t port,
+                 int32_t priority)
+{
+   struct sockaddr_in addr;
+   int nonBlocking = 1;
+   int ret;
+
+   if (sRunning) {
+      return TRUE;
+   }
+
+   sRing = MEMAllocFromDefaultHeapEx(sizeof(TelemetryRing), 32);
+   sPublisherStack = MEMAllocFromDefaultHeapEx(PUBLISHER_STACK_SIZE, 16);
+   if (!sRing || !sPublisherStack) {
+      WHBLogPrintf("%s: Failed to allocate telemetry buffers.", __FUNCTION__);
+      goto error;
+   }
+
+   memset(sRing, 0, sizeof(TelemetryRing));
+
+   WHBInitializeSocketLibrary();
+
+   sSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+   if (sSocket < 0) {
+      WHBLogPrintf("%s: Error occurred while creating socket: %d", __FUNCTION__, socketlasterr());
+      WHBDeinitializeSocketLibrary();
+      goto error;
+   }
+
+   memset(&addr, 0, sizeof(struct sockaddr_in));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+   addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+   ret = bind(sSocket, (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
+   if (ret >= 0) {
+      ret = listen(sSocket, 1);
+   }
+
+   if (ret < 0) {
+      WHBLogPrintf("%s: Error occurred while setting up socket: %d", __FUNCTION__, socketlasterr());
+      socketclose(sSocket);
+      sSocket = -1;
+      WHBDeinitializeSocketLibrary();
+      goto error;
+   }
+
+   setsockopt(sSocket, SOL_SOCKET, SO_NBIO, &nonBlocking, sizeof(nonBlocking));
+
+   if (sFrameTimeId == WHB_TELEMETRY_INVALID) {
+      sFrameTimeId = WHBTelemetryRegister("frame_time_us", WHB_TELEMETRY_GAUGE);
+      sMem2FreeId = WHBTelemetryRegister("mem2_free", WHB_TELEMETRY_GAUGE);
+   }
+
+   sRunning = TRUE;
+   if (!OSCreateThread(&sPublisherThread,
+                       publisherThreadMain,
+                       0,
+                       NULL,
+                       (uint8_t *)sPublisherStack + PUBLISHER_STACK_SIZE,
+                       PUBLISHER_STACK_SIZE,
+                       priority,
+                       OS_THREAD_ATTRIB_AFFINITY_ANY)) {
+      WHBLogPrintf("%s: Failed to create publisher thread.", __FUNCTION__);
+      sRunning = FALSE;
+      socketclose(sSocket);
+      sSocket = -1;
+      WHBDeinitializeSocketLibrary();
+      goto error;
+   }
+
+   OSSetThreadName(&sPublisherThread, "WHBTelemetry");
+   OSResumeThread(&sPublisherThread);
+   return TRUE;
+
+error:
+   if (sRing) {
+      MEMFreeToDefaultHeap(sRing);
+      sRing = NULL;
+   }
+
+   if (sPublisherStack) {
+      MEMFreeToDefaultHeap(sPublisherStack);
+      sPublisherStack = NULL;
+   }
+
+   return FALSE;
+}
+
+void
+WHBTelemetryShutdown()
+{
+   if (!sRunning) {
+      return;
+   }
+
+   sRunning = FALSE;
+   OSJoinThread(&sPublisherThread, NULL);
+
+   if (sClient >= 0) {
+      closeClient(__FUNCTION__);
+   }
+
+   socketclose(sSocket);
+   sSocket = -1;
+   WHBDeinitializeSocketLibrary();
+
+   MEMFreeToDefaultHeap(sRing);
+   sRing = NULL;
+   MEMFreeToDefaultHeap(sPublisherStack);
+   sPublisherStack = NULL;
+}
+
+WHBTelemetryId
+WHBTelemetryRegister(const char *name,
+                     WHBTelemetryType type)
+{
+   WHBTelemetryId id = OSAddAtomic((volatile int32_t *)&sNumMetrics, 1);
+   TelemetryMetric *metric = getMetric(id);
+   if (!metric) {
+      return WHB_TELEMETRY_INVALID;
+   }
+
+   strncpy(metric->name, name, WHB_TELEMETRY_MAX_NAME);
+   metric->name[WHB_TELEMETRY_MAX_NAME] = 0;
+   metric->type = type;
+   metric->value = 0;
+   metric->lastValue = 0;
+
+   memoryBarrier();
+   metric->ready = 1;
+   return id;
+}
+
+void
+WHBTelemetryCounterAdd(WHBTelemetryId id,
+                       int32_t value)
+{
+   TelemetryMetric *metric = getMetric(id);
+   if (metric) {
+      OSAddAtomic(&metric->value, value);
+   }
+}
+
+void
+WHBTelemetryGaugeSet(WHBTelemetryId id,
+                     int32_t value)
+{
+   TelemetryMetric *metric = getMetric(id);
+   if (metric) {
+      metric->value = value;
+   }
+}
+
+void
+WHBTelemetryTimerAdd(WHBTelemetryId id,
+                     OSTime start)
+{
+   TelemetryMetric *metric = getMetric(id);
+   if (metric) {
+      OSAddAtomic(&metric->value, (int32_t)(OSGetTime() - start));
+   }
+}
+
+void
+WHBTelemetrySampleFrame()
+{
+   TelemetrySample *sample;
+   OSTime now = OSGetTime();
+   uint32_t tail;
+   uint32_t i;
+
+   if (!sRing) {
+      return;
+   }
+
+   if (sLastFrameTime) {
+      WHBTelemetryGaugeSet(sFrameTimeId, (int32_t)OSTicksToMicroseconds(now - sLastFrameTime));
+   }
+   sLastFrameTime = now;
+
+   WHBTelemetryGaugeSet(sMem2FreeId,
+      (int32_t)MEMGetTotalFreeSizeForExpHeap(MEMGetBaseHeapHandle(MEM_BASE_HEAP_MEM2)));
+
+   tail = sRing->tail;
+   if (tail - sRing->head >= WHB_TELEMETRY_RING_SIZE) {
+      OSAddAtomic((volatile int32_t *)&sDroppedFrames, 1);
+      sFrame++;
+      return;
+   }
+
+   sample = &sRing->samples[tail % WHB_TELEMETRY_RING_SIZE];
+   sample->frame = sFrame++;
+   sample->tick = (uint32_t)OSGetSystemTick();
+   sample->numMetrics = readyMetricCount();
+
+   for (i = 0; i < sample->numMetrics; ++i) {
+      TelemetryMetric *metric = &sMetrics[i];
+      int32_t value;
+
+      switch (metric->type) {
+      case WHB_TELEMETRY_COUNTER:
+         value = metric->value;
+         sample->values[i] = value - metric->lastValue;
+         metric->lastValue = value;
+         break;
+      case WHB_TELEMETRY_TIMER:
+         value = (int32_t)OSSwapAtomic((volatile uint32_t *)&metric->value, 0);
+         sample->values[i] = (int32_t)OSTicksToMicroseconds(value);
+         break;
+      case WHB_TELEMETRY_GAUGE:
+      default:
+         sample->values[i] = metric->value;
+         break;
+      }
+   }
+
+   memoryBarrier();
+   sRing->tail = tail + 1;
+}
+
+uint32_t
+WHBTelemetryGetDroppedFrames()
+{
+   return sDroppedFrames;
+}
@@ -0,0 +1,488 @@
+#include <coreinit/atomic.h>
+#include <coreinit/core.h>
+#include <coreinit/filesystem.h>
+#include <coreinit/memdefaultheap.h>
+#include <coreinit/systeminfo.h>
+#include <coreinit/thread.h>
+#include <coreinit/time.h>
+#include <nsysnet/socket.h>
+#include <stdio.h>
+#include <string.h>
+#include <whb/libmanager.h>
+#include <whb/log.h>
+#include <whb/sdcard.h>
+#include <whb/trace.h>
+
+#define NUM_CORES (3)
+#define OUTPUT_BUFFER_SIZE (16 * 1024)
+#define LINE_SIZE (512)
+#define PATH_SIZE (256)
+
+typedef struct TraceEvent
+{
+   const char *name;
+   OSTick begin;
+   OSTick end;
+   uint32_t core;
+} TraceEvent;
+
+typedef struct TraceThread
+{
+   volatile uint32_t writeIndex;
+   //! Set while the owning thread is writing into its ring.
+   volatile BOOL busy;
+   uint32_t generation;
+   uint32_t id;
+   char name[32];
+   TraceEvent *events;
+} TraceThread;
+
+typedef struct TraceOutput TraceOutput;
+
+struct TraceOutput
+{
+   BOOL (*write)(TraceOutput *output, uint8_t *data, uint32_t size);
+   uint8_t *buffer;
+   uint32_t size;
+   BOOL error;
+   int socket;
+   FSClient *client;
+   FSCmdBlock *cmd;
+   FSFileHandle handle;
+};
+
+static TraceThread
+sThreads[WHB_TRACE_MAX_THREADS];
+
+static volatile int32_t
+sNumThreads = 0;
+
+static uint32_t
+sMaxThreads = 0;
+
+static volatile uint32_t
+sDroppedThreads = 0;
+
+static TraceEvent *
+sEvents = NULL;
+
+static uint32_t
+sEventsPerThread = 0;
+
+static uint32_t
+sGeneration = 0;
+
+static volatile BOOL
+sPaused = FALSE;
+
+static uint8_t *
+sOutputBuffer = NULL;
+
+static FSClient
+sClient;
+
+static FSCmdBlock
+sCmd;
+
+static inline void
+memoryBarrier()
+{
+   __asm__ __volatile__ ("sync" : : : "memory");
+}
+
+// Stored instead of a TraceThread for a thread which got no ring, tagged with
+// the generation so the thread tries again after the next WHBTraceInit.
+static inline void *
+noRingMarker(uint32_t generation)
+{
+   return (void *)(((uintptr_t)generation << 1) | 1);
+}
+
+// Wait for threads which were past the sPaused check when it was set
+static void
+waitForWriters()
+{
+   uint32_t numThreads = sNumThreads < (int32_t)sMaxThreads ? (uint32_t)sNumThreads : sMaxThreads;
+   uint32_t i;
+
+   for (i = 0; i < numThreads; ++i) {
+      while (sThreads[i].busy) {
+         OSSleepTicks(OSMicrosecondsToTicks(100));
+      }
+   }
+}
+
+BOOL
+WHBTraceInit(uint32_t maxThreads,
+             uint32_t eventsPerThread)
+{
+   uint32_t numEvents = 1;
+
+   if (sEvents || !maxThreads || !eventsPerThread) {
+      return FALSE;
+   }
+
+   if (maxThreads > WHB_TRACE_MAX_THREADS) {
+      maxThreads = WHB_TRACE_MAX_THREADS;
+   }
+
+   while (numEvents < eventsPerThread) {
+      numEvents <<= 1;
+   }
+
+   sEvents = MEMAllocFromDefaultHeapEx(maxThreads * numEvents * sizeof(TraceEvent), 4);
+   if (!sEvents) {
+      WHBLogPrintf("%s: MEMAllocFromDefaultHeapEx(0x%X, 4) returned NULL", __FUNCTION__,
+                   (uint32_t)(maxThreads * numEvents * sizeof(TraceEvent)));
+      return FALSE;
+   }
+
+   // FS requires 0x40 aligned buffers
+   sOutputBuffer = MEMAllocFromDefaultHeapEx(OUTPUT_BUFFER_SIZE, 0x40);
+   if (!sOutputBuffer) {
+      MEMFreeToDefaultHeap(sEvents);
+      sEvents = NULL;
+      return FALSE;
+   }
+
+   // Threads holding a ring from a previous init see the new generation and
+   // claim a new one.
+   sGeneration++;
+   sMaxThreads = maxThreads;
+   sEventsPerThread = numEvents;
+   sNumThreads = 0;
+   sDroppedThreads = 0;
+   sPaused = FALSE;
+   return TRUE;
+}
+
+void
+WHBTraceShutdown()
+{
+   if (!sEvents) {
+      return;
+   }
+
+   sPaused = TRUE;
+   sGeneration++;
+   memoryBarrier();
+   waitForWriters();
+
+   MEMFreeToDefaultHeap(sEvents);
+   MEMFreeToDefaultHeap(sOutputBuffer);
+   sEvents = NULL;
+   sOutputBuffer = NULL;
+}
+
+static TraceThread *
+claimThread(uint32_t generation)
+{
+   OSThread *thread = OSGetCurrentThread();
+   TraceThread *trace;
+   int32_t index = OSAddAtomic(&sNumThreads, 1);
+
+   if (index >= (int32_t)sMaxThreads) {
+      OSAddAtomic((volatile int32_t *)&sDroppedThreads, 1);
+      OSSetThreadSpecific(WHB_TRACE_THREAD_SPECIFIC_ID, noRingMarker(generation));
+      return NULL;
+   }
+
+   trace = &sThreads[index];
+   trace->writeIndex = 0;
+   trace->busy = FALSE;
+   trace->id = thread->id;
+   trace->events = sEvents + index * sEventsPerThread;
+   memset(trace->name, 0, sizeof(trace->name));
+   if (thread->name) {
+      strncpy(trace->name, thread->name, sizeof(trace->name) - 1);
+   }
+
+   memoryBarrier();
+   trace->generation = generation;
+   OSSetThreadSpecific(WHB_TRACE_THREAD_SPECIFIC_ID, trace);
+   return trace;
+}
+
+void
+WHBTraceZoneEnd(WHBTraceZone *zone)
+{
+   uint32_t generation = sGeneration;
+   TraceThread *trace;
+   TraceEvent *event;
+   void *value;
+
+   if (sPaused || !sEvents) {
+      return;
+   }
+
+   value = OSGetThreadSpecific(WHB_TRACE_THREAD_SPECIFIC_ID);
+   if (value == noRingMarker(generation)) {
+      return;
+   }
+
+   trace = (TraceThread *)value;
+   if (!trace || ((uintptr_t)value & 1) || trace->generation != generation) {
+      trace = claimThread(generation);
+      if (!trace) {
+         return;
+      }
+   }
+
+   // Shutdown and capture set sPaused then wait for busy to clear, so the
+   // ring is only touched if sPaused is still clear after busy is set.
+   trace->busy = TRUE;
+   memoryBarrier();
+   if (sPaused || sGeneration != generation) {
+      trace->busy = FALSE;
+      return;
+   }
+
+   // Only the owning thread writes to its ring
+   event = &trace->events[trace->writeIndex & (sEventsPerThread - 1)];
+   event->name = zone->name;
+   event->begin = zone->begin;
+   event->end = OSGetSystemTick();
+   event->core = OSGetCoreId();
+   memoryBarrier();
+   trace->writeIndex = trace->writeIndex + 1;
+   trace->busy = FALSE;
+}
+
+uint32_t
+WHBTraceGetDroppedThreads()
+{
+   return sDroppedThreads;
+}
+
+static void
+outputFlush(TraceOutput *output)
+{
+   if (output->size && !output->error) {
+      output->error = !output->write(output, output->buffer, output->size);
+   }
+
+   output->size = 0;
+}
+
+static void
+outputString(TraceOutput *output,
+             const char *str,
+             int length)
+{
+   if (length < 0) {
+      return;
+   } else if (length >= LINE_SIZE) {
+      length = LINE_SIZE - 1;
+   }
+
+   if (output->size + length > OUTPUT_BUFFER_SIZE) {
+      outputFlush(output);
+   }
+
+   memcpy(output->buffer + output->size, str, length);
+   output->size += length;
+}
+
+static uint32_t
+escapeName(char *dst,
+           uint32_t size,
+           const char *name)
+{
+   uint32_t length = 0;
+
+   while (*name && length + 2 < size) {
+      if (*name == '"' || *name == '\\') {
+         dst[length++] = '\\';
+      }
+
+      if ((uint8_t)*name >= 0x20) {
+         dst[length++] = *name;
+      }
+
+      name++;
+   }
+
+   dst[length] = 0;
+   return length;
+}
+
+static BOOL
+writeTrace(TraceOutput *output)
+{
+   char line[LINE_SIZE];
+   char name[128];
+   OSTime nowTime;
+   OSTick nowTick;
+   uint64_t now;
+   uint32_t numThreads;
+   uint32_t i, j, core;
+   BOOL first = TRUE;
+   int length;
+
+   // Stop recording so the rings are not overwritten while they are read
+   sPaused = TRUE;
+   memoryBarrier();
+   waitForWriters();
+   numThreads = sNumThreads < (int32_t)sMaxThreads ? (uint32_t)sNumThreads : sMaxThreads;
+
+   // Event ticks are 32 bits, so timestamps are made relative to now
+   nowTick = OSGetSystemTick();
+   nowTime = OSGetSystemTime();
+   now = OSTicksToNanoseconds(nowTime);
+
+   output->size = 0;
+   output->error = FALSE;
+   outputString(output, "{\"traceEvents\":[\n", 17);
+
+   for (core = 0; core < NUM_CORES; ++core) {
+      length = snprintf(line, sizeof(line),
+                        "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"Core %u\"}}",
+                        first ? "" : ",\n", (unsigned)core, (unsigned)core);
+      outputString(output, line, length);
+      first = FALSE;
+
+      for (i = 0; i < numThreads; ++i) {
+         TraceThread *trace = &sThreads[i];
+         escapeName(name, sizeof(name), trace->name[0] ? trace->name : "thread");
+         length = snprintf(line, sizeof(line),
+                           ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+                           (unsigned)core, (unsigned)trace->id, name, (unsigned)trace->id);
+         outputString(output, line, length);
+      }
+   }
+
+   for (i = 0; i < numThreads; ++i) {
+      TraceThread *trace = &sThreads[i];
+      uint32_t end = trace->writeIndex;
+      uint32_t start = end > sEventsPerThread ? end - sEventsPerThread : 0;
+
+      for (j = start; j < end; ++j) {
+         TraceEvent *event = &trace->events[j & (sEventsPerThread - 1)];
+         uint64_t ts = now - OSTicksToNanoseconds((uint32_t)(nowTick - event->begin));
+         uint64_t dur = OSTicksToNanoseconds((uint32_t)(event->end - event->begin));
+
+         escapeName(name, sizeof(name), event->name);
+         length = snprintf(line, sizeof(line),
+                           ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu.%03u,\"dur\":%llu.%03u,\"pid\":%u,\"tid\":%u}",
+                           name,
+                           (unsigned long long)(ts / 1000), (unsigned)(ts % 1000),
+                           (unsigned long long)(dur / 1000), (unsigned)(dur % 1000),
+                           (unsigned)event->core, (unsigned)trace->id);
+         outputString(output, line, length);
+      }
+   }
+
+   outputString(output, "\n]}\n", 4);
+   outputFlush(output);
+
+   sPaused = FALSE;
+   return !output->error;
+}
+
+static BOOL
+writeFile(TraceOutput *output,
+          uint8_t *data,
+          uint32_t size)
+{
+   return FSWriteFile(output->client, output->cmd, data, 1, size, output->handle, 0, -1) >= 0;
+}
+
+static BOOL
+writeSocket(TraceOutput *output,
+            uint8_t *data,
+            uint32_t size)
+{
+   while (size) {
+      int sent = send(output->socket, data, size, 0);
+      if (sent <= 0) {
+         return FALSE;
+      }
+
+      data += sent;
+      size -= sent;
+   }
+
+   return TRUE;
+}
+
+BOOL
+WHBTraceCaptureToFile(const char *name)
+{
+   char path[PATH_SIZE];
+   TraceOutput output;
+   FSStatus result;
+   BOOL success;
+
+   if (!sEvents || !WHBMountSdCard()) {
+      return FALSE;
+   }
+
+   snprintf(path, sizeof(path), "%s/%s", WHBGetSdCardMountPath(), name);
+
+   result = FSAddClient(&sClient, -1);
+   if (result != FS_STATUS_OK) {
+      WHBLogPrintf("%s: FSAddClient error %d", __FUNCTION__, result);
+      return FALSE;
+   }
+
+   memset(&output, 0, sizeof(output));
+   output.write = writeFile;
+   output.buffer = sOutputBuffer;
+   output.client = &sClient;
+   output.cmd = &sCmd;
+
+   FSInitCmdBlock(&sCmd);
+   result = FSOpenFile(&sClient, &sCmd, path, "w", &output.handle, -1);
+   if (result < 0) {
+      WHBLogPrintf("%s: FSOpenFile(%s) error %d", __FUNCTION__, path, result);
+      FSDelClient(&sClient, -1);
+      return FALSE;
+   }
+
+   success = writeTrace(&output);
+   FSCloseFile(&sClient, &sCmd, output.handle, -1);
+   FSDelClient(&sClient, -1);
+   return success;
+}
+
+BOOL
+WHBTraceCaptureToSocket(uint32_t address,
+                        uint16_t port)
+{
+   struct sockaddr_in addr;
+   TraceOutput output;
+   BOOL success;
+
+   if (!sEvents) {
+      return FALSE;
+   }
+
+   WHBInitializeSocketLibrary();
+
+   memset(&output, 0, sizeof(output));
+   output.write = writeSocket;
+   output.buffer = sOutputBuffer;
+   output.socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+   if (output.socket < 0) {
+      WHBDeinitializeSocketLibrary();
+      return FALSE;
+   }
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+   addr.sin_addr.s_addr = htonl(address);
+
+   if (connect(output.socket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      WHBLogPrintf("%s: connect error %d", __FUNCTION__, socketlasterr());
+      socketclose(output.socket);
+      WHBDeinitializeSocketLibrary();
+      return FALSE;
+   }
+
+   success = writeTrace(&output);
+   shutdown(output.socket, SHUT_WR);
+   socketclose(output.socket);
+   WHBDeinitializeSocketLibrary();
+   return success;
+}
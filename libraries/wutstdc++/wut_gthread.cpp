@@ -31,6 +31,8 @@ typedef int (* __gthread_fn_cond_timedwait) (__gthread_cond_t *__cond, __gthread
 typedef int (* __gthread_fn_cond_wait_recursive) (__gthread_cond_t *__cond, __gthread_recursive_mutex_t *__mutex);
 typedef int (* __gthread_fn_cond_destroy) (__gthread_cond_t* __cond);
 
+extern "C" BOOL __wut_thread_use_fast_mutex __attribute__((weak));
+
 int
 __wut_active_p()
 {
@@ -70,4 +72,20 @@ __init_wut_gthread()
    __gthread_impl.cond_timedwait = (__gthread_fn_cond_timedwait)__wut_cond_timedwait;
    __gthread_impl.cond_wait_recursive = (__gthread_fn_cond_wait_recursive)__wut_cond_wait_recursive;
    __gthread_impl.cond_destroy = (__gthread_fn_cond_destroy)__wut_cond_destroy;
+
+   if (&__wut_thread_use_fast_mutex && __wut_thread_use_fast_mutex) {
+      __gthread_impl.mutex_init_function = (__gthread_fn_mutex_init_function)__wut_fast_mutex_init_function;
+      __gthread_impl.mutex_destroy = (__gthread_fn_mutex_destroy)__wut_fast_mutex_destroy;
+      __gthread_impl.mutex_lock = (__gthread_fn_mutex_lock)__wut_fast_mutex_lock;
+      __gthread_impl.mutex_trylock = (__gthread_fn_mutex_trylock)__wut_fast_mutex_trylock;
+      __gthread_impl.mutex_unlock = (__gthread_fn_mutex_unlock)__wut_fast_mutex_unlock;
+      __gthread_impl.cond_init_function = (__gthread_fn_cond_init_function)__wut_fast_cond_init_function;
+      __gthread_impl.cond_broadcast = (__gthread_fn_cond_broadcast)__wut_fast_cond_broadcast;
+      __gthread_impl.cond_signal = (__gthread_fn_cond_signal)__wut_fast_cond_signal;
+      __gthread_impl.cond_wait = (__gthread_fn_cond_wait)__wut_fast_cond_wait;
+      __gthread_impl.cond_timedwait = (__gthread_fn_cond_timedwait)__wut_fast_cond_timedwait;
+      __gthread_impl.cond_wait_recursive = (__gthread_fn_cond_wait_recursive)__wut_fast_cond_wait_recursive;
+   }
+
+   __init_wut_thread_pool();
 }
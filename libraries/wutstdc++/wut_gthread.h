@@ -3,11 +3,23 @@
 
 #include <coreinit/atomic.h>
 #include <coreinit/condition.h>
+#include <coreinit/fastcondition.h>
+#include <coreinit/fastmutex.h>
 #include <coreinit/thread.h>
 #include <coreinit/mutex.h>
+#include <coreinit/time.h>
+#include <wut_thread.h>
+
+#include "../wutnewlib/wut_clock.h"
 
 #define __WUT_MAX_KEYS (128)
-#define __WUT_STACK_SIZE (4096*1024)
+#define __WUT_FAST_KEYS (32)
+#define __WUT_KEY_DESTRUCTOR_ITERATIONS (4)
+
+#define __WUT_THREAD_POOL_DEFAULT_MAX_COUNT (4)
+#define __WUT_THREAD_POOL_DEFAULT_MAX_BYTES (16*1024*1024)
+
+#define __WUT_FAST_MUTEX_SPIN_COUNT (32)
 
 #define __WUT_ONCE_VALUE_INIT (0)
 #define __WUT_ONCE_VALUE_STARTED (1)
@@ -20,6 +32,25 @@ typedef struct {
    uint32_t index;
 } __wut_key_t;
 
+// Per-thread key values, the first __WUT_FAST_KEYS are stored inline and the
+// remainder are only allocated once a thread sets one of them.
+typedef struct {
+   const void *fast[__WUT_FAST_KEYS];
+   const void **slow;
+   bool allocated;
+
+   // Set by WUTSetNextThreadAttributes for the next thread this one creates.
+   WUTThreadAttributes nextAttributes;
+   bool hasNextAttributes;
+} __wut_thread_keys;
+
+// Every gthread is allocated as a single block so its key table comes for
+// free with the OSThread, thread must remain the first member.
+typedef struct {
+   OSThread thread;
+   __wut_thread_keys keys;
+} __wut_thread_block;
+
 void
 __init_wut_gthread();
 
@@ -31,6 +62,19 @@ __wut_thread_create(OSThread **outThread,
                     void *(*func) (void*),
                     void *args);
 
+void
+__init_wut_thread_pool();
+
+BOOL
+__wut_thread_pool_acquire(uint32_t stackSize,
+                          OSThread **outThread,
+                          void **outStack);
+
+void
+__wut_thread_pool_release(OSThread *thread,
+                          void *stack,
+                          uint32_t stackSize);
+
 int
 __wut_thread_join(OSThread * thread,
                   void **outValue);
@@ -52,9 +96,16 @@ int
 __wut_once(__wut_once_t *once,
            void (*func) (void));
 
+void
+__wut_key_init(OSThread *thread,
+               __wut_thread_keys *keys);
+
 void
 __wut_key_cleanup(OSThread *thread);
 
+__wut_thread_keys *
+__wut_get_thread_keys();
+
 int
 __wut_key_create(__wut_key_t *key,
                  void (*dtor) (void *));
@@ -112,6 +163,9 @@ int
 __wut_cond_wait(OSCondition *cond,
                 OSMutex *mutex);
 
+OSTime
+__wut_timeout_remaining_ticks(const __gthread_time_t *abs_timeout);
+
 int
 __wut_cond_timedwait(OSCondition *cond,
                      OSMutex *mutex,
@@ -123,3 +177,40 @@ __wut_cond_wait_recursive(OSCondition *cond,
 
 int
 __wut_cond_destroy(OSCondition* cond);
+
+void
+__wut_fast_mutex_init_function(OSFastMutex *mutex);
+
+int
+__wut_fast_mutex_destroy(OSFastMutex *mutex);
+
+int
+__wut_fast_mutex_lock(OSFastMutex *mutex);
+
+int
+__wut_fast_mutex_trylock(OSFastMutex *mutex);
+
+int
+__wut_fast_mutex_unlock(OSFastMutex *mutex);
+
+void
+__wut_fast_cond_init_function(OSFastCondition *cond);
+
+int
+__wut_fast_cond_broadcast(OSFastCondition *cond);
+
+int
+__wut_fast_cond_signal(OSFastCondition *cond);
+
+int
+__wut_fast_cond_wait(OSFastCondition *cond,
+                     OSFastMutex *mutex);
+
+int
+__wut_fast_cond_timedwait(OSFastCondition *cond,
+                          OSFastMutex *mutex,
+                          const __gthread_time_t *abs_timeout);
+
+int
+__wut_fast_cond_wait_recursive(OSFastCondition *cond,
+                               OSMutex *mutex);
@@ -3,9 +3,9 @@
 #include <sys/errno.h>
 
 #include <coreinit/alarm.h>
+#include <coreinit/interrupts.h>
 #include <coreinit/systeminfo.h>
 #include <coreinit/time.h>
-#include <chrono>
 
 void
 __wut_cond_init_function(OSCondition *cond)
@@ -38,7 +38,7 @@ __wut_cond_wait(OSCondition *cond,
 struct __wut_cond_timedwait_data_t
 {
    OSCondition *cond;
-   bool timed_out;
+   volatile bool timed_out;
 };
 
 static void
@@ -50,6 +50,17 @@ __wut_cond_timedwait_alarm_callback(OSAlarm *alarm,
    OSSignalCond(data->cond);
 }
 
+OSTime
+__wut_timeout_remaining_ticks(const __gthread_time_t *abs_timeout)
+{
+   // __gthread_time_t is a CLOCK_REALTIME deadline, which is OSGetTime moved
+   // from the Wii U epoch to the Unix epoch.
+   OSTime deadline =
+      OSSecondsToTicks((int64_t)abs_timeout->tv_sec - (int64_t)EPOCH_DIFF_SECS) +
+      OSNanosecondsToTicks(abs_timeout->tv_nsec);
+   return deadline - OSGetTime();
+}
+
 int
 __wut_cond_timedwait(OSCondition *cond, OSMutex *mutex,
                      const __gthread_time_t *abs_timeout)
@@ -58,28 +69,23 @@ __wut_cond_timedwait(OSCondition *cond, OSMutex *mutex,
    data.timed_out = false;
    data.cond = cond;
 
-   auto time = std::chrono::system_clock::now();
-   auto timeout = std::chrono::system_clock::time_point(
-      std::chrono::seconds(abs_timeout->tv_sec) +
-      std::chrono::nanoseconds(abs_timeout->tv_nsec));
+   OSTime timeout = __wut_timeout_remaining_ticks(abs_timeout);
 
    // Already timed out!
-   if (timeout <= time) {
+   if (timeout <= 0) {
       return ETIMEDOUT;
    }
 
-   auto duration =
-      std::chrono::duration_cast<std::chrono::nanoseconds>(timeout - time);
-
-   // Set an alarm
    OSAlarm alarm;
    OSCreateAlarm(&alarm);
    OSSetAlarmUserData(&alarm, &data);
-   OSSetAlarm(&alarm, OSNanosecondsToTicks(duration.count()),
-              &__wut_cond_timedwait_alarm_callback);
 
-   // Wait on the condition
+   // Keep interrupts disabled until we are asleep on the condition, otherwise
+   // a short alarm could signal it before we start waiting and be lost.
+   BOOL enabled = OSDisableInterrupts();
+   OSSetAlarm(&alarm, timeout, &__wut_cond_timedwait_alarm_callback);
    OSWaitCond(cond, mutex);
+   OSRestoreInterrupts(enabled);
 
    OSCancelAlarm(&alarm);
    return data.timed_out ? ETIMEDOUT : 0;
@@ -0,0 +1,148 @@
+#include "wut_gthread.h"
+
+#include <sys/errno.h>
+
+#include <coreinit/alarm.h>
+#include <coreinit/interrupts.h>
+#include <coreinit/systeminfo.h>
+#include <coreinit/time.h>
+
+/*
+ * Alternative std::mutex and std::condition_variable implementation built on
+ * OSFastMutex and OSFastCondition, enabled with __wut_thread_use_fast_mutex.
+ *
+ * OSFastMutex takes an atomic compare-and-swap fast path in user space and only
+ * enters the scheduler when contended. __gthread_mutex_t only has room for a
+ * single OSMutex sized object, and the condition variable wait must release
+ * the same object it sleeps on, so there is no separate lock word here: lock
+ * spins on the OSFastMutex try path for a short while before blocking.
+ */
+
+static_assert(sizeof(OSFastMutex) <= sizeof(OSMutex),
+              "OSFastMutex must fit in __gthread_mutex_t");
+static_assert(sizeof(OSFastCondition) <= sizeof(OSCondition),
+              "OSFastCondition must fit in __gthread_cond_t");
+
+void
+__wut_fast_mutex_init_function(OSFastMutex *mutex)
+{
+   OSFastMutex_Init(mutex, NULL);
+}
+
+int
+__wut_fast_mutex_lock(OSFastMutex *mutex)
+{
+   for (int i = 0; i < __WUT_FAST_MUTEX_SPIN_COUNT; ++i) {
+      if (OSFastMutex_TryLock(mutex)) {
+         return 0;
+      }
+   }
+
+   OSFastMutex_Lock(mutex);
+   return 0;
+}
+
+int
+__wut_fast_mutex_trylock(OSFastMutex *mutex)
+{
+   if (!OSFastMutex_TryLock(mutex)) {
+      return -1;
+   }
+
+   return 0;
+}
+
+int
+__wut_fast_mutex_unlock(OSFastMutex *mutex)
+{
+   OSFastMutex_Unlock(mutex);
+   return 0;
+}
+
+int
+__wut_fast_mutex_destroy(OSFastMutex *mutex)
+{
+   return 0;
+}
+
+void
+__wut_fast_cond_init_function(OSFastCondition *cond)
+{
+   OSFastCond_Init(cond, NULL);
+}
+
+int
+__wut_fast_cond_broadcast(OSFastCondition *cond)
+{
+   OSFastCond_Signal(cond);
+   return 0;
+}
+
+int
+__wut_fast_cond_signal(OSFastCondition *cond)
+{
+   OSFastCond_Signal(cond);
+   return 0;
+}
+
+int
+__wut_fast_cond_wait(OSFastCondition *cond,
+                     OSFastMutex *mutex)
+{
+   OSFastCond_Wait(cond, mutex);
+   return 0;
+}
+
+struct __wut_fast_cond_timedwait_data_t
+{
+   OSFastCondition *cond;
+   volatile bool timed_out;
+};
+
+static void
+__wut_fast_cond_timedwait_alarm_callback(OSAlarm *alarm,
+                                         OSContext *context)
+{
+   __wut_fast_cond_timedwait_data_t *data = (__wut_fast_cond_timedwait_data_t *)OSGetAlarmUserData(alarm);
+   data->timed_out = true;
+   OSFastCond_Signal(data->cond);
+}
+
+int
+__wut_fast_cond_timedwait(OSFastCondition *cond,
+                          OSFastMutex *mutex,
+                          const __gthread_time_t *abs_timeout)
+{
+   __wut_fast_cond_timedwait_data_t data;
+   data.timed_out = false;
+   data.cond = cond;
+
+   OSTime timeout = __wut_timeout_remaining_ticks(abs_timeout);
+
+   // Already timed out!
+   if (timeout <= 0) {
+      return ETIMEDOUT;
+   }
+
+   OSAlarm alarm;
+   OSCreateAlarm(&alarm);
+   OSSetAlarmUserData(&alarm, &data);
+
+   // See __wut_cond_timedwait
+   BOOL enabled = OSDisableInterrupts();
+   OSSetAlarm(&alarm, timeout, &__wut_fast_cond_timedwait_alarm_callback);
+   OSFastCond_Wait(cond, mutex);
+   OSRestoreInterrupts(enabled);
+
+   OSCancelAlarm(&alarm);
+   return data.timed_out ? ETIMEDOUT : 0;
+}
+
+int
+__wut_fast_cond_wait_recursive(OSFastCondition *cond,
+                               OSMutex *mutex)
+{
+   // An OSFastCondition can only be waited on with an OSFastMutex, and
+   // libstdc++ never waits on a condition with a recursive mutex.
+   return EINVAL;
+}
@@ -49,24 +49,40 @@ __wut_key_create(__wut_key_t *key,
 int
 __wut_key_delete(__wut_key_t key)
 {
+   if (key.index >= __WUT_MAX_KEYS) {
+      return EINVAL;
+   }
+
    __wut_mutex_lock(&key_mutex);
    key_table[key.index].in_use = 0;
    key_table[key.index].dtor = NULL;
    __wut_mutex_unlock(&key_mutex);
-   return -1;
+   return 0;
 }
 
-static const void **
+void
+__wut_key_init(OSThread *thread,
+               __wut_thread_keys *keys)
+{
+   // OSSetThreadSpecific only works on the current thread, so set the new
+   // thread's slot directly before it starts running.
+   thread->specific[__WUT_KEY_THREAD_SPECIFIC_ID] = keys;
+}
+
+__wut_thread_keys *
 __wut_get_thread_keys()
 {
-   const void **keys = (const void **)OSGetThreadSpecific(__WUT_KEY_THREAD_SPECIFIC_ID);
+   __wut_thread_keys *keys = (__wut_thread_keys *)OSGetThreadSpecific(__WUT_KEY_THREAD_SPECIFIC_ID);
    if (!keys) {
-      keys = (const void **)malloc(sizeof(void *) * sizeof(__WUT_MAX_KEYS));
+      // Threads not created by gthread, such as the main thread, do not have
+      // a key table allocated with them.
+      keys = (__wut_thread_keys *)malloc(sizeof(__wut_thread_keys));
       if (!keys) {
          return NULL;
       }
 
-      memset(keys, 0, sizeof(void *) * sizeof(__WUT_MAX_KEYS));
+      memset(keys, 0, sizeof(__wut_thread_keys));
+      keys->allocated = true;
       OSSetThreadSpecific(__WUT_KEY_THREAD_SPECIFIC_ID, keys);
    }
 
@@ -76,43 +92,117 @@ __wut_get_thread_keys()
 void *
 __wut_getspecific(__wut_key_t key)
 {
-   const void **keys = __wut_get_thread_keys();
+   __wut_thread_keys *keys = (__wut_thread_keys *)OSGetThreadSpecific(__WUT_KEY_THREAD_SPECIFIC_ID);
    if (!keys) {
       return NULL;
    }
 
-   return (void *)(keys[key.index]);
+   if (key.index < __WUT_FAST_KEYS) {
+      return (void *)(keys->fast[key.index]);
+   }
+
+   if (!keys->slow || key.index >= __WUT_MAX_KEYS) {
+      return NULL;
+   }
+
+   return (void *)(keys->slow[key.index - __WUT_FAST_KEYS]);
 }
 
 int
 __wut_setspecific(__wut_key_t key,
                   const void *ptr)
 {
-   const void **keys = __wut_get_thread_keys();
+   __wut_thread_keys *keys = __wut_get_thread_keys();
    if (!keys) {
-      return -1;
+      return ENOMEM;
+   }
+
+   if (key.index < __WUT_FAST_KEYS) {
+      keys->fast[key.index] = ptr;
+      return 0;
    }
 
-   keys[key.index] = ptr;
+   if (key.index >= __WUT_MAX_KEYS) {
+      return EINVAL;
+   }
+
+   if (!keys->slow) {
+      if (!ptr) {
+         return 0;
+      }
+
+      uint32_t size = sizeof(void *) * (__WUT_MAX_KEYS - __WUT_FAST_KEYS);
+      keys->slow = (const void **)malloc(size);
+      if (!keys->slow) {
+         return ENOMEM;
+      }
+
+      memset(keys->slow, 0, size);
+   }
+
+   keys->slow[key.index - __WUT_FAST_KEYS] = ptr;
    return 0;
 }
 
+static inline const void **
+__wut_key_slot(__wut_thread_keys *keys,
+               uint32_t index)
+{
+   if (index < __WUT_FAST_KEYS) {
+      return &keys->fast[index];
+   }
+
+   if (!keys->slow) {
+      return NULL;
+   }
+
+   return &keys->slow[index - __WUT_FAST_KEYS];
+}
+
 void
 __wut_key_cleanup(OSThread *thread)
 {
-   void **keys = (void **)OSGetThreadSpecific(__WUT_KEY_THREAD_SPECIFIC_ID);
+   __wut_thread_keys *keys = (__wut_thread_keys *)OSGetThreadSpecific(__WUT_KEY_THREAD_SPECIFIC_ID);
    if (!keys) {
       return;
    }
 
-   __wut_mutex_lock(&key_mutex);
+   // As with POSIX, clear each value before calling its destructor and repeat
+   // while destructors keep setting new values, up to a fixed number of passes.
+   // The key mutex is not held across destructor calls as they may themselves
+   // use thread keys.
+   for (int pass = 0; pass < __WUT_KEY_DESTRUCTOR_ITERATIONS; ++pass) {
+      bool called = false;
+
+      for (uint32_t i = 0; i < __WUT_MAX_KEYS; ++i) {
+         const void **slot = __wut_key_slot(keys, i);
+         if (!slot || !*slot) {
+            continue;
+         }
+
+         __wut_mutex_lock(&key_mutex);
+         void (*dtor) (void *) = key_table[i].in_use ? key_table[i].dtor : NULL;
+         __wut_mutex_unlock(&key_mutex);
+
+         void *value = (void *)*slot;
+         *slot = NULL;
+
+         if (dtor) {
+            dtor(value);
+            called = true;
+         }
+      }
 
-   for (int i = 0; i < __WUT_MAX_KEYS; ++i) {
-      if (key_table[i].in_use && key_table[i].dtor && keys[i]) {
-         key_table[i].dtor(keys[i]);
+      if (!called) {
+         break;
       }
    }
 
-   __wut_mutex_unlock(&key_mutex);
-   free(keys);
+   free(keys->slow);
+   keys->slow = NULL;
+
+   if (keys->allocated) {
+      OSSetThreadSpecific(__WUT_KEY_THREAD_SPECIFIC_ID, NULL);
+      free(keys);
+   }
 }
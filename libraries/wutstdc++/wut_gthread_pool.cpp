@@ -0,0 +1,122 @@
+#include "wut_gthread.h"
+
+#include <coreinit/spinlock.h>
+#include <malloc.h>
+
+/*
+ * Exited threads are kept in a free list for reuse by the next thread which
+ * needs the same stack size. The list node lives inside the dead thread block, so
+ * releasing a thread to the pool never allocates. The deallocator may run in
+ * any context, so the list is only protected by an uninterruptible spinlock
+ * and all freeing is deferred to __wut_thread_pool_acquire / WUTTrimThreadPool.
+ */
+struct __wut_thread_pool_entry
+{
+   __wut_thread_pool_entry *next;
+   void *stack;
+   uint32_t stackSize;
+};
+static_assert(sizeof(__wut_thread_pool_entry) <= sizeof(__wut_thread_block),
+              "pool entry must fit inside a thread block");
+
+static OSSpinLock pool_lock;
+static __wut_thread_pool_entry *pool_head = NULL;
+static uint32_t pool_count = 0;
+static uint32_t pool_bytes = 0;
+static uint32_t pool_max_count = __WUT_THREAD_POOL_DEFAULT_MAX_COUNT;
+static uint32_t pool_max_bytes = __WUT_THREAD_POOL_DEFAULT_MAX_BYTES;
+
+void
+__init_wut_thread_pool()
+{
+   OSInitSpinLock(&pool_lock);
+}
+
+static void
+__wut_thread_pool_trim(uint32_t maxCount,
+                       uint32_t maxBytes)
+{
+   __wut_thread_pool_entry *freeList = NULL;
+
+   OSUninterruptibleSpinLock_Acquire(&pool_lock);
+   while (pool_head && (pool_count > maxCount || pool_bytes > maxBytes)) {
+      __wut_thread_pool_entry *entry = pool_head;
+      pool_head = entry->next;
+      pool_count--;
+      pool_bytes -= entry->stackSize;
+
+      entry->next = freeList;
+      freeList = entry;
+   }
+   OSUninterruptibleSpinLock_Release(&pool_lock);
+
+   while (freeList) {
+      __wut_thread_pool_entry *entry = freeList;
+      freeList = entry->next;
+      free(entry->stack);
+      free(entry);
+   }
+}
+
+BOOL
+__wut_thread_pool_acquire(uint32_t stackSize,
+                          OSThread **outThread,
+                          void **outStack)
+{
+   __wut_thread_pool_entry *entry = NULL;
+   __wut_thread_pool_entry **link;
+
+   OSUninterruptibleSpinLock_Acquire(&pool_lock);
+   for (link = &pool_head; *link; link = &(*link)->next) {
+      if ((*link)->stackSize == stackSize) {
+         entry = *link;
+         *link = entry->next;
+         pool_count--;
+         pool_bytes -= entry->stackSize;
+         break;
+      }
+   }
+   OSUninterruptibleSpinLock_Release(&pool_lock);
+
+   // Lazily release anything pushed over the limit since the last trim
+   __wut_thread_pool_trim(pool_max_count, pool_max_bytes);
+
+   if (!entry) {
+      return FALSE;
+   }
+
+   *outStack = entry->stack;
+   *outThread = (OSThread *)entry;
+   return TRUE;
+}
+
+void
+__wut_thread_pool_release(OSThread *thread,
+                          void *stack,
+                          uint32_t stackSize)
+{
+   __wut_thread_pool_entry *entry = (__wut_thread_pool_entry *)thread;
+   entry->stack = stack;
+   entry->stackSize = stackSize;
+
+   OSUninterruptibleSpinLock_Acquire(&pool_lock);
+   entry->next = pool_head;
+   pool_head = entry;
+   pool_count++;
+   pool_bytes += stackSize;
+   OSUninterruptibleSpinLock_Release(&pool_lock);
+}
+
+void
+WUTSetThreadPoolLimit(uint32_t maxThreads,
+                      uint32_t maxBytes)
+{
+   pool_max_count = maxThreads;
+   pool_max_bytes = maxBytes;
+}
+
+void
+WUTTrimThreadPool()
+{
+   __wut_thread_pool_trim(0, 0);
+}
@@ -4,12 +4,89 @@
 #include <string.h>
 #include <sys/errno.h>
 
+static WUTThreadAttributes
+__wut_thread_default_attributes = {
+   WUT_THREAD_DEFAULT_STACK_SIZE,
+   WUT_THREAD_DEFAULT_PRIORITY,
+   OS_THREAD_ATTRIB_AFFINITY_ANY,
+   NULL,
+};
+
+static BOOL
+__wut_thread_attributes_valid(const WUTThreadAttributes *attribs)
+{
+   if (!attribs) {
+      return FALSE;
+   }
+
+   if (attribs->stackSize < WUT_THREAD_MIN_STACK_SIZE ||
+       attribs->stackSize > WUT_THREAD_MAX_STACK_SIZE) {
+      return FALSE;
+   }
+
+   if (attribs->priority < 0 || attribs->priority > 31) {
+      return FALSE;
+   }
+
+   if (!(attribs->attributes & OS_THREAD_ATTRIB_AFFINITY_ANY)) {
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
+void
+WUTGetDefaultThreadAttributes(WUTThreadAttributes *attribs)
+{
+   *attribs = __wut_thread_default_attributes;
+}
+
+BOOL
+WUTSetDefaultThreadAttributes(const WUTThreadAttributes *attribs)
+{
+   if (!__wut_thread_attributes_valid(attribs)) {
+      return FALSE;
+   }
+
+   __wut_thread_default_attributes = *attribs;
+   return TRUE;
+}
+
+BOOL
+WUTSetNextThreadAttributes(const WUTThreadAttributes *attribs)
+{
+   if (attribs && !__wut_thread_attributes_valid(attribs)) {
+      return FALSE;
+   }
+
+   // Pending attributes live in the wut owned key table in specific slot 0,
+   // so the application's thread specific slots are left alone.
+   if (!attribs) {
+      __wut_thread_keys *keys =
+         (__wut_thread_keys *)OSGetThreadSpecific(__WUT_KEY_THREAD_SPECIFIC_ID);
+      if (keys) {
+         keys->hasNextAttributes = false;
+      }
+
+      return TRUE;
+   }
+
+   __wut_thread_keys *keys = __wut_get_thread_keys();
+   if (!keys) {
+      return FALSE;
+   }
+
+   keys->nextAttributes = *attribs;
+   keys->hasNextAttributes = true;
+   return TRUE;
+}
+
 static void
 __wut_thread_deallocator(OSThread *thread,
                          void *stack)
 {
-   free(thread);
-   free(stack);
+   uint32_t stackSize = (uint32_t)thread->stackStart - (uint32_t)stack;
+   __wut_thread_pool_release(thread, stack, stackSize);
 }
 
 static void
@@ -23,23 +100,50 @@ __wut_thread_create(OSThread **outThread,
                     void *(*entryPoint) (void*),
                     void *entryArgs)
 {
-   OSThread *thread = (OSThread *)memalign(16, sizeof(OSThread));
-   char *stack = (char *)memalign(16, __WUT_STACK_SIZE);
-   memset(thread, 0, sizeof(OSThread));
+   WUTThreadAttributes attribs = __wut_thread_default_attributes;
+   __wut_thread_keys *keys =
+      (__wut_thread_keys *)OSGetThreadSpecific(__WUT_KEY_THREAD_SPECIFIC_ID);
+   if (keys && keys->hasNextAttributes) {
+      attribs = keys->nextAttributes;
+      keys->hasNextAttributes = false;
+   }
+
+   // Keep the stack top 16 byte aligned
+   uint32_t stackSize = (attribs.stackSize + 15) & ~15u;
+   OSThread *thread = NULL;
+   char *stack = NULL;
+   if (!__wut_thread_pool_acquire(stackSize, &thread, (void **)&stack)) {
+      thread = (OSThread *)memalign(16, sizeof(__wut_thread_block));
+      stack = (char *)memalign(16, stackSize);
+      if (!thread || !stack) {
+         free(thread);
+         free(stack);
+         return EAGAIN;
+      }
+   }
 
+   __wut_thread_block *block = (__wut_thread_block *)thread;
+   memset(block, 0, sizeof(__wut_thread_block));
+
+   // std::thread always joins or detaches explicitly, so never start detached
    if (!OSCreateThread(thread,
                        (OSThreadEntryPointFn)entryPoint,
                        (int)entryArgs,
                        NULL,
-                       stack + __WUT_STACK_SIZE,
-                       __WUT_STACK_SIZE,
-                       16,
-                       OS_THREAD_ATTRIB_AFFINITY_ANY)) {
-      free(thread);
-      free(stack);
+                       stack + stackSize,
+                       stackSize,
+                       attribs.priority,
+                       attribs.attributes & ~OS_THREAD_ATTRIB_DETACHED)) {
+      __wut_thread_pool_release(thread, stack, stackSize);
       return EINVAL;
    }
 
+   __wut_key_init(thread, &block->keys);
+
+   if (attribs.name) {
+      OSSetThreadName(thread, attribs.name);
+   }
+
    *outThread = thread;
    OSSetThreadDeallocator(thread, &__wut_thread_deallocator);
    OSSetThreadCleanupCallback(thread, &__wut_thread_cleanup);
@@ -0,0 +1,126 @@
+#include <coreinit/fastmutex.h>
+#include <coreinit/mutex.h>
+#include <coreinit/thread.h>
+#include <coreinit/time.h>
+
+#include <whb/proc.h>
+#include <whb/log.h>
+#include <whb/log_console.h>
+
+#include <wut_thread.h>
+
+#include <mutex>
+#include <thread>
+
+// The std::mutex backend is chosen at link time, so each build only measures
+// one of them. CMakeLists.txt builds this file twice: mutex_benchmark.rpx uses
+// OSMutex and mutex_benchmark_fast.rpx defines MUTEX_BENCHMARK_FAST_MUTEX to
+// use OSFastMutex. Run both to compare.
+#ifdef MUTEX_BENCHMARK_FAST_MUTEX
+extern "C" BOOL __wut_thread_use_fast_mutex = TRUE;
+static const char *StdMutexBackend = "OSFastMutex";
+#else
+static const char *StdMutexBackend = "OSMutex";
+#endif
+
+static const int NumIterations = 200000;
+
+static std::mutex sStdMutex;
+static OSMutex sMutex;
+static OSFastMutex sFastMutex;
+static volatile uint32_t sCounter;
+
+static void
+stdMutexWorker()
+{
+   for (int i = 0; i < NumIterations; ++i) {
+      std::lock_guard<std::mutex> lock(sStdMutex);
+      sCounter++;
+   }
+}
+
+static void
+mutexWorker()
+{
+   for (int i = 0; i < NumIterations; ++i) {
+      OSLockMutex(&sMutex);
+      sCounter++;
+      OSUnlockMutex(&sMutex);
+   }
+}
+
+static void
+fastMutexWorker()
+{
+   for (int i = 0; i < NumIterations; ++i) {
+      OSFastMutex_Lock(&sFastMutex);
+      sCounter++;
+      OSFastMutex_Unlock(&sFastMutex);
+   }
+}
+
+static void
+runBenchmark(const char *name,
+             void (*worker)(),
+             int numThreads)
+{
+   static const char *threadNames[] = { "Core0", "Core1", "Core2" };
+   std::thread threads[3];
+   WUTThreadAttributes attribs;
+   OSTime start, end;
+
+   sCounter = 0;
+   start = OSGetSystemTime();
+
+   // One worker pinned to each core
+   for (int i = 0; i < numThreads; ++i) {
+      WUTGetDefaultThreadAttributes(&attribs);
+      attribs.stackSize = 16 * 1024;
+      attribs.attributes = (OSThreadAttributes)(OS_THREAD_ATTRIB_AFFINITY_CPU0 << i);
+      attribs.name = threadNames[i];
+      WUTSetNextThreadAttributes(&attribs);
+      threads[i] = std::thread(worker);
+   }
+
+   for (int i = 0; i < numThreads; ++i) {
+      threads[i].join();
+   }
+
+   end = OSGetSystemTime();
+
+   uint64_t ns = OSTicksToNanoseconds(end - start);
+   uint64_t ops = (uint64_t)NumIterations * numThreads;
+   WHBLogPrintf("%-12s %d thread(s): %6llu us, %4llu ns/lock, counter %s",
+                name, numThreads, ns / 1000, ns / ops,
+                sCounter == ops ? "ok" : "BAD");
+   WHBLogConsoleDraw();
+}
+
+int
+main(int argc, char **argv)
+{
+   WHBProcInit();
+   WHBLogConsoleInit();
+
+   WHBLogPrintf("std::mutex backed by %s", StdMutexBackend);
+
+   OSInitMutex(&sMutex);
+   OSFastMutex_Init(&sFastMutex, "Benchmark");
+
+   for (int numThreads = 1; numThreads <= 3; ++numThreads) {
+      runBenchmark("std::mutex", &stdMutexWorker, numThreads);
+      runBenchmark("OSMutex", &mutexWorker, numThreads);
+      runBenchmark("OSFastMutex", &fastMutexWorker, numThreads);
+   }
+
+   WHBLogPrintf("Done.");
+
+   while (WHBProcIsRunning()) {
+      WHBLogConsoleDraw();
+      OSSleepTicks(OSMillisecondsToTicks(100));
+   }
+
+   WHBLogConsoleFree();
+   WHBProcShutdown();
+   return 0;
+}
@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+"""Decode a libwhb binary log (see whb/log_binary.h) back into text.
+
+Usage: whb_binlog_decode.py app.elf log.bin
+
+The stream is a WHBBinLogStreamHeader followed by records as returned by
+WHBBinLogRead. Format strings are looked up in the .elf the application
+was built from, relative to the __whb_binlog_format_base symbol.
+"""
+
+import re
+import struct
+import sys
+
+MAGIC = 0x57424C47
+RECORD = struct.Struct('>IIBBH')
+HEADER = struct.Struct('>IIII')
+BASE_SYMBOL = b'__whb_binlog_format_base'
+
+CONVERSION = re.compile(r'%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d*))?([hlLjztq]*)([a-zA-Z%])')
+
+
+class Elf:
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            self.data = f.read()
+        if self.data[:4] != b'\x7fELF' or self.data[4] != 1 or self.data[5] != 2:
+            raise ValueError('expected a 32 bit big endian ELF')
+
+        shoff, = struct.unpack_from('>I', self.data, 0x20)
+        shentsize, shnum, shstrndx = struct.unpack_from('>HHH', self.data, 0x2E)
+        self.sections = []
+        for i in range(shnum):
+            (name, type_, flags, addr, offset, size,
+             link, info, align, entsize) = struct.unpack_from('>10I', self.data, shoff + i * shentsize)
+            self.sections.append((name, type_, addr, offset, size, link, entsize))
+
+    def read_cstring(self, offset):
+        end = self.data.index(b'\0', offset)
+        return self.data[offset:end]
+
+    def symbol(self, wanted):
+        for name, type_, addr, offset, size, link, entsize in self.sections:
+            if type_ != 2:  # SHT_SYMTAB
+                continue
+            strtab = self.sections[link][3]
+            for pos in range(offset, offset + size, entsize):
+                st_name, st_value = struct.unpack_from('>II', self.data, pos)
+                if self.read_cstring(strtab + st_name) == wanted:
+                    return st_value
+        raise KeyError(wanted.decode())
+
+    def string_at(self, address):
+        for name, type_, addr, offset, size, link, entsize in self.sections:
+            if type_ == 1 and addr <= address < addr + size:  # SHT_PROGBITS
+                return self.read_cstring(offset + address - addr).decode('utf-8', 'replace')
+        return None
+
+
+def format_record(fmt, words):
+    out = []
+    pos = 0
+    index = 0
+
+    def take(count=1):
+        nonlocal index
+        values = words[index:index + count]
+        index += count
+        if len(values) < count:
+            raise IndexError
+        return values
+
+    def take_int(signed, wide):
+        if wide:
+            hi, lo = take(2)
+            value = (hi << 32) | lo
+            if signed and value & (1 << 63):
+                value -= 1 << 64
+        else:
+            value, = take()
+            if signed and value & (1 << 31):
+                value -= 1 << 32
+        return value
+
+    for m in CONVERSION.finditer(fmt):
+        out.append(fmt[pos:m.start()])
+        pos = m.end()
+        flags, width, precision, length, conv = m.groups()
+        if conv == '%':
+            out.append('%')
+            continue
+
+        try:
+            if width == '*':
+                width = str(take_int(True, False))
+            if precision == '*':
+                precision = str(take_int(True, False))
+            spec = '%' + flags + (width or '') + ('.' + precision if precision is not None else '')
+            wide = length in ('ll', 'L', 'q', 'j')
+
+            if conv in 'fFeEgGaA':
+                hi, lo = take(2)
+                value, = struct.unpack('>d', struct.pack('>II', hi, lo))
+                if conv in 'aA':
+                    out.append(value.hex())
+                else:
+                    out.append((spec + conv) % value)
+            elif conv == 's':
+                length_bytes, = take()
+                chunk = take((length_bytes + 3) // 4)
+                raw = b''.join(struct.pack('>I', w) for w in chunk)[:length_bytes]
+                out.append((spec + 's') % raw.decode('utf-8', 'replace'))
+            elif conv in 'di':
+                out.append((spec + 'd') % take_int(True, wide))
+            elif conv in 'uxXo':
+                out.append((spec + conv.replace('u', 'd')) % take_int(False, wide))
+            elif conv == 'c':
+                out.append((spec + 'c') % chr(take_int(False, False) & 0xFF))
+            elif conv == 'p':
+                out.append('0x%08x' % take_int(False, False))
+            else:
+                take()
+                out.append(m.group(0))
+        except IndexError:
+            out.append('<missing>')
+
+    out.append(fmt[pos:])
+    return ''.join(out)
+
+
+def decode(elf, stream, output):
+    base = elf.symbol(BASE_SYMBOL)
+    tick_rate = None
+    offset = 0
+
+    if len(stream) >= HEADER.size:
+        magic, version, rate, runtime_base = HEADER.unpack_from(stream, 0)
+        if magic == MAGIC:
+            tick_rate = rate
+            offset = HEADER.size
+
+    while offset + RECORD.size <= len(stream):
+        format_id, tick, core, flags, num_words = RECORD.unpack_from(stream, offset)
+        offset += RECORD.size
+        words = list(struct.unpack_from('>%dI' % num_words, stream, offset))
+        offset += num_words * 4
+
+        if format_id & 0x80000000:
+            format_id -= 1 << 32
+        fmt = elf.string_at(base + format_id)
+        text = format_record(fmt, words) if fmt is not None else '<unknown format 0x%08x>' % format_id
+
+        if tick_rate:
+            stamp = '%12.6f' % (tick / tick_rate)
+        else:
+            stamp = '%10u' % tick
+        output.write('[%s core %d] %s' % (stamp, core, text.rstrip('\n') + '\n'))
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.stderr.write(__doc__)
+        return 1
+
+    elf = Elf(sys.argv[1])
+    with open(sys.argv[2], 'rb') as f:
+        stream = f.read()
+
+    decode(elf, stream, sys.stdout)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
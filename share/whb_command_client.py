@@ -0,0 +1,142 @@
+#!/usr/bin/env python3
+"""Send commands to a libwhb command server (see whb/commandserver.h).
+
+Usage: whb_command_client.py HOST COMMAND [PAYLOAD] [--port PORT] [--wait SECONDS]
+       whb_command_client.py --selftest
+
+COMMAND is the numeric command id, PAYLOAD is sent as UTF-8. Any frames the
+console sends back within --wait seconds are printed.
+
+--selftest only checks this client's framing against reference_server, a
+Python copy of the console's server, over loopback. It does not run
+libwhb's commandserver.c, so use a real console to test the C server.
+"""
+
+import argparse
+import select
+import socket
+import struct
+import sys
+import threading
+
+DEFAULT_PORT = 4406
+MAX_PAYLOAD = 1024
+
+
+def encode_frame(command, payload):
+    return struct.pack('>II', len(payload) + 4, command) + payload
+
+
+class FrameReader:
+    def __init__(self):
+        self.buffer = b''
+
+    def feed(self, data):
+        """Return every complete (command, payload) frame received so far."""
+        self.buffer += data
+        frames = []
+        while len(self.buffer) >= 8:
+            size, command = struct.unpack_from('>II', self.buffer, 0)
+            if size < 4 or size - 4 > MAX_PAYLOAD:
+                raise ValueError('invalid frame size %d' % size)
+            if len(self.buffer) < size + 4:
+                break
+            frames.append((command, self.buffer[8:size + 4]))
+            self.buffer = self.buffer[size + 4:]
+        return frames
+
+
+def receive_frames(sock, wait):
+    reader = FrameReader()
+    frames = []
+    while True:
+        ready, _, _ = select.select([sock], [], [], wait)
+        if not ready:
+            break
+        data = sock.recv(4096)
+        if not data:
+            break
+        frames += reader.feed(data)
+    return frames
+
+
+def reference_server(listener, handlers, stop):
+    """Python copy of the console server's framing and dispatch, for --selftest."""
+    clients = {}
+    while not stop.is_set():
+        ready, _, _ = select.select([listener] + list(clients), [], [], 0.1)
+        for sock in ready:
+            if sock is listener:
+                client, _ = listener.accept()
+                clients[client] = FrameReader()
+                continue
+            data = sock.recv(4096)
+            if not data:
+                del clients[sock]
+                sock.close()
+                continue
+            for command, payload in clients[sock].feed(data):
+                handler = handlers.get(command)
+                if handler:
+                    sock.sendall(encode_frame(command, handler(payload)))
+    for sock in clients:
+        sock.close()
+
+
+def selftest():
+    listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    listener.bind(('127.0.0.1', 0))
+    listener.listen(8)
+    stop = threading.Event()
+    handlers = {1: lambda p: p.upper(), 2: lambda p: struct.pack('>I', len(p))}
+    server = threading.Thread(target=reference_server, args=(listener, handlers, stop))
+    server.start()
+
+    ok = True
+    try:
+        clients = [socket.create_connection(listener.getsockname()) for _ in range(3)]
+        for i, sock in enumerate(clients):
+            # Split the frames across writes to exercise reassembly
+            data = encode_frame(1, b'hello %d' % i) + encode_frame(2, b'x' * (100 + i)) + encode_frame(99, b'ignored')
+            sock.sendall(data[:5])
+            sock.sendall(data[5:])
+        for i, sock in enumerate(clients):
+            frames = receive_frames(sock, 0.5)
+            expected = [(1, b'HELLO %d' % i), (2, struct.pack('>I', 100 + i))]
+            print('client %d: %r' % (i, frames))
+            ok = ok and frames == expected
+            sock.close()
+    finally:
+        stop.set()
+        server.join()
+        listener.close()
+
+    print('selftest', 'passed' if ok else 'FAILED')
+    return 0 if ok else 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Send commands to a libwhb command server.')
+    parser.add_argument('host', nargs='?')
+    parser.add_argument('command', nargs='?', type=int)
+    parser.add_argument('payload', nargs='?', default='')
+    parser.add_argument('--port', type=int, default=DEFAULT_PORT)
+    parser.add_argument('--wait', type=float, default=1.0)
+    parser.add_argument('--selftest', action='store_true')
+    args = parser.parse_args()
+
+    if args.selftest:
+        return selftest()
+
+    if args.host is None or args.command is None:
+        parser.error('HOST and COMMAND are required')
+
+    with socket.create_connection((args.host, args.port)) as sock:
+        sock.sendall(encode_frame(args.command, args.payload.encode('utf-8')))
+        for command, payload in receive_frames(sock, args.wait):
+            print('%d: %r' % (command, payload))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,343 @@
+#!/usr/bin/env python3
+"""Receive and symbolize libwhb crash minidumps (see whb/crash.h).
+
+Usage: whb_minidump.py receive [--port PORT] [--output DIR]
+       whb_minidump.py show DUMP [--elf app.elf] [--addr2line TOOL]
+       whb_minidump.py --selftest
+
+receive waits for dumps sent over UDP and saves each one as it completes.
+show prints the registers, a stack trace for every thread, memory ranges
+and the recent log. With --elf addresses are symbolized against the .elf
+the application was built from, relocated using the run time address of
+WHBInitCrashHandler, and with --addr2line (e.g. powerpc-eabi-addr2line)
+file and line numbers are added.
+"""
+
+import argparse
+import os
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+
+DEFAULT_PORT = 4408
+MAGIC = 0x57444D50
+CHUNK_MAGIC = 0x57444D43
+VERSION = 1
+ANCHOR_SYMBOL = b'WHBInitCrashHandler'
+
+HEADER = struct.Struct('>IIIIQIIII')
+SECTION = struct.Struct('>HHI')
+CONTEXT = struct.Struct('>32I9I8II32Q32Q')
+THREAD = struct.Struct('>IIIIIIiBBHI32s')
+CHUNK = struct.Struct('>IIII')
+
+SECTION_CONTEXT = 1
+SECTION_THREAD = 2
+SECTION_MEMORY = 3
+SECTION_LOG = 4
+
+EXCEPTIONS = {2: 'DSI', 3: 'ISI', 5: 'ALIGNMENT', 6: 'PROGRAM'}
+MAX_FRAMES = 32
+
+
+class Elf:
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            self.data = f.read()
+        if self.data[:4] != b'\x7fELF' or self.data[4] != 1 or self.data[5] != 2:
+            raise ValueError('expected a 32 bit big endian ELF')
+
+        shoff, = struct.unpack_from('>I', self.data, 0x20)
+        shentsize, shnum, shstrndx = struct.unpack_from('>HHH', self.data, 0x2E)
+        self.functions = []
+        for i in range(shnum):
+            (name, type_, flags, addr, offset, size,
+             link, info, align, entsize) = struct.unpack_from('>10I', self.data, shoff + i * shentsize)
+            if type_ != 2:  # SHT_SYMTAB
+                continue
+            strtab, = struct.unpack_from('>I', self.data, shoff + link * shentsize + 0x10)
+            for pos in range(offset, offset + size, entsize):
+                st_name, st_value, st_size, st_info = struct.unpack_from('>IIIB', self.data, pos)
+                if st_info & 0xF == 2:  # STT_FUNC
+                    self.functions.append((st_value, st_size, self.read_cstring(strtab + st_name)))
+        self.functions.sort()
+
+    def read_cstring(self, offset):
+        end = self.data.index(b'\0', offset)
+        return self.data[offset:end]
+
+    def symbol(self, wanted):
+        for value, size, name in self.functions:
+            if name == wanted:
+                return value
+        raise KeyError(wanted.decode())
+
+    def lookup(self, address):
+        lo, hi = 0, len(self.functions)
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if self.functions[mid][0] <= address:
+                lo = mid + 1
+            else:
+                hi = mid
+        if lo == 0:
+            return None
+        value, size, name = self.functions[lo - 1]
+        if size and address >= value + size:
+            return None
+        return '%s+0x%x' % (name.decode('utf-8', 'replace'), address - value)
+
+
+class Symbolizer:
+    def __init__(self, elf_path, addr2line, anchor):
+        self.elf = Elf(elf_path) if elf_path else None
+        self.addr2line = addr2line if elf_path else None
+        self.elf_path = elf_path
+        self.delta = 0
+        if self.elf:
+            self.delta = anchor - self.elf.symbol(ANCHOR_SYMBOL)
+
+    def __call__(self, address):
+        if not self.elf:
+            return ''
+        link_address = (address - self.delta) & 0xFFFFFFFF
+        name = self.elf.lookup(link_address)
+        if not name:
+            return ''
+        if self.addr2line:
+            out = subprocess.run([self.addr2line, '-e', self.elf_path, '%x' % link_address],
+                                 stdout=subprocess.PIPE, universal_newlines=True).stdout.strip()
+            if out and not out.startswith('??'):
+                name += ' (%s)' % out
+        return ' ' + name
+
+
+class Minidump:
+    def __init__(self, data):
+        (magic, version, size, self.exception, self.time, self.core,
+         self.upid, self.anchor, count) = HEADER.unpack_from(data, 0)
+        if magic != MAGIC or version != VERSION:
+            raise ValueError('not a version %d minidump' % VERSION)
+        if size > len(data):
+            raise ValueError('truncated minidump, %d of %d bytes' % (len(data), size))
+
+        self.context = None
+        self.threads = []
+        self.ranges = []
+        self.log = b''
+
+        pos = HEADER.size
+        for _ in range(count):
+            type_, flags, length = SECTION.unpack_from(data, pos)
+            body = data[pos + SECTION.size:pos + SECTION.size + length]
+            pos += SECTION.size + ((length + 3) & ~3)
+
+            if type_ == SECTION_CONTEXT:
+                self.context = CONTEXT.unpack_from(body, 0)
+            elif type_ == SECTION_THREAD:
+                fields = THREAD.unpack_from(body, 0)
+                stack = body[THREAD.size:THREAD.size + fields[10]]
+                self.threads.append((fields, stack))
+            elif type_ == SECTION_MEMORY:
+                address, = struct.unpack_from('>I', body, 0)
+                self.ranges.append((address, body[4:]))
+            elif type_ == SECTION_LOG:
+                self.log = body
+
+    def crashed_thread(self):
+        return self.context[32 + 9 + 8] if self.context else None
+
+
+def stack_trace(sp, lr, stack):
+    """Follow the back chain through the captured stack bytes."""
+    frames = [lr]
+    base = sp
+    for _ in range(MAX_FRAMES):
+        offset = sp - base
+        if offset < 0 or offset + 8 > len(stack):
+            break
+        sp, saved_lr = struct.unpack_from('>II', stack, offset)
+        if saved_lr:
+            frames.append(saved_lr)
+        if not sp or sp == 0xFFFFFFFF:
+            break
+    return frames
+
+
+def hexdump(address, data):
+    lines = []
+    for i in range(0, len(data), 16):
+        row = data[i:i + 16]
+        text = ''.join(chr(c) if 32 <= c < 127 else '.' for c in row)
+        lines.append('  %08x: %-48s %s' % (address + i, ' '.join('%02x' % c for c in row), text))
+    return lines
+
+
+def show(dump, symbolize):
+    out = []
+    out.append('%s exception on core %d, process %d' % (
+        EXCEPTIONS.get(dump.exception, 'type %d' % dump.exception), dump.core, dump.upid))
+
+    if dump.context:
+        c = dump.context
+        gpr = c[:32]
+        cr, lr, ctr, xer, srr0, srr1, dsisr, dar, fpscr = c[32:41]
+        out.append('')
+        out.append('SRR0  = 0x%08X%s' % (srr0, symbolize(srr0)))
+        out.append('LR    = 0x%08X%s' % (lr, symbolize(lr)))
+        out.append('CTR   = 0x%08X  CR = 0x%08X  XER = 0x%08X' % (ctr, cr, xer))
+        out.append('SRR1  = 0x%08X  DSISR = 0x%08X  DAR = 0x%08X  FPSCR = 0x%08X' % (srr1, dsisr, dar, fpscr))
+        for i in range(16):
+            out.append('r%-2d   = 0x%08X  r%-2d   = 0x%08X' % (i, gpr[i], i + 16, gpr[i + 16]))
+
+    crashed = dump.crashed_thread()
+    for fields, stack in dump.threads:
+        thread, stack_start, stack_end, sp, lr, pc, priority, state, attr, id_, size, name = fields
+        name = name.split(b'\0', 1)[0].decode('utf-8', 'replace')
+        out.append('')
+        out.append('Thread 0x%08X "%s" id %d priority %d state %d%s' % (
+            thread, name, id_, priority, state, ' (crashed)' if thread == crashed else ''))
+        out.append('  pc 0x%08X%s' % (pc, symbolize(pc)))
+        for address in stack_trace(sp, lr, stack):
+            out.append('  lr 0x%08X%s' % (address, symbolize(address)))
+
+    for address, data in dump.ranges:
+        out.append('')
+        out.append('Memory 0x%08X, %d bytes' % (address, len(data)))
+        out += hexdump(address, data)
+
+    if dump.log:
+        out.append('')
+        out.append('Recent log:')
+        out += ['  ' + line for line in dump.log.decode('utf-8', 'replace').splitlines()]
+
+    return '\n'.join(out)
+
+
+class Reassembler:
+    def __init__(self):
+        self.dumps = {}
+
+    def feed(self, packet):
+        """Returns the complete dump once every chunk has arrived."""
+        if len(packet) < CHUNK.size:
+            return None
+        magic, id_, offset, total = CHUNK.unpack_from(packet, 0)
+        if magic != CHUNK_MAGIC:
+            return None
+        data, received = self.dumps.setdefault(id_, (bytearray(total), {}))
+        payload = packet[CHUNK.size:]
+        data[offset:offset + len(payload)] = payload
+        received[offset] = len(payload)
+        if sum(received.values()) >= total:
+            del self.dumps[id_]
+            return id_, bytes(data)
+        return None
+
+
+def receive(args):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(('', args.port))
+    reassembler = Reassembler()
+    print('Waiting for minidumps on port %d' % args.port)
+    try:
+        while True:
+            packet, addr = sock.recvfrom(65536)
+            result = reassembler.feed(packet)
+            if result:
+                id_, data = result
+                path = os.path.join(args.output, 'whb_minidump_%08X.dmp' % id_)
+                with open(path, 'wb') as f:
+                    f.write(data)
+                print('Received %d bytes from %s, saved to %s' % (len(data), addr[0], path))
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+def build_test_dump():
+    """A dump with a crashed thread whose stack holds a two frame back chain."""
+    sp = 0x10001000
+    stack = struct.pack('>II', sp + 0x20, 0) + b'\0' * 0x18 + \
+            struct.pack('>II', sp + 0x40, 0x02000120) + b'\0' * 0x18 + \
+            struct.pack('>II', 0, 0x02000230)
+    context = list(range(32)) + [0, 0x02000010, 0, 0, 0x02000004, 0, 0, 0xDEAD, 0] + \
+        [0] * 8 + [0xAAAA0000] + [0] * 64
+    context[1] = sp
+
+    thread = THREAD.pack(0xAAAA0000, sp + 0x100, sp - 0x1000, sp, 0x02000010, 0x02000004,
+                         16, 2, 0, 1, len(stack), b'main')
+    sections = [
+        (SECTION_CONTEXT, CONTEXT.pack(*context)),
+        (SECTION_THREAD, thread + stack),
+        (SECTION_MEMORY, struct.pack('>I', 0x10002000) + b'hello minidump'),
+        (SECTION_LOG, b'first line\nlast line before crash\n'),
+    ]
+
+    body = b''
+    for type_, data in sections:
+        body += SECTION.pack(type_, 0, len(data)) + data + b'\0' * (-len(data) & 3)
+    size = HEADER.size + len(body)
+    return HEADER.pack(MAGIC, VERSION, size, 2, 0x12345678, 1, 2, 0x02000000, len(sections)) + body
+
+
+def selftest():
+    data = build_test_dump()
+    dump = Minidump(data)
+    symbols = {0x02000004: ' crash+0x4', 0x02000010: ' crash+0x10',
+               0x02000120: ' caller+0x20', 0x02000230: ' main+0x30'}
+    text = show(dump, lambda address: symbols.get(address, ''))
+    print(text)
+
+    # Split into chunks, deliver them out of order and reassemble
+    reassembler = Reassembler()
+    chunks = [CHUNK.pack(CHUNK_MAGIC, 1, offset, len(data)) + data[offset:offset + 64]
+              for offset in range(0, len(data), 64)]
+    result = None
+    for chunk in reversed(chunks):
+        result = reassembler.feed(chunk) or result
+
+    ok = ('DSI exception' in text and
+          'lr 0x02000120 caller+0x20' in text and
+          'lr 0x02000230 main+0x30' in text and
+          '(crashed)' in text and
+          'hello minidump' in text and
+          'last line before crash' in text and
+          result == (1, data))
+    print('selftest', 'passed' if ok else 'FAILED')
+    return 0 if ok else 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Receive and symbolize libwhb minidumps.')
+    parser.add_argument('--selftest', action='store_true')
+    commands = parser.add_subparsers(dest='command')
+
+    receive_parser = commands.add_parser('receive')
+    receive_parser.add_argument('--port', type=int, default=DEFAULT_PORT)
+    receive_parser.add_argument('--output', default='.')
+
+    show_parser = commands.add_parser('show')
+    show_parser.add_argument('dump')
+    show_parser.add_argument('--elf')
+    show_parser.add_argument('--addr2line', default=shutil.which('powerpc-eabi-addr2line'))
+
+    args = parser.parse_args()
+    if args.selftest:
+        return selftest()
+    if args.command == 'receive':
+        return receive(args)
+    if args.command == 'show':
+        with open(args.dump, 'rb') as f:
+            dump = Minidump(f.read())
+        print(show(dump, Symbolizer(args.elf, args.addr2line, dump.anchor)))
+        return 0
+    parser.print_help()
+    return 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
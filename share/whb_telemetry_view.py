@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+"""View libwhb telemetry (see whb/telemetry.h).
+
+Usage: whb_telemetry_view.py HOST [--port PORT] [--every N]
+
+Connects to the console and prints the current value of every metric each
+N frames. Values are deltas for counters, last value for gauges and
+microseconds per frame for timers.
+"""
+
+import argparse
+import socket
+import struct
+import sys
+
+DEFAULT_PORT = 4407
+MSG_METRIC = 1
+MSG_FRAME = 2
+TYPES = {0: 'counter', 1: 'gauge', 2: 'timer'}
+
+
+def read_exact(sock, size):
+    data = b''
+    while len(data) < size:
+        chunk = sock.recv(size - len(data))
+        if not chunk:
+            raise EOFError
+        data += chunk
+    return data
+
+
+def main():
+    parser = argparse.ArgumentParser(description='View libwhb telemetry.')
+    parser.add_argument('host')
+    parser.add_argument('--port', type=int, default=DEFAULT_PORT)
+    parser.add_argument('--every', type=int, default=60)
+    args = parser.parse_args()
+
+    names = {}
+    types = {}
+    values = {}
+    last_frame = None
+
+    with socket.create_connection((args.host, args.port)) as sock:
+        try:
+            while True:
+                kind, size = struct.unpack('>HH', read_exact(sock, 4))
+                body = read_exact(sock, size)
+
+                if kind == MSG_METRIC:
+                    metric, type_, length = struct.unpack_from('>HBB', body, 0)
+                    names[metric] = body[4:4 + length].decode('utf-8', 'replace')
+                    types[metric] = TYPES.get(type_, '?')
+                    values.setdefault(metric, 0)
+                elif kind == MSG_FRAME:
+                    frame, tick, count = struct.unpack_from('>IIH', body, 0)
+                    for i in range(count):
+                        metric, value = struct.unpack_from('>Hi', body, 10 + i * 6)
+                        values[metric] = value
+
+                    if last_frame is not None and frame != last_frame + 1:
+                        print('-- %d frame(s) dropped' % (frame - last_frame - 1))
+                    last_frame = frame
+
+                    if frame % args.every == 0:
+                        print('frame %d' % frame)
+                        for metric in sorted(names):
+                            print('  %-32s %-8s %d' % (names[metric], types[metric], values[metric]))
+                        sys.stdout.flush()
+        except (EOFError, KeyboardInterrupt):
+            pass
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+"""Receive libwhb UDP logs (see whb/log_udp.h).
+
+Usage: whb_udplog_receive.py [--port PORT] [--bind ADDRESS]
+       whb_udplog_receive.py --selftest
+
+Prints each message with its console tick and core, and reports datagrams
+which were lost or arrived out of order. --selftest sends a few datagrams
+over loopback, including a gap and a reordering, and checks they decode.
+"""
+
+import argparse
+import socket
+import struct
+import sys
+
+MAGIC = 0x574C4F47
+DEFAULT_PORT = 4405
+PACKET = struct.Struct('>IIHH')
+MESSAGE = struct.Struct('>IBBH')
+
+
+class Receiver:
+    def __init__(self, output):
+        self.output = output
+        self.expected = None
+        self.lost = 0
+        self.reordered = 0
+
+    def datagram(self, data, source):
+        if len(data) < PACKET.size:
+            return
+        magic, sequence, count, size = PACKET.unpack_from(data, 0)
+        if magic != MAGIC:
+            return
+
+        if self.expected is not None and sequence != self.expected:
+            delta = (sequence - self.expected) & 0xFFFFFFFF
+            if delta < 0x80000000:
+                self.lost += delta
+                self.output.write('-- %s: %d datagram(s) lost before #%d\n' % (source, delta, sequence))
+            else:
+                # A late datagram we previously counted as lost
+                self.lost -= 1
+                self.reordered += 1
+                self.output.write('-- %s: datagram #%d arrived out of order\n' % (source, sequence))
+        if self.expected is None or ((sequence - self.expected) & 0xFFFFFFFF) < 0x80000000:
+            self.expected = (sequence + 1) & 0xFFFFFFFF
+
+        offset = PACKET.size
+        end = min(size, len(data))
+        for _ in range(count):
+            if offset + MESSAGE.size > end:
+                break
+            tick, core, flags, length = MESSAGE.unpack_from(data, offset)
+            offset += MESSAGE.size
+            text = data[offset:offset + length].decode('utf-8', 'replace')
+            offset += length
+            self.output.write('[%10u core %d] %s' % (tick, core, text if text.endswith('\n') else text + '\n'))
+        self.output.flush()
+
+
+def build_datagram(sequence, messages):
+    body = b''.join(MESSAGE.pack(tick, core, 0, len(text)) + text for tick, core, text in messages)
+    return PACKET.pack(MAGIC, sequence, len(messages), PACKET.size + len(body)) + body
+
+
+def selftest():
+    import io
+
+    rx = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    rx.bind(('127.0.0.1', 0))
+    rx.settimeout(2)
+    tx = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    target = rx.getsockname()
+
+    for sequence in (0, 1, 3, 2):
+        tx.sendto(build_datagram(sequence, [(100 + sequence, sequence % 3, b'message %d\n' % sequence),
+                                            (200 + sequence, 1, b'second')]), target)
+
+    output = io.StringIO()
+    receiver = Receiver(output)
+    for _ in range(4):
+        data, source = rx.recvfrom(65536)
+        receiver.datagram(data, '%s:%d' % source)
+
+    text = output.getvalue()
+    sys.stdout.write(text)
+    ok = (text.count('message') == 4 and text.count('second') == 4 and
+          receiver.lost == 0 and receiver.reordered == 1)
+    print('selftest', 'passed' if ok else 'FAILED')
+    return 0 if ok else 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Receive libwhb UDP logs.')
+    parser.add_argument('--port', type=int, default=DEFAULT_PORT)
+    parser.add_argument('--bind', default='0.0.0.0')
+    parser.add_argument('--selftest', action='store_true')
+    args = parser.parse_args()
+
+    if args.selftest:
+        return selftest()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind((args.bind, args.port))
+
+    receiver = Receiver(sys.stdout)
+    try:
+        while True:
+            data, source = sock.recvfrom(65536)
+            receiver.datagram(data, '%s:%d' % source)
+    except KeyboardInterrupt:
+        pass
+
+    sys.stderr.write('%d datagram(s) lost, %d reordered\n' % (receiver.lost, receiver.reordered))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
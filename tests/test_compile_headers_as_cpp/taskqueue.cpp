@@ -0,0 +1,3 @@
+// Compiled on its own, as the full header list in main.cpp would hide an
+// include missing from coreinit/taskqueue.h.
+#include <whb/taskqueue_cpp.h>
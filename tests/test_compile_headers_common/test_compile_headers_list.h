@@ -20,6 +20,7 @@
 #include <coreinit/filesystem.h>
 #include <coreinit/foreground.h>
 #include <coreinit/internal.h>
+#include <coreinit/interrupts.h>
 #include <coreinit/ios.h>
 #include <coreinit/mcp.h>
 #include <coreinit/memblockheap.h>
@@ -90,6 +91,8 @@
 #include <sysapp/launch.h>
 #include <sysapp/switch.h>
 #include <vpad/input.h>
+#include <whb/taskqueue_cpp.h>
 #include <wut.h>
 #include <wut_structsize.h>
+#include <wut_thread.h>
 #include <wut_types.h>
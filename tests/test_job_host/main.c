@@ -0,0 +1,222 @@
+/*
+ * Host tests for the libwhb job system, built against the pthread shim in
+ * shim/. job.c is included directly so its deque can be tested on its own.
+ */
+#include "../../libraries/libwhb/src/job.c"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECK(expr) \
+   do { \
+      if (!(expr)) { \
+         printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #expr); \
+         exit(1); \
+      } \
+   } while (0)
+
+#define STEAL_JOBS      100000
+#define STEAL_THIEVES   3
+#define RANGE_SIZE      100003
+#define CONTINUATION_ITERATIONS 2000
+
+static JobDeque
+sDeque;
+
+static WHBJob
+sStealJobs[STEAL_JOBS];
+
+static volatile int32_t
+sStealCounts[STEAL_JOBS];
+
+static volatile int32_t
+sStealDone = 0;
+
+static void
+testDequeOrder()
+{
+   static WHBJob jobs[WHB_JOB_DEQUE_SIZE + 1];
+   int i;
+
+   memset(&sDeque, 0, sizeof(sDeque));
+   CHECK(dequePop(&sDeque) == NULL);
+   CHECK(dequeSteal(&sDeque) == NULL);
+
+   for (i = 0; i < WHB_JOB_DEQUE_SIZE; ++i) {
+      CHECK(dequePush(&sDeque, &jobs[i]));
+   }
+
+   // Full, the submitter runs the job itself instead
+   CHECK(!dequePush(&sDeque, &jobs[WHB_JOB_DEQUE_SIZE]));
+
+   // Owner pops newest first, thieves take oldest first
+   CHECK(dequePop(&sDeque) == &jobs[WHB_JOB_DEQUE_SIZE - 1]);
+   CHECK(dequeSteal(&sDeque) == &jobs[0]);
+   CHECK(dequeSteal(&sDeque) == &jobs[1]);
+
+   for (i = WHB_JOB_DEQUE_SIZE - 2; i >= 2; --i) {
+      CHECK(dequePop(&sDeque) == &jobs[i]);
+   }
+
+   CHECK(dequePop(&sDeque) == NULL);
+   CHECK(dequeSteal(&sDeque) == NULL);
+}
+
+static void
+markStolen(WHBJob *job)
+{
+   OSAddAtomic(&sStealCounts[job - sStealJobs], 1);
+}
+
+static void *
+thiefMain(void *arg)
+{
+   WHBJob *job;
+
+   while (!sStealDone) {
+      job = dequeSteal(&sDeque);
+      if (job) {
+         markStolen(job);
+      }
+   }
+
+   return NULL;
+}
+
+static void
+testDequeSteal()
+{
+   pthread_t thieves[STEAL_THIEVES];
+   WHBJob *job;
+   int i, next = 0;
+
+   memset(&sDeque, 0, sizeof(sDeque));
+
+   for (i = 0; i < STEAL_THIEVES; ++i) {
+      CHECK(pthread_create(&thieves[i], NULL, thiefMain, NULL) == 0);
+   }
+
+   // The owner pushes bursts and pops some back while thieves steal, every
+   // job must be taken exactly once.
+   while (next < STEAL_JOBS) {
+      for (i = 0; i < 16 && next < STEAL_JOBS; ++i, ++next) {
+         if (!dequePush(&sDeque, &sStealJobs[next])) {
+            markStolen(&sStealJobs[next]);
+         }
+      }
+
+      for (i = 0; i < 8; ++i) {
+         job = dequePop(&sDeque);
+         if (job) {
+            markStolen(job);
+         }
+      }
+   }
+
+   while ((job = dequePop(&sDeque))) {
+      markStolen(job);
+   }
+
+   sStealDone = 1;
+   for (i = 0; i < STEAL_THIEVES; ++i) {
+      pthread_join(thieves[i], NULL);
+   }
+
+   for (i = 0; i < STEAL_JOBS; ++i) {
+      CHECK(sStealCounts[i] == 1);
+   }
+}
+
+static volatile int32_t
+sRangeCounts[RANGE_SIZE];
+
+static void
+rangeFn(uint32_t begin,
+        uint32_t end,
+        void *arg)
+{
+   uint32_t i;
+
+   for (i = begin; i < end; ++i) {
+      OSAddAtomic(&sRangeCounts[i], 1);
+   }
+}
+
+static void
+testParallelFor()
+{
+   uint32_t i;
+
+   memset((void *)sRangeCounts, 0, sizeof(sRangeCounts));
+   WHBJobParallelFor(0, RANGE_SIZE, 100, rangeFn, NULL);
+
+   for (i = 0; i < RANGE_SIZE; ++i) {
+      CHECK(sRangeCounts[i] == 1);
+   }
+
+   // Empty and single chunk ranges run inline
+   WHBJobParallelFor(5, 5, 1, rangeFn, NULL);
+   WHBJobParallelFor(0, 3, 100, rangeFn, NULL);
+   CHECK(sRangeCounts[0] == 2 && sRangeCounts[2] == 2 && sRangeCounts[3] == 1);
+}
+
+static void
+incrementJob(void *arg)
+{
+   OSAddAtomic((volatile int32_t *)arg, 1);
+}
+
+static void
+testContinuation()
+{
+   WHBJobCounter counter, continuationCounter;
+   WHBJob jobs[4], continuation;
+   volatile int32_t ran = 0, continued = 0;
+   int i, iteration;
+
+   // Counter already at zero, the continuation is submitted straight away
+   WHBJobCounterInit(&counter);
+   WHBJobCounterInit(&continuationCounter);
+   WHBJobInit(&continuation, incrementJob, (void *)&continued);
+   WHBJobCounterSetContinuation(&counter, &continuation, &continuationCounter);
+   WHBJobWait(&continuationCounter);
+   CHECK(continued == 1);
+
+   // Jobs finishing while the continuation is being installed
+   for (iteration = 0; iteration < CONTINUATION_ITERATIONS; ++iteration) {
+      ran = 0;
+      continued = 0;
+      WHBJobCounterInit(&counter);
+      WHBJobCounterInit(&continuationCounter);
+
+      for (i = 0; i < 4; ++i) {
+         WHBJobInit(&jobs[i], incrementJob, (void *)&ran);
+      }
+
+      WHBJobRunBatch(jobs, 4, &counter);
+      WHBJobInit(&continuation, incrementJob, (void *)&continued);
+      WHBJobCounterSetContinuation(&counter, &continuation, &continuationCounter);
+
+      WHBJobWait(&continuationCounter);
+      WHBJobWait(&counter);
+      CHECK(ran == 4);
+      CHECK(continued == 1);
+   }
+}
+
+int
+main(int argc,
+     char **argv)
+{
+   testDequeOrder();
+   testDequeSteal();
+
+   CHECK(WHBJobSystemInit(16, 64 * 1024));
+   testParallelFor();
+   testContinuation();
+   WHBJobSystemShutdown();
+
+   printf("test_job_host: ok\n");
+   return 0;
+}
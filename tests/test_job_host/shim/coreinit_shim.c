@@ -0,0 +1,229 @@
+#include <wut.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <whb/log.h>
+
+static __thread OSThread *
+sCurrentThread = NULL;
+
+static OSThread
+sMainThread;
+
+int32_t
+OSAddAtomic(volatile int32_t *ptr,
+            int32_t value)
+{
+   return __atomic_fetch_add(ptr, value, __ATOMIC_SEQ_CST);
+}
+
+BOOL
+OSCompareAndSwapAtomic(volatile uint32_t *ptr,
+                       uint32_t compare,
+                       uint32_t value)
+{
+   return __atomic_compare_exchange_n(ptr, &compare, value, 0,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+void *
+MEMAllocFromDefaultHeapEx(uint32_t size,
+                          int32_t alignment)
+{
+   void *block = NULL;
+
+   if (alignment < (int32_t)sizeof(void *)) {
+      alignment = sizeof(void *);
+   }
+
+   if (posix_memalign(&block, alignment, size)) {
+      return NULL;
+   }
+
+   return block;
+}
+
+void
+MEMFreeToDefaultHeap(void *block)
+{
+   free(block);
+}
+
+void
+OSInitMutex(OSMutex *mutex)
+{
+   pthread_mutex_init(&mutex->mutex, NULL);
+}
+
+void
+OSLockMutex(OSMutex *mutex)
+{
+   pthread_mutex_lock(&mutex->mutex);
+}
+
+void
+OSUnlockMutex(OSMutex *mutex)
+{
+   pthread_mutex_unlock(&mutex->mutex);
+}
+
+void
+OSInitCond(OSCondition *condition)
+{
+   pthread_cond_init(&condition->cond, NULL);
+}
+
+void
+OSWaitCond(OSCondition *condition,
+           OSMutex *mutex)
+{
+   pthread_cond_wait(&condition->cond, &mutex->mutex);
+}
+
+void
+OSSignalCond(OSCondition *condition)
+{
+   // OSSignalCond wakes every waiting thread
+   pthread_cond_broadcast(&condition->cond);
+}
+
+void
+OSInitSpinLock(OSSpinLock *spinlock)
+{
+   pthread_mutex_init(&spinlock->mutex, NULL);
+}
+
+BOOL
+OSUninterruptibleSpinLock_Acquire(OSSpinLock *spinlock)
+{
+   pthread_mutex_lock(&spinlock->mutex);
+   return TRUE;
+}
+
+BOOL
+OSUninterruptibleSpinLock_Release(OSSpinLock *spinlock)
+{
+   pthread_mutex_unlock(&spinlock->mutex);
+   return TRUE;
+}
+
+void
+OSInitSemaphore(OSSemaphore *semaphore,
+                int32_t count)
+{
+   pthread_mutex_init(&semaphore->mutex, NULL);
+   pthread_cond_init(&semaphore->cond, NULL);
+   semaphore->count = count;
+}
+
+int32_t
+OSWaitSemaphore(OSSemaphore *semaphore)
+{
+   int32_t previous;
+
+   pthread_mutex_lock(&semaphore->mutex);
+   while (semaphore->count <= 0) {
+      pthread_cond_wait(&semaphore->cond, &semaphore->mutex);
+   }
+   previous = semaphore->count--;
+   pthread_mutex_unlock(&semaphore->mutex);
+   return previous;
+}
+
+int32_t
+OSSignalSemaphore(OSSemaphore *semaphore)
+{
+   int32_t previous;
+
+   pthread_mutex_lock(&semaphore->mutex);
+   previous = semaphore->count++;
+   pthread_cond_signal(&semaphore->cond);
+   pthread_mutex_unlock(&semaphore->mutex);
+   return previous;
+}
+
+static void *
+threadEntry(void *arg)
+{
+   OSThread *thread = (OSThread *)arg;
+   sCurrentThread = thread;
+   thread->result = thread->entry(thread->argc, thread->argv);
+   return NULL;
+}
+
+BOOL
+OSCreateThread(OSThread *thread,
+               OSThreadEntryPointFn entry,
+               int32_t argc,
+               char *argv,
+               void *stack,
+               uint32_t stackSize,
+               int32_t priority,
+               OSThreadAttributes attributes)
+{
+   thread->entry = entry;
+   thread->argc = argc;
+   thread->argv = (const char **)argv;
+   thread->result = 0;
+   return TRUE;
+}
+
+void
+OSSetThreadName(OSThread *thread,
+                const char *name)
+{
+}
+
+int32_t
+OSResumeThread(OSThread *thread)
+{
+   return pthread_create(&thread->handle, NULL, threadEntry, thread) ? 0 : 1;
+}
+
+BOOL
+OSJoinThread(OSThread *thread,
+             int *threadResult)
+{
+   if (pthread_join(thread->handle, NULL)) {
+      return FALSE;
+   }
+
+   if (threadResult) {
+      *threadResult = thread->result;
+   }
+
+   return TRUE;
+}
+
+OSThread *
+OSGetCurrentThread()
+{
+   return sCurrentThread ? sCurrentThread : &sMainThread;
+}
+
+void
+OSYieldThread()
+{
+   sched_yield();
+}
+
+OSTick
+OSGetTick()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (OSTick)(ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+BOOL
+WHBLogPrintf(const char *fmt, ...)
+{
+   va_list va;
+   va_start(va, fmt);
+   vprintf(fmt, va);
+   va_end(va);
+   printf("\n");
+   return TRUE;
+}
@@ -0,0 +1,144 @@
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Just enough of coreinit, implemented with pthreads, to run the job system
+ * on the host. Thread priority and affinity are ignored.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int64_t OSTime;
+typedef int32_t OSTick;
+
+typedef enum OSThreadAttributes
+{
+   OS_THREAD_ATTRIB_AFFINITY_CPU0   = 1 << 0,
+   OS_THREAD_ATTRIB_AFFINITY_CPU1   = 1 << 1,
+   OS_THREAD_ATTRIB_AFFINITY_CPU2   = 1 << 2,
+   OS_THREAD_ATTRIB_AFFINITY_ANY    = 7,
+} OSThreadAttributes;
+
+typedef int (*OSThreadEntryPointFn)(int argc, const char **argv);
+
+typedef struct OSThread
+{
+   pthread_t handle;
+   OSThreadEntryPointFn entry;
+   int argc;
+   const char **argv;
+   int result;
+} OSThread;
+
+typedef struct OSMutex
+{
+   pthread_mutex_t mutex;
+} OSMutex;
+
+typedef struct OSCondition
+{
+   pthread_cond_t cond;
+} OSCondition;
+
+typedef struct OSSpinLock
+{
+   pthread_mutex_t mutex;
+} OSSpinLock;
+
+typedef struct OSSemaphore
+{
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+   int32_t count;
+} OSSemaphore;
+
+int32_t
+OSAddAtomic(volatile int32_t *ptr,
+            int32_t value);
+
+BOOL
+OSCompareAndSwapAtomic(volatile uint32_t *ptr,
+                       uint32_t compare,
+                       uint32_t value);
+
+void *
+MEMAllocFromDefaultHeapEx(uint32_t size,
+                          int32_t alignment);
+
+void
+MEMFreeToDefaultHeap(void *block);
+
+void
+OSInitMutex(OSMutex *mutex);
+
+void
+OSLockMutex(OSMutex *mutex);
+
+void
+OSUnlockMutex(OSMutex *mutex);
+
+void
+OSInitCond(OSCondition *condition);
+
+void
+OSWaitCond(OSCondition *condition,
+           OSMutex *mutex);
+
+void
+OSSignalCond(OSCondition *condition);
+
+void
+OSInitSpinLock(OSSpinLock *spinlock);
+
+BOOL
+OSUninterruptibleSpinLock_Acquire(OSSpinLock *spinlock);
+
+BOOL
+OSUninterruptibleSpinLock_Release(OSSpinLock *spinlock);
+
+void
+OSInitSemaphore(OSSemaphore *semaphore,
+                int32_t count);
+
+int32_t
+OSWaitSemaphore(OSSemaphore *semaphore);
+
+int32_t
+OSSignalSemaphore(OSSemaphore *semaphore);
+
+BOOL
+OSCreateThread(OSThread *thread,
+               OSThreadEntryPointFn entry,
+               int32_t argc,
+               char *argv,
+               void *stack,
+               uint32_t stackSize,
+               int32_t priority,
+               OSThreadAttributes attributes);
+
+void
+OSSetThreadName(OSThread *thread,
+                const char *name);
+
+int32_t
+OSResumeThread(OSThread *thread);
+
+BOOL
+OSJoinThread(OSThread *thread,
+             int *threadResult);
+
+OSThread *
+OSGetCurrentThread();
+
+void
+OSYieldThread();
+
+OSTick
+OSGetTick();
+
+#ifdef __cplusplus
+}
+#endif